@@ -0,0 +1,205 @@
+/*!
+  \file blit-bench.cc
+  \brief Measures the blit kernel sets on screen-sized fills, packing, copies and conversions.
+
+  Each operation is run over a whole screen a row at a time, the way
+  SDLDisplay does it, and again in 16-pixel runs, the width of a hextile
+  or TRLE tile. Throughput is reported in MB written per second. The
+  output of each set is checksummed so a broken one can't look fast.
+*/
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+#include <sys/time.h>
+#include <zlib.h>
+#include "blit-kernels.h"
+
+using namespace std;
+
+#define BENCH_TILE_RUN  16   //!< pixels per call in the tile-sized tests
+
+//! One operation to measure.
+struct BenchTest
+{
+	char const* name;   //!< what it is
+	int op;             //!< BENCH_xxx
+	int out_bytes;      //!< bytes written per pixel
+	bool tiles;         //!< in tile-sized runs rather than whole rows
+};
+
+enum { BENCH_FILL8, BENCH_FILL16, BENCH_FILL24, BENCH_FILL32, BENCH_PACK, BENCH_COPY, BENCH_CONVERT };
+
+//! A byte swap and three channel moves, so every step of the conversion has work to do.
+static VNC::ChannelShifts const s_convert_shifts = { true, { 8, 16, 24 }, { 255, 255, 255 }, { 0, 8, 16 } };
+
+static BenchTest const s_tests[] =
+{
+	{ "fill 8-bit rows",      BENCH_FILL8,   1, false },
+	{ "fill 16-bit rows",     BENCH_FILL16,  2, false },
+	{ "fill 24-bit rows",     BENCH_FILL24,  3, false },
+	{ "fill 32-bit rows",     BENCH_FILL32,  4, false },
+	{ "pack 32 to 24 rows",   BENCH_PACK,    3, false },
+	{ "copy 32-bit rows",     BENCH_COPY,    4, false },
+	{ "convert 32-bit rows",  BENCH_CONVERT, 4, false },
+	{ "fill 16-bit tiles",    BENCH_FILL16,  2, true },
+	{ "fill 24-bit tiles",    BENCH_FILL24,  3, true },
+	{ "fill 32-bit tiles",    BENCH_FILL32,  4, true },
+	{ "pack 32 to 24 tiles",  BENCH_PACK,    3, true },
+	{ "copy 32-bit tiles",    BENCH_COPY,    4, true },
+	{ "convert 32-bit tiles", BENCH_CONVERT, 4, true },
+};
+
+/*!
+  Displays command line usage information.
+  \param path path to this executable, generally from argv[0]
+*/
+static void Usage( char const* path )
+{
+	cerr << "Usage:" << path << " [-n passes] [-s WxH] [-k kernels]..." << endl
+		 << "    -n passes        times to run each test (default: 20)" << endl
+		 << "    -s WxH           screen size (default: 1920x1080)" << endl
+		 << "    -k kernels       scalar, sse2 or avx2 (default: all this processor runs)" << endl;
+}
+
+//! Current time in seconds.
+static double Now()
+{
+	timeval tv;
+	gettimeofday( &tv, NULL );
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/*!
+  Runs a test once over the whole screen.
+  \param k kernels to use
+  \param test what to run
+  \param dst screen, 4 bytes per pixel wide whatever the depth
+  \param src 32-bit source pixels, the same size as the screen
+  \param width screen width
+  \param height screen height
+*/
+static void RunTest( VNC::BlitKernels const& k, BenchTest const& test, VNC::Uint8* dst, VNC::Uint8 const* src, int width, int height )
+{
+	int pitch = width * 4;
+	int run = test.tiles ? BENCH_TILE_RUN : width;
+	for( int y = 0; y < height; ++y )
+	{
+		VNC::Uint32 pixel = 0x00a1b2c3 + y;
+		for( int x = 0; x < width; x += run )
+		{
+			unsigned count = width - x < run ? width - x : run;
+			VNC::Uint8* out = dst + y * pitch + x * test.out_bytes;
+			VNC::Uint8 const* in = src + y * pitch + x * 4;
+			switch( test.op )
+			{
+			case BENCH_FILL8:   k.fill8( out, (VNC::Uint8)pixel, count );            break;
+			case BENCH_FILL16:  k.fill16( out, (VNC::Uint16)pixel, count );          break;
+			case BENCH_FILL24:  k.fill24( out, pixel, count );                       break;
+			case BENCH_FILL32:  k.fill32( out, pixel, count );                       break;
+			case BENCH_PACK:    k.pack32to24( out, in, count );                      break;
+			case BENCH_COPY:    k.copy( out, in, count * 4 );                        break;
+			case BENCH_CONVERT: k.convert32( out, in, count, s_convert_shifts );     break;
+			}
+		}
+	}
+}
+
+int main( int argc, char* argv[] )
+{
+	int opt_passes = 20;
+	int width = 1920;
+	int height = 1080;
+	vector< string > names;
+	int ch;
+	while( ( ch = getopt( argc, argv, "n:s:k:" ) ) != -1 )
+	{
+		switch( ch )
+		{
+		case 'n':
+			opt_passes = atoi( optarg );
+			if( opt_passes < 1 )
+			{
+				cerr << "Invalid pass count " << opt_passes << " selected." << endl;
+				return 1;
+			}
+			break;
+
+		case 's':
+			if( sscanf( optarg, "%dx%d", &width, &height ) != 2 || width < 1 || height < 1 )
+			{
+				cerr << "Invalid screen size " << optarg << " selected." << endl;
+				return 1;
+			}
+			break;
+
+		case 'k':
+			names.push_back( optarg );
+			break;
+
+		default:
+			Usage( argv[0] );
+			return 1;
+		}
+	}
+	if( optind < argc )
+	{
+		Usage( argv[0] );
+		return 1;
+	}
+	if( names.empty() )
+		VNC::ListBlitKernels( names );
+
+	try
+	{
+		vector< VNC::BlitKernels const* > sets;
+		for( unsigned i = 0; i < names.size(); ++i )
+			sets.push_back( &VNC::FindBlitKernels( names[i].c_str() ) );
+
+		size_t size = (size_t)width * height * 4;
+		vector< VNC::Uint8 > dst( size );
+		vector< VNC::Uint8 > src( size );
+		for( size_t i = 0; i < size; ++i )
+			src[i] = (VNC::Uint8)( i * 7 + ( i >> 9 ) );
+
+		cout << width << "x" << height << ", " << opt_passes << " passes" << endl;
+		for( unsigned t = 0; t < sizeof( s_tests ) / sizeof( s_tests[0] ); ++t )
+		{
+			BenchTest const& test = s_tests[t];
+			cout << test.name << endl;
+			uLong expected = 0;
+			for( unsigned s = 0; s < sets.size(); ++s )
+			{
+				// one untimed pass to check the output and warm up
+				fill( dst.begin(), dst.end(), 0 );
+				RunTest( *sets[s], test, &dst[0], &src[0], width, height );
+				uLong checksum = adler32( adler32( 0, NULL, 0 ), &dst[0], size );
+				if( s == 0 )
+					expected = checksum;
+
+				double start = Now();
+				for( int i = 0; i < opt_passes; ++i )
+					RunTest( *sets[s], test, &dst[0], &src[0], width, height );
+				double seconds = Now() - start;
+
+				double bytes = (double)width * height * test.out_bytes * opt_passes;
+				cout << "    " << setw( 12 ) << left << sets[s]->name << right
+					 << setw( 10 ) << fixed << setprecision( 1 ) << bytes / seconds / 1e6 << " MB/s";
+				if( checksum != expected )
+					cout << "  OUTPUT DIFFERS";
+				cout << endl;
+			}
+		}
+	}
+	catch( VNC::Exc const& e )
+	{
+		cerr << "Flagrant blit error: " << (char const*)e << endl;
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,253 @@
+/*!
+  \file blit-kernels-avx2.cpp
+  \brief Blit kernels using AVX2.
+
+  Only built in when this file is compiled with AVX2 enabled; see the
+  Makefile. Works the same way as the SSE2 set, with vectors twice as
+  wide, and packs 24-bit pixels with byte shuffles.
+*/
+
+#include <cstring>
+#include "blit-kernels.h"
+
+#if defined(__AVX2__)
+
+#include <immintrin.h>
+
+namespace VNC
+{
+
+	//! Fills bytes with a repeating 32-byte pattern.
+	/*!
+	  \param dst where to write
+	  \param v the pattern, whose period divides both 4 and \a bytes
+	  \param bytes number of bytes to write, at least 32
+	*/
+	static inline void FillPattern( Uint8* dst, __m256i v, unsigned bytes )
+	{
+		// one store covers the start, then the rest are aligned; crossing
+		// cache lines costs wide stores more than narrow ones
+		unsigned i = 0;
+		unsigned head = ( 32 - ( (size_t)dst & 31 ) ) & 31;
+		if( ( head & 3 ) == 0 && bytes >= head + 32 )
+		{
+			_mm256_storeu_si256( (__m256i*)dst, v );
+			i = head;
+		}
+		for( ; i + 128 <= bytes; i += 128 )
+		{
+			_mm256_storeu_si256( (__m256i*)( dst + i ), v );
+			_mm256_storeu_si256( (__m256i*)( dst + i + 32 ), v );
+			_mm256_storeu_si256( (__m256i*)( dst + i + 64 ), v );
+			_mm256_storeu_si256( (__m256i*)( dst + i + 96 ), v );
+		}
+		for( ; i + 32 <= bytes; i += 32 )
+			_mm256_storeu_si256( (__m256i*)( dst + i ), v );
+		if( i < bytes )
+			_mm256_storeu_si256( (__m256i*)( dst + bytes - 32 ), v );
+	}
+
+	static void Fill8( Uint8* dst, Uint8 pixel, unsigned count )
+	{
+		if( count < 32 )
+			memset( dst, pixel, count );
+		else
+			FillPattern( dst, _mm256_set1_epi8( (char)pixel ), count );
+	}
+
+	static void Fill16( Uint8* dst, Uint16 pixel, unsigned count )
+	{
+		if( count < 16 )
+		{
+			for( Uint8* end = dst + count * 2; dst < end; dst += 2 )
+				memcpy( dst, &pixel, 2 );
+			return;
+		}
+		FillPattern( dst, _mm256_set1_epi16( (short)pixel ), count * 2 );
+	}
+
+	static void Fill32( Uint8* dst, Uint32 pixel, unsigned count )
+	{
+		if( count < 8 )
+		{
+			for( Uint8* end = dst + count * 4; dst < end; dst += 4 )
+				memcpy( dst, &pixel, 4 );
+			return;
+		}
+		FillPattern( dst, _mm256_set1_epi32( (int)pixel ), count * 4 );
+	}
+
+	//! Makes the three words that four packed 24-bit pixels fill.
+	static inline void Make24BitWords( Uint32 pixel, Uint32 words[3] )
+	{
+		pixel &= 0x00ffffff;
+		words[0] = pixel | ( pixel << 24 );
+		words[1] = ( pixel >> 8 ) | ( pixel << 16 );
+		words[2] = ( pixel >> 16 ) | ( pixel << 8 );
+	}
+
+	static void Fill24( Uint8* dst, Uint32 pixel, unsigned count )
+	{
+		Uint32 w[3];
+		Make24BitWords( pixel, w );
+		unsigned bytes = count * 3;
+		if( bytes < 96 )
+		{
+			// sixteen pixels make three half-width vectors
+			__m128i h0 = _mm_setr_epi32( w[0], w[1], w[2], w[0] );
+			__m128i h1 = _mm_setr_epi32( w[1], w[2], w[0], w[1] );
+			__m128i h2 = _mm_setr_epi32( w[2], w[0], w[1], w[2] );
+			for( ; bytes >= 48; bytes -= 48, dst += 48 )
+			{
+				_mm_storeu_si128( (__m128i*)dst, h0 );
+				_mm_storeu_si128( (__m128i*)( dst + 16 ), h1 );
+				_mm_storeu_si128( (__m128i*)( dst + 32 ), h2 );
+			}
+			for( ; bytes >= 12; bytes -= 12, dst += 12 )
+				memcpy( dst, w, 12 );
+			memcpy( dst, w, bytes );
+			return;
+		}
+
+		// thirty-two pixels make three whole vectors
+		__m256i v0 = _mm256_setr_epi32( w[0], w[1], w[2], w[0], w[1], w[2], w[0], w[1] );
+		__m256i v1 = _mm256_setr_epi32( w[2], w[0], w[1], w[2], w[0], w[1], w[2], w[0] );
+		__m256i v2 = _mm256_setr_epi32( w[1], w[2], w[0], w[1], w[2], w[0], w[1], w[2] );
+		Uint8* end = dst + bytes;
+		unsigned i = 0;
+		unsigned head = ( 32 - ( (size_t)dst & 31 ) ) & 31;
+		if( head != 0 && bytes >= head + 96 )
+		{
+			// write the start unaligned, then carry on from the next aligned
+			// address with the vectors rotated to match
+			Uint8 pattern[192];
+			_mm256_storeu_si256( (__m256i*)pattern, v0 );
+			_mm256_storeu_si256( (__m256i*)( pattern + 32 ), v1 );
+			_mm256_storeu_si256( (__m256i*)( pattern + 64 ), v2 );
+			_mm256_storeu_si256( (__m256i*)( pattern + 96 ), v0 );
+			_mm256_storeu_si256( (__m256i*)( pattern + 128 ), v1 );
+			_mm256_storeu_si256( (__m256i*)( pattern + 160 ), v2 );
+			_mm256_storeu_si256( (__m256i*)dst, v0 );
+			dst += head;
+			bytes -= head;
+			__m256i r0 = _mm256_loadu_si256( (__m256i const*)( pattern + head ) );
+			__m256i r1 = _mm256_loadu_si256( (__m256i const*)( pattern + head + 32 ) );
+			__m256i r2 = _mm256_loadu_si256( (__m256i const*)( pattern + head + 64 ) );
+			for( ; i + 96 <= bytes; i += 96 )
+			{
+				_mm256_store_si256( (__m256i*)( dst + i ), r0 );
+				_mm256_store_si256( (__m256i*)( dst + i + 32 ), r1 );
+				_mm256_store_si256( (__m256i*)( dst + i + 64 ), r2 );
+			}
+		}
+		else
+		{
+			for( ; i + 96 <= bytes; i += 96 )
+			{
+				_mm256_storeu_si256( (__m256i*)( dst + i ), v0 );
+				_mm256_storeu_si256( (__m256i*)( dst + i + 32 ), v1 );
+				_mm256_storeu_si256( (__m256i*)( dst + i + 64 ), v2 );
+			}
+		}
+		if( i < bytes )
+		{
+			// the whole run is a multiple of 3 bytes, so the unrotated
+			// pattern is in step at its end
+			Uint8* last = end - 96;
+			_mm256_storeu_si256( (__m256i*)last, v0 );
+			_mm256_storeu_si256( (__m256i*)( last + 32 ), v1 );
+			_mm256_storeu_si256( (__m256i*)( last + 64 ), v2 );
+		}
+	}
+
+	static void Pack32to24( Uint8* dst, Uint8 const* src, unsigned count )
+	{
+		// each half packs its four pixels into its low 12 bytes...
+		__m256i shuffle = _mm256_setr_epi8( 0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+											0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1 );
+		// ...then the halves are joined into the low 24 bytes
+		__m256i join = _mm256_setr_epi32( 0, 1, 2, 4, 5, 6, 3, 7 );
+
+		// each store writes 8 bytes past its pixels, which the next one covers;
+		// stop while there is still room for them
+		for( ; count >= 11; count -= 8, src += 32, dst += 24 )
+		{
+			__m256i v = _mm256_loadu_si256( (__m256i const*)src );
+			v = _mm256_permutevar8x32_epi32( _mm256_shuffle_epi8( v, shuffle ), join );
+			_mm256_storeu_si256( (__m256i*)dst, v );
+		}
+
+		// the rest four at a time, storing exactly the 12 bytes each makes
+		for( ; count >= 4; count -= 4, src += 16, dst += 12 )
+		{
+			__m128i v = _mm_shuffle_epi8( _mm_loadu_si128( (__m128i const*)src ), _mm256_castsi256_si128( shuffle ) );
+			_mm_storel_epi64( (__m128i*)dst, v );
+			Uint32 last = _mm_cvtsi128_si32( _mm_srli_si128( v, 8 ) );
+			memcpy( dst + 8, &last, 4 );
+		}
+		for( ; count > 0; --count, src += 4, dst += 3 )
+		{
+			dst[0] = src[0];
+			dst[1] = src[1];
+			dst[2] = src[2];
+		}
+	}
+
+	static void Copy( Uint8* dst, Uint8 const* src, unsigned bytes )
+	{
+		memcpy( dst, src, bytes );
+	}
+
+	static void Convert32( Uint8* dst, Uint8 const* src, unsigned count, ChannelShifts const& shifts )
+	{
+		__m256i swap = _mm256_setr_epi8( 3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+										 3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12 );
+		__m128i right[3], left[3];
+		__m256i mask[3];
+		for( int c = 0; c < 3; ++c )
+		{
+			right[c] = _mm_cvtsi32_si128( shifts.right[c] );
+			mask[c] = _mm256_set1_epi32( shifts.mask[c] );
+			left[c] = _mm_cvtsi32_si128( shifts.left[c] );
+		}
+		for( ; count >= 8; count -= 8, src += 32, dst += 32 )
+		{
+			__m256i v = _mm256_loadu_si256( (__m256i const*)src );
+			if( shifts.swap )
+				v = _mm256_shuffle_epi8( v, swap );
+			__m256i out = _mm256_sll_epi32( _mm256_and_si256( _mm256_srl_epi32( v, right[0] ), mask[0] ), left[0] );
+			out = _mm256_or_si256( out, _mm256_sll_epi32( _mm256_and_si256( _mm256_srl_epi32( v, right[1] ), mask[1] ), left[1] ) );
+			out = _mm256_or_si256( out, _mm256_sll_epi32( _mm256_and_si256( _mm256_srl_epi32( v, right[2] ), mask[2] ), left[2] ) );
+			_mm256_storeu_si256( (__m256i*)dst, out );
+		}
+		for( ; count > 0; --count, src += 4, dst += 4 )
+		{
+			Uint32 pixel;
+			memcpy( &pixel, src, 4 );
+			pixel = ShiftChannels( pixel, shifts );
+			memcpy( dst, &pixel, 4 );
+		}
+	}
+
+	static BlitKernels const s_avx2_kernels = { "avx2", Fill8, Fill16, Fill24, Fill32, Pack32to24, Copy, Convert32 };
+
+	BlitKernels const* GetAVX2BlitKernels()
+	{
+		return &s_avx2_kernels;
+	}
+
+};
+
+#else
+
+namespace VNC
+{
+
+	BlitKernels const* GetAVX2BlitKernels()
+	{
+		return NULL;
+	}
+
+};
+
+#endif
@@ -0,0 +1,209 @@
+/*!
+  \file blit-kernels-sse2.cpp
+  \brief Blit kernels using SSE2.
+
+  Only built in when this file is compiled with SSE2 enabled; see the
+  Makefile. Stores are unaligned throughout: rows start wherever the
+  rectangle does, and a final store that overlaps the one before it
+  finishes each run instead of a byte loop.
+*/
+
+#include <cstring>
+#include "blit-kernels.h"
+
+#if defined(__SSE2__)
+
+#include <emmintrin.h>
+
+namespace VNC
+{
+
+	//! Fills bytes with a repeating 16-byte pattern.
+	/*!
+	  \param dst where to write
+	  \param v the pattern, whose period divides both 16 and \a bytes
+	  \param bytes number of bytes to write, at least 16
+	*/
+	static inline void FillPattern( Uint8* dst, __m128i v, unsigned bytes )
+	{
+		unsigned i = 0;
+		for( ; i + 64 <= bytes; i += 64 )
+		{
+			_mm_storeu_si128( (__m128i*)( dst + i ), v );
+			_mm_storeu_si128( (__m128i*)( dst + i + 16 ), v );
+			_mm_storeu_si128( (__m128i*)( dst + i + 32 ), v );
+			_mm_storeu_si128( (__m128i*)( dst + i + 48 ), v );
+		}
+		for( ; i + 16 <= bytes; i += 16 )
+			_mm_storeu_si128( (__m128i*)( dst + i ), v );
+		if( i < bytes )
+			_mm_storeu_si128( (__m128i*)( dst + bytes - 16 ), v );
+	}
+
+	static void Fill8( Uint8* dst, Uint8 pixel, unsigned count )
+	{
+		if( count < 16 )
+			memset( dst, pixel, count );
+		else
+			FillPattern( dst, _mm_set1_epi8( (char)pixel ), count );
+	}
+
+	static void Fill16( Uint8* dst, Uint16 pixel, unsigned count )
+	{
+		if( count < 8 )
+		{
+			for( Uint8* end = dst + count * 2; dst < end; dst += 2 )
+				memcpy( dst, &pixel, 2 );
+			return;
+		}
+		FillPattern( dst, _mm_set1_epi16( (short)pixel ), count * 2 );
+	}
+
+	static void Fill32( Uint8* dst, Uint32 pixel, unsigned count )
+	{
+		if( count < 4 )
+		{
+			for( Uint8* end = dst + count * 4; dst < end; dst += 4 )
+				memcpy( dst, &pixel, 4 );
+			return;
+		}
+		FillPattern( dst, _mm_set1_epi32( (int)pixel ), count * 4 );
+	}
+
+	//! Makes the three words that four packed 24-bit pixels fill.
+	static inline void Make24BitWords( Uint32 pixel, Uint32 words[3] )
+	{
+		pixel &= 0x00ffffff;
+		words[0] = pixel | ( pixel << 24 );
+		words[1] = ( pixel >> 8 ) | ( pixel << 16 );
+		words[2] = ( pixel >> 16 ) | ( pixel << 8 );
+	}
+
+	static void Fill24( Uint8* dst, Uint32 pixel, unsigned count )
+	{
+		Uint32 w[3];
+		Make24BitWords( pixel, w );
+		unsigned bytes = count * 3;
+		if( bytes < 48 )
+		{
+			for( ; bytes >= 12; bytes -= 12, dst += 12 )
+				memcpy( dst, w, 12 );
+			memcpy( dst, w, bytes );
+			return;
+		}
+
+		// sixteen pixels make three whole vectors
+		__m128i v0 = _mm_setr_epi32( w[0], w[1], w[2], w[0] );
+		__m128i v1 = _mm_setr_epi32( w[1], w[2], w[0], w[1] );
+		__m128i v2 = _mm_setr_epi32( w[2], w[0], w[1], w[2] );
+		unsigned i = 0;
+		for( ; i + 48 <= bytes; i += 48 )
+		{
+			_mm_storeu_si128( (__m128i*)( dst + i ), v0 );
+			_mm_storeu_si128( (__m128i*)( dst + i + 16 ), v1 );
+			_mm_storeu_si128( (__m128i*)( dst + i + 32 ), v2 );
+		}
+		if( i < bytes )
+		{
+			// bytes is a multiple of 3, so the pattern is in step at the end too
+			Uint8* last = dst + bytes - 48;
+			_mm_storeu_si128( (__m128i*)last, v0 );
+			_mm_storeu_si128( (__m128i*)( last + 16 ), v1 );
+			_mm_storeu_si128( (__m128i*)( last + 32 ), v2 );
+		}
+	}
+
+	//! Packs four 32-bit pixels into the low 12 bytes of a vector, zeroing the rest.
+	static inline __m128i Pack4( __m128i v, __m128i even, __m128i odd )
+	{
+		// each 64-bit half holds two pixels; close the gap between them
+		__m128i t = _mm_or_si128( _mm_and_si128( v, even ), _mm_srli_epi64( _mm_and_si128( v, odd ), 8 ) );
+		// then the gap between the halves
+		return _mm_or_si128( _mm_move_epi64( t ), _mm_slli_si128( _mm_srli_si128( t, 8 ), 6 ) );
+	}
+
+	static void Pack32to24( Uint8* dst, Uint8 const* src, unsigned count )
+	{
+		__m128i even = _mm_set_epi32( 0, 0x00ffffff, 0, 0x00ffffff );
+		__m128i odd = _mm_set_epi32( 0x00ffffff, 0, 0x00ffffff, 0 );
+		for( ; count >= 16; count -= 16, src += 64, dst += 48 )
+		{
+			__m128i r0 = Pack4( _mm_loadu_si128( (__m128i const*)src ), even, odd );
+			__m128i r1 = Pack4( _mm_loadu_si128( (__m128i const*)( src + 16 ) ), even, odd );
+			__m128i r2 = Pack4( _mm_loadu_si128( (__m128i const*)( src + 32 ) ), even, odd );
+			__m128i r3 = Pack4( _mm_loadu_si128( (__m128i const*)( src + 48 ) ), even, odd );
+			_mm_storeu_si128( (__m128i*)dst, _mm_or_si128( r0, _mm_slli_si128( r1, 12 ) ) );
+			_mm_storeu_si128( (__m128i*)( dst + 16 ), _mm_or_si128( _mm_srli_si128( r1, 4 ), _mm_slli_si128( r2, 8 ) ) );
+			_mm_storeu_si128( (__m128i*)( dst + 32 ), _mm_or_si128( _mm_srli_si128( r2, 8 ), _mm_slli_si128( r3, 4 ) ) );
+		}
+		for( ; count > 0; --count, src += 4, dst += 3 )
+		{
+			dst[0] = src[0];
+			dst[1] = src[1];
+			dst[2] = src[2];
+		}
+	}
+
+	static void Copy( Uint8* dst, Uint8 const* src, unsigned bytes )
+	{
+		memcpy( dst, src, bytes );
+	}
+
+	//! Reverses the bytes of each 32-bit pixel.
+	static inline __m128i Swap32( __m128i v )
+	{
+		// swap the bytes of each 16-bit half, then the halves
+		v = _mm_or_si128( _mm_slli_epi16( v, 8 ), _mm_srli_epi16( v, 8 ) );
+		return _mm_shufflehi_epi16( _mm_shufflelo_epi16( v, _MM_SHUFFLE( 2, 3, 0, 1 ) ), _MM_SHUFFLE( 2, 3, 0, 1 ) );
+	}
+
+	static void Convert32( Uint8* dst, Uint8 const* src, unsigned count, ChannelShifts const& shifts )
+	{
+		__m128i right[3], mask[3], left[3];
+		for( int c = 0; c < 3; ++c )
+		{
+			right[c] = _mm_cvtsi32_si128( shifts.right[c] );
+			mask[c] = _mm_set1_epi32( shifts.mask[c] );
+			left[c] = _mm_cvtsi32_si128( shifts.left[c] );
+		}
+		for( ; count >= 4; count -= 4, src += 16, dst += 16 )
+		{
+			__m128i v = _mm_loadu_si128( (__m128i const*)src );
+			if( shifts.swap )
+				v = Swap32( v );
+			__m128i out = _mm_sll_epi32( _mm_and_si128( _mm_srl_epi32( v, right[0] ), mask[0] ), left[0] );
+			out = _mm_or_si128( out, _mm_sll_epi32( _mm_and_si128( _mm_srl_epi32( v, right[1] ), mask[1] ), left[1] ) );
+			out = _mm_or_si128( out, _mm_sll_epi32( _mm_and_si128( _mm_srl_epi32( v, right[2] ), mask[2] ), left[2] ) );
+			_mm_storeu_si128( (__m128i*)dst, out );
+		}
+		for( ; count > 0; --count, src += 4, dst += 4 )
+		{
+			Uint32 pixel;
+			memcpy( &pixel, src, 4 );
+			pixel = ShiftChannels( pixel, shifts );
+			memcpy( dst, &pixel, 4 );
+		}
+	}
+
+	static BlitKernels const s_sse2_kernels = { "sse2", Fill8, Fill16, Fill24, Fill32, Pack32to24, Copy, Convert32 };
+
+	BlitKernels const* GetSSE2BlitKernels()
+	{
+		return &s_sse2_kernels;
+	}
+
+};
+
+#else
+
+namespace VNC
+{
+
+	BlitKernels const* GetSSE2BlitKernels()
+	{
+		return NULL;
+	}
+
+};
+
+#endif
@@ -0,0 +1,157 @@
+/*!
+  \file blit-kernels.cpp
+  \brief Portable blit kernels, and the choice between them and the SIMD sets.
+*/
+
+#include <cstring>
+#include "blit-kernels.h"
+
+using namespace std;
+
+namespace VNC
+{
+
+	static void Fill8( Uint8* dst, Uint8 pixel, unsigned count )
+	{
+		memset( dst, pixel, count );
+	}
+
+	static void Fill16( Uint8* dst, Uint16 pixel, unsigned count )
+	{
+		for( Uint8* end = dst + count * 2; dst < end; dst += 2 )
+			memcpy( dst, &pixel, 2 );
+	}
+
+	static void Fill24( Uint8* dst, Uint32 pixel, unsigned count )
+	{
+		// the first few pixels a byte at a time...
+		Uint8* end = dst + ( count < 4 ? count : 4 ) * 3;
+		for( Uint8* p = dst; p < end; p += 3 )
+		{
+			p[0] = pixel & 0xff;
+			p[1] = ( pixel >> 8 ) & 0xff;
+			p[2] = ( pixel >> 16 ) & 0xff;
+		}
+
+		// ...then keep doubling what is written, so the copies get long quickly
+		unsigned done = end - dst;
+		unsigned total = count * 3;
+		while( done < total )
+		{
+			unsigned amount = total - done < done ? total - done : done;
+			memcpy( dst + done, dst, amount );
+			done += amount;
+		}
+	}
+
+	static void Fill32( Uint8* dst, Uint32 pixel, unsigned count )
+	{
+		for( Uint8* end = dst + count * 4; dst < end; dst += 4 )
+			memcpy( dst, &pixel, 4 );
+	}
+
+	static void Pack32to24( Uint8* dst, Uint8 const* src, unsigned count )
+	{
+		for( Uint8* end = dst + count * 3; dst < end; dst += 3, src += 4 )
+		{
+			dst[0] = src[0];
+			dst[1] = src[1];
+			dst[2] = src[2];
+		}
+	}
+
+	static void Copy( Uint8* dst, Uint8 const* src, unsigned bytes )
+	{
+		memcpy( dst, src, bytes );
+	}
+
+	static void Convert32( Uint8* dst, Uint8 const* src, unsigned count, ChannelShifts const& shifts )
+	{
+		for( Uint8* end = dst + count * 4; dst < end; dst += 4, src += 4 )
+		{
+			Uint32 pixel;
+			memcpy( &pixel, src, 4 );
+			pixel = ShiftChannels( pixel, shifts );
+			memcpy( dst, &pixel, 4 );
+		}
+	}
+
+	static BlitKernels const s_scalar_kernels = { "scalar", Fill8, Fill16, Fill24, Fill32, Pack32to24, Copy, Convert32 };
+
+	//! Checks whether the processor has SSE2.
+	static bool HaveSSE2()
+	{
+#if defined(__GNUC__) && ( defined(__i386__) || defined(__x86_64__) )
+		return __builtin_cpu_supports( "sse2" );
+#else
+		return false;
+#endif
+	}
+
+	//! Checks whether the processor, and the operating system, can run AVX2.
+	static bool HaveAVX2()
+	{
+#if defined(__GNUC__) && ( defined(__i386__) || defined(__x86_64__) )
+		return __builtin_cpu_supports( "avx2" );
+#else
+		return false;
+#endif
+	}
+
+	//! The built in sets the processor can run, slowest first.
+	/*!
+	  \param sets filled with the sets
+	  \returns number of sets
+	*/
+	static int GetUsableSets( BlitKernels const* sets[3] )
+	{
+		int count = 0;
+		sets[count++] = &s_scalar_kernels;
+		if( GetSSE2BlitKernels() != NULL && HaveSSE2() )
+			sets[count++] = GetSSE2BlitKernels();
+		if( GetAVX2BlitKernels() != NULL && HaveAVX2() )
+			sets[count++] = GetAVX2BlitKernels();
+		return count;
+	}
+
+	static BlitKernels const* s_kernels = NULL;
+
+	BlitKernels const& FindBlitKernels( char const* name )
+	{
+		BlitKernels const* sets[3];
+		int count = GetUsableSets( sets );
+		for( int i = 0; i < count; ++i )
+			if( !strcmp( name, sets[i]->name ) )
+				return *sets[i];
+
+		// tell apart a set that isn't there from one the processor can't run
+		if( ( GetSSE2BlitKernels() != NULL && !strcmp( name, GetSSE2BlitKernels()->name ) )
+			|| ( GetAVX2BlitKernels() != NULL && !strcmp( name, GetAVX2BlitKernels()->name ) ) )
+			throw Exc( string( "this processor can't run the " ) + name + " blit kernels" );
+		throw Exc( string( "unknown blit kernels " ) + name );
+	}
+
+	void ListBlitKernels( vector< string >& names )
+	{
+		BlitKernels const* sets[3];
+		int count = GetUsableSets( sets );
+		for( int i = 0; i < count; ++i )
+			names.push_back( sets[i]->name );
+	}
+
+	BlitKernels const& GetBlitKernels()
+	{
+		if( s_kernels == NULL )
+		{
+			BlitKernels const* sets[3];
+			s_kernels = sets[GetUsableSets( sets ) - 1];
+		}
+		return *s_kernels;
+	}
+
+	void SetBlitKernels( BlitKernels const& kernels )
+	{
+		s_kernels = &kernels;
+	}
+
+};
@@ -0,0 +1,103 @@
+/*!
+  \file blit-kernels.h
+  \brief Bulk pixel fills, packing and copies, in versions for different instruction sets.
+
+  SDLDisplay does all its pixel pushing through a set of BlitKernels:
+  filling runs of 8, 16, 24 and 32-bit pixels, packing 32-bit pixels
+  into 24-bit surfaces, copying rows, and moving the channels of 32-bit
+  pixels when the server's layout is kept. A portable set is always
+  there; SSE2 and AVX2 sets are built in on x86 when the Makefile
+  compiles their files with those instruction sets, and the best one
+  the processor supports is picked when the program starts.
+*/
+
+#ifndef BLIT_KERNELS_H
+#define BLIT_KERNELS_H
+
+#include <string>
+#include <vector>
+#include "vnctypes.h"
+
+namespace VNC
+{
+
+	//! How to rearrange the channels of a 32-bit pixel.
+	/*!
+	  Each channel of the result is ( ( pixel >> right ) & mask ) << left,
+	  which is how any layout whose channel maxima are all 2^n - 1 turns
+	  into any other.
+	*/
+	struct ChannelShifts
+	{
+		bool swap;          //!< byte swap each source pixel first
+		Uint32 right[3];    //!< red, green and blue shifted down by this...
+		Uint32 mask[3];     //!< ...keeping these bits...
+		Uint32 left[3];     //!< ...and shifted up to here
+	};
+
+	//! Rearranges one pixel's channels; how every set converts the odd pixels at the end of a run.
+	inline Uint32 ShiftChannels( Uint32 pixel, ChannelShifts const& shifts )
+	{
+		if( shifts.swap )
+			pixel = SwapPixel( pixel );
+		return ( ( ( pixel >> shifts.right[0] ) & shifts.mask[0] ) << shifts.left[0] )
+			| ( ( ( pixel >> shifts.right[1] ) & shifts.mask[1] ) << shifts.left[1] )
+			| ( ( ( pixel >> shifts.right[2] ) & shifts.mask[2] ) << shifts.left[2] );
+	}
+
+	//! One implementation of the bulk pixel operations.
+	/*!
+	  None of the pointers need to be aligned, and counts may be zero.
+	*/
+	struct BlitKernels
+	{
+		char const* name;   //!< the name the set is found by
+
+		//! Writes count copies of an 8-bit pixel.
+		void (*fill8)( Uint8* dst, Uint8 pixel, unsigned count );
+
+		//! Writes count copies of a 16-bit pixel.
+		void (*fill16)( Uint8* dst, Uint16 pixel, unsigned count );
+
+		//! Writes count copies of the low three bytes of a pixel, lowest first.
+		void (*fill24)( Uint8* dst, Uint32 pixel, unsigned count );
+
+		//! Writes count copies of a 32-bit pixel.
+		void (*fill32)( Uint8* dst, Uint32 pixel, unsigned count );
+
+		//! Packs count 32-bit pixels into 24 bits, keeping the first three bytes of each in memory.
+		void (*pack32to24)( Uint8* dst, Uint8 const* src, unsigned count );
+
+		//! Copies bytes between buffers that don't overlap.
+		void (*copy)( Uint8* dst, Uint8 const* src, unsigned bytes );
+
+		//! Converts count 32-bit pixels to another layout, as ShiftChannels does.
+		void (*convert32)( Uint8* dst, Uint8 const* src, unsigned count, ChannelShifts const& shifts );
+	};
+
+	//! Finds a set of kernels.
+	/*!
+	  Throws Exc if there is no such set, or the processor can't run it.
+	  \param name "scalar", or "sse2" or "avx2" if they were built in
+	  \returns the kernels
+	*/
+	BlitKernels const& FindBlitKernels( char const* name );
+
+	//! Lists the sets built into this program that the processor can run, slowest first.
+	void ListBlitKernels( std::vector< std::string >& names );
+
+	//! Retrieves the kernels displays use; the fastest the processor can run unless changed.
+	BlitKernels const& GetBlitKernels();
+
+	//! Changes the kernels displays created from now on use.
+	void SetBlitKernels( BlitKernels const& kernels );
+
+	//! The SSE2 set, or NULL if it wasn't built in; for FindBlitKernels.
+	BlitKernels const* GetSSE2BlitKernels();
+
+	//! The AVX2 set, or NULL if it wasn't built in; for FindBlitKernels.
+	BlitKernels const* GetAVX2BlitKernels();
+
+};
+
+#endif
@@ -0,0 +1,63 @@
+/*!
+  \file damage-list.cpp
+  \brief Collects the areas of the screen drawn during an update.
+*/
+
+#include "damage-list.h"
+
+#define DAMAGE_MAX_RECTS  64   //!< rectangles kept before the list collapses to its bounds
+
+namespace VNC
+{
+
+	// returns the number of pixels in a rectangle
+	static Uint32 Area( ScreenRect const& r )
+	{
+		return (Uint32)r.w * r.h;
+	}
+
+	// returns the smallest rectangle covering both
+	static ScreenRect Bounds( ScreenRect const& a, ScreenRect const& b )
+	{
+		int x1 = a.x < b.x ? a.x : b.x;
+		int y1 = a.y < b.y ? a.y : b.y;
+		int x2 = a.x + a.w > b.x + b.w ? a.x + a.w : b.x + b.w;
+		int y2 = a.y + a.h > b.y + b.h ? a.y + a.h : b.y + b.h;
+		return ScreenRect( x1, y1, x2 - x1, y2 - y1 );
+	}
+
+	void DamageList::Add( ScreenRect const& rect )
+	{
+		if( rect.w == 0 || rect.h == 0 )
+			return;
+
+		// keep absorbing rectangles while covering both with one adds no
+		// pixels; that takes in neighbours in a row or column, and anything
+		// the new one contains or is contained by
+		ScreenRect r = rect;
+		for( unsigned i = 0; i < m_rects.size(); )
+		{
+			ScreenRect both = Bounds( r, m_rects[i] );
+			if( Area( both ) - Area( r ) <= Area( m_rects[i] ) )
+			{
+				r = both;
+				m_rects[i] = m_rects.back();
+				m_rects.pop_back();
+				i = 0;   // the bigger one may now reach others already passed
+			}
+			else
+				++i;
+		}
+		m_rects.push_back( r );
+
+		if( m_rects.size() > DAMAGE_MAX_RECTS )
+		{
+			ScreenRect all = m_rects[0];
+			for( unsigned i = 1; i < m_rects.size(); ++i )
+				all = Bounds( all, m_rects[i] );
+			m_rects.clear();
+			m_rects.push_back( all );
+		}
+	}
+
+};
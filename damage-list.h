@@ -0,0 +1,51 @@
+/*!
+  \file damage-list.h
+  \brief Collects the areas of the screen drawn during an update.
+
+  A framebuffer update can touch hundreds of small rectangles, often
+  side by side, like the tiles of a hextile or ZRLE rectangle. Presenting
+  each of them on its own costs far more than the pixels are worth, so
+  displays gather them in a DamageList, which merges rectangles whenever
+  covering both with one costs no more than the two apart, and present
+  what is left once.
+*/
+
+#ifndef DAMAGE_LIST_H
+#define DAMAGE_LIST_H
+
+#include <vector>
+#include "vnctypes.h"
+
+namespace VNC
+{
+
+	class DamageList
+	{
+	public:
+
+		//! Adds an area, merging it with any it touches or overlaps, where that costs nothing.
+		/*!
+		  Empty rectangles are ignored. Past DAMAGE_MAX_RECTS rectangles
+		  the list collapses into its bounding box, which is then cheaper
+		  to present than the pieces.
+		  \param rect area drawn
+		*/
+		void Add( ScreenRect const& rect );
+
+		//! Forgets everything added.
+		void Clear() { m_rects.clear(); }
+
+		//! Checks whether anything has been added since the last Clear.
+		bool IsEmpty() const { return m_rects.empty(); }
+
+		//! Retrieves the merged areas; some may overlap, where covering both would have cost more.
+		std::vector< ScreenRect > const& GetRects() const { return m_rects; }
+
+	private:
+
+		std::vector< ScreenRect > m_rects;   //!< merged areas, in no particular order
+	};
+
+};
+
+#endif
@@ -0,0 +1,214 @@
+/*!
+  \file decoder-bench.cc
+  \brief Measures the decoders on captured server traffic.
+
+  Each input file is everything a server sent this client, from its
+  version string on: the server's half of the TCP stream of a session
+  without -t, as a packet capture saves it. The capture is replayed
+  through RFBProto and the decoders into a framebuffer in memory, three
+  ways: without the worker pool, with it, and with it while also
+  decoding independent rectangles in parallel (-r). Each pass is a fresh
+  session, since zlib streams carry over from one rectangle to the next.
+  Only the updates are timed, not the handshake, and the throughput is
+  that of the capture, so the ways compare fairly. The final framebuffer
+  is checksummed, and every way of decoding has to draw the same picture
+  as the first.
+*/
+
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include <sys/time.h>
+#include <zlib.h>
+#include "vnc.h"
+#include "vnc-sdl.h"
+#include "vnc-wire.h"
+#include "replay.h"
+
+using namespace std;
+
+/*!
+  Displays command line usage information.
+  \param path path to this executable, generally from argv[0]
+*/
+static void Usage( char const* path )
+{
+	cerr << "Usage:" << path << " [-n passes] [-j threads] [-p bits] capture..." << endl
+		 << "    -n passes        times to replay each capture in each way (default: 5)" << endl
+		 << "    -j threads       decoding threads for the pool (default: one per processor)" << endl
+		 << "    -p bits          pixel size the client asked for when capturing: 8, 16 or 32 (default: the server's)" << endl
+		 << "    capture          what a server sent, from its version string on, without -t" << endl;
+}
+
+//! Current time in seconds.
+static double Now()
+{
+	timeval tv;
+	gettimeofday( &tv, NULL );
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+//! Ways of replaying a capture.
+enum ReplayMode
+{
+	REPLAY_SERIAL,      //!< everything on the network thread
+	REPLAY_POOL,        //!< decoders hand work to the pool
+	REPLAY_PARALLEL,    //!< and independent rectangles are decoded side by side
+	NUM_REPLAY_MODES
+};
+
+static char const* const s_mode_names[NUM_REPLAY_MODES] = { "serial", "pool", "pool, parallel rects" };
+
+/*!
+  Replays a capture once, as a new session.
+  \param data the capture
+  \param mode how to decode
+  \param bits pixel size the client asked for, or 0
+  \param pool worker pool for the modes that use one
+  \param checksum set to the Adler-32 of the final framebuffer
+  \returns seconds spent in updates
+*/
+static double Replay( vector< VNC::Uint8 > const& data, ReplayMode mode, int bits, VNC::WorkerPool& pool, uLong& checksum )
+{
+	ReplayClient net( &data[0], data.size() );
+
+	vector< VNC::Decoder* > decoders;
+#if defined(VNC_HAVE_H264)
+	::VNC::VNC_DECODER( H264 ) dec_h264( net ); decoders.push_back( &dec_h264 );
+#endif
+	::VNC::VNC_DECODER( TIGHT ) dec_tight( net ); decoders.push_back( &dec_tight );
+	::VNC::VNC_DECODER( ZYWRLE ) dec_zywrle( net ); decoders.push_back( &dec_zywrle );
+	::VNC::VNC_DECODER( ZRLE ) dec_zrle( net ); decoders.push_back( &dec_zrle );
+	::VNC::VNC_DECODER( ZLIB ) dec_zlib( net ); decoders.push_back( &dec_zlib );
+	::VNC::VNC_DECODER( ZLIBHEX ) dec_zlibhex( net ); decoders.push_back( &dec_zlibhex );
+	::VNC::VNC_DECODER( TRLE ) dec_trle( net ); decoders.push_back( &dec_trle );
+	::VNC::VNC_DECODER( HEXTILE ) dec_hextile( net ); decoders.push_back( &dec_hextile );
+	::VNC::VNC_DECODER( CORRE ) dec_corre( net ); decoders.push_back( &dec_corre );
+	::VNC::VNC_DECODER( RRE ) dec_rre( net ); decoders.push_back( &dec_rre );
+	::VNC::VNC_DECODER( COPYRECT ) dec_copyrect( net ); decoders.push_back( &dec_copyrect );
+	::VNC::VNC_DECODER( RAW ) dec_raw( net ); decoders.push_back( &dec_raw );
+	if( mode != REPLAY_SERIAL )
+	{
+		for( unsigned i = 0; i < decoders.size(); ++i )
+			decoders[i]->SetWorkerPool( &pool );
+	}
+
+	VNC::RFBProto rfb( net, "", true, decoders );
+	MemoryDisplay display( rfb, bits );
+	rfb.SetDisplay( &display );
+	if( mode == REPLAY_PARALLEL )
+		rfb.SetParallelUpdates( &pool, false );
+
+	double start = Now();
+	while( net.GetRemaining() > 0 )
+		rfb.Update( 0 );
+	double seconds = Now() - start;
+
+	checksum = display.GetChecksum();
+	return seconds;
+}
+
+int main( int argc, char* argv[] )
+{
+	int opt_passes = 5;
+	int opt_threads = (int)sysconf( _SC_NPROCESSORS_ONLN );
+	int opt_bits = 0;
+	int ch;
+	while( ( ch = getopt( argc, argv, "n:j:p:" ) ) != -1 )
+	{
+		switch( ch )
+		{
+		case 'n':
+			opt_passes = atoi( optarg );
+			if( opt_passes < 1 )
+			{
+				cerr << "Invalid pass count " << opt_passes << " selected." << endl;
+				return 1;
+			}
+			break;
+
+		case 'j':
+			opt_threads = atoi( optarg );
+			if( opt_threads < 1 )
+			{
+				cerr << "Invalid thread count " << opt_threads << " selected." << endl;
+				return 1;
+			}
+			break;
+
+		case 'p':
+			opt_bits = atoi( optarg );
+			if( opt_bits != 8 && opt_bits != 16 && opt_bits != 32 )
+			{
+				cerr << "Invalid pixel size " << opt_bits << " selected." << endl;
+				return 1;
+			}
+			break;
+
+		default:
+			Usage( argv[0] );
+			return 1;
+		}
+	}
+	if( optind >= argc )
+	{
+		Usage( argv[0] );
+		return 1;
+	}
+	if( opt_threads < 1 ) opt_threads = 1;
+
+	try
+	{
+		VNC::SDLWorkerPool workers( opt_threads > 1 ? opt_threads : 0 );
+		for( int f = optind; f < argc; ++f )
+		{
+			ifstream file( argv[f], ios::binary );
+			if( !file )
+			{
+				cerr << "Unable to read " << argv[f] << "." << endl;
+				return 1;
+			}
+			vector< VNC::Uint8 > data( ( istreambuf_iterator< char >( file ) ), istreambuf_iterator< char >() );
+			if( data.empty() )
+			{
+				cerr << argv[f] << " is empty." << endl;
+				return 1;
+			}
+
+			cout << argv[f] << ": " << data.size() << " bytes, " << opt_threads << " thread(s)" << endl;
+			uLong expected = 0;
+			for( int m = 0; m < NUM_REPLAY_MODES; ++m )
+			{
+				// one untimed pass to check the output and warm up
+				uLong checksum;
+				Replay( data, (ReplayMode)m, opt_bits, workers, checksum );
+				if( m == 0 )
+					expected = checksum;
+
+				double seconds = 0;
+				for( int i = 0; i < opt_passes; ++i )
+					seconds += Replay( data, (ReplayMode)m, opt_bits, workers, checksum );
+
+				cout << "    " << setw( 24 ) << left << s_mode_names[m] << right
+					 << setw( 10 ) << fixed << setprecision( 1 ) << data.size() * (double)opt_passes / seconds / 1e6 << " MB/s"
+					 << "  (" << setprecision( 2 ) << seconds * 1000 / opt_passes << " ms a pass)";
+				if( checksum != expected )
+					cout << "  OUTPUT DIFFERS";
+				cout << endl;
+			}
+		}
+	}
+	catch( VNC::Exc const& e )
+	{
+		cerr << "Flagrant decoder error: " << (char const*)e << endl;
+		return 1;
+	}
+
+	return 0;
+}
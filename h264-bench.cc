@@ -0,0 +1,248 @@
+/*!
+  \file h264-bench.cc
+  \brief Measures the Open H.264 decoder on recorded rectangles.
+
+  Each input file holds the Open H.264 rectangles of a session, cut out
+  of their updates: each rectangle's header, with its position, size
+  and encoding, followed by its body as the server sent it, in the
+  order they arrived. They are fed through DecoderH264 from memory into
+  a framebuffer in memory, a number of times, and the rate of
+  rectangles and of compressed data is reported. Every pass starts with
+  fresh streams and has to draw the same picture as the first.
+
+  Like the decoder, this is only built with VNC_HAVE_H264 defined; see
+  the Makefile. Without it, the tool only says so.
+*/
+
+#include <iostream>
+
+#if defined(VNC_HAVE_H264)
+
+#include <iomanip>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <unistd.h>
+#include <sys/time.h>
+#include <zlib.h>
+#include "vnc.h"
+#include "vnc-wire.h"
+#include "replay.h"
+
+using namespace std;
+
+/*!
+  Displays command line usage information.
+  \param path path to this executable, generally from argv[0]
+*/
+static void Usage( char const* path )
+{
+	cerr << "Usage:" << path << " [-n passes] [-p bits] recording..." << endl
+		 << "    -n passes        times to replay each recording (default: 5)" << endl
+		 << "    -p bits          pixel size to decode to: 8, 16 or 32 (default: 32)" << endl
+		 << "    recording        Open H.264 rectangles, each its header and body as the server sent them" << endl;
+}
+
+//! Current time in seconds.
+static double Now()
+{
+	timeval tv;
+	gettimeofday( &tv, NULL );
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/*!
+  Checks a recording, and finds the screen it needs.
+  \param data the recording
+  \param width set to the width the rectangles reach to
+  \param height set to the height they reach to
+  \returns number of rectangles
+*/
+static unsigned long Scan( vector< VNC::Uint8 > const& data, int& width, int& height )
+{
+	VNC::Wire::MemoryClient net( &data[0], data.size() );
+	unsigned long rects = 0;
+	width = height = 0;
+	while( net.GetRemaining() > 0 )
+	{
+		VNC::Wire::RectHeader header;
+		VNC::Wire::Receive( net, header );
+		if( header.encoding != RFB_ENCODING_H264 )
+			throw VNC::Exc( "recording holds a rectangle that isn't Open H.264" );
+		if( header.x + header.w > width ) width = header.x + header.w;
+		if( header.y + header.h > height ) height = header.y + header.h;
+
+		// length and flags, then the data
+		VNC::Uint32 length = VNC::Wire::ReceiveValue< VNC::Uint32 >( net );
+		VNC::Wire::ReceiveValue< VNC::Uint32 >( net );
+		if( length > net.GetRemaining() )
+			throw VNC::Wire::ExcTruncated();
+		vector< VNC::Uint8 > skip( length );
+		if( length > 0 )
+			net.ReceiveBytes( &skip[0], length );
+		++rects;
+	}
+	return rects;
+}
+
+/*!
+  Makes up a server's side of the handshake, up to a ServerInit for a
+  true color screen of the given size.
+  \param width screen width
+  \param height screen height
+  \param handshake set to the bytes
+*/
+static void MakeHandshake( int width, int height, vector< VNC::Uint8 >& handshake )
+{
+	static VNC::Uint8 const s_version[] = { 'R', 'F', 'B', ' ', '0', '0', '3', '.', '0', '0', '3', '\n' };
+	static VNC::Uint8 const s_format[] =
+	{
+		32, 24, VNC_HOST_BIG_ENDIAN ? 1 : 0, 1,   // bits, depth, byte order, true color
+		0, 255, 0, 255, 0, 255,                   // channel maximums
+		16, 8, 0, 0, 0, 0,                        // shifts and padding
+		0, 0, 0, 0                                // no name
+	};
+	handshake.assign( s_version, s_version + sizeof( s_version ) );
+	VNC::Uint8 const rest[] = { 0, 0, 0, 1, (VNC::Uint8)( width >> 8 ), (VNC::Uint8)width, (VNC::Uint8)( height >> 8 ), (VNC::Uint8)height };
+	handshake.insert( handshake.end(), rest, rest + sizeof( rest ) );
+	handshake.insert( handshake.end(), s_format, s_format + sizeof( s_format ) );
+}
+
+/*!
+  Replays a recording once, with a fresh decoder.
+  \param data the recording
+  \param handshake a session to decode into; see MakeHandshake
+  \param bits pixel size to decode to, or 0 for the session's
+  \param checksum set to the Adler-32 of the final framebuffer
+  \returns seconds spent decoding
+*/
+static double Replay( vector< VNC::Uint8 > const& data, vector< VNC::Uint8 > const& handshake, int bits, uLong& checksum )
+{
+	ReplayClient session( &handshake[0], handshake.size() );
+	vector< VNC::Decoder* > decoders;
+	VNC::RFBProto rfb( session, "", true, decoders );
+	MemoryDisplay display( rfb, bits );
+
+	// the rectangles come from the recording, not the session
+	VNC::Wire::MemoryClient net( &data[0], data.size() );
+	VNC::ScratchArena scratch;
+	::VNC::VNC_DECODER( H264 ) decoder( net );
+	decoder.SetScratchArena( &scratch );
+
+	double start = Now();
+	while( net.GetRemaining() > 0 )
+	{
+		VNC::Wire::RectHeader header;
+		VNC::Wire::Receive( net, header );
+		decoder( VNC::ScreenRect( header.x, header.y, header.w, header.h ), display );
+		scratch.Reset();
+	}
+	double seconds = Now() - start;
+
+	checksum = display.GetChecksum();
+	return seconds;
+}
+
+int main( int argc, char* argv[] )
+{
+	int opt_passes = 5;
+	int opt_bits = 0;
+	int ch;
+	while( ( ch = getopt( argc, argv, "n:p:" ) ) != -1 )
+	{
+		switch( ch )
+		{
+		case 'n':
+			opt_passes = atoi( optarg );
+			if( opt_passes < 1 )
+			{
+				cerr << "Invalid pass count " << opt_passes << " selected." << endl;
+				return 1;
+			}
+			break;
+
+		case 'p':
+			opt_bits = atoi( optarg );
+			if( opt_bits != 8 && opt_bits != 16 && opt_bits != 32 )
+			{
+				cerr << "Invalid pixel size " << opt_bits << " selected." << endl;
+				return 1;
+			}
+			break;
+
+		default:
+			Usage( argv[0] );
+			return 1;
+		}
+	}
+	if( optind >= argc )
+	{
+		Usage( argv[0] );
+		return 1;
+	}
+
+	try
+	{
+		for( int f = optind; f < argc; ++f )
+		{
+			ifstream file( argv[f], ios::binary );
+			if( !file )
+			{
+				cerr << "Unable to read " << argv[f] << "." << endl;
+				return 1;
+			}
+			vector< VNC::Uint8 > data( ( istreambuf_iterator< char >( file ) ), istreambuf_iterator< char >() );
+			if( data.empty() )
+			{
+				cerr << argv[f] << " is empty." << endl;
+				return 1;
+			}
+
+			int width, height;
+			unsigned long rects = Scan( data, width, height );
+			vector< VNC::Uint8 > handshake;
+			MakeHandshake( width, height, handshake );
+
+			// one untimed pass to check the output against and warm up
+			uLong expected, checksum;
+			Replay( data, handshake, opt_bits, expected );
+
+			double seconds = 0;
+			bool differs = false;
+			for( int i = 0; i < opt_passes; ++i )
+			{
+				seconds += Replay( data, handshake, opt_bits, checksum );
+				if( checksum != expected )
+					differs = true;
+			}
+
+			cout << argv[f] << ": " << rects << " rectangles, " << data.size() << " bytes, "
+				 << width << "x" << height << endl
+				 << "    " << setw( 10 ) << fixed << setprecision( 1 ) << rects * (double)opt_passes / seconds << " rectangles/s"
+				 << setw( 10 ) << data.size() * (double)opt_passes / seconds / 1e6 << " MB/s"
+				 << "  (" << setprecision( 2 ) << seconds * 1000 / opt_passes << " ms a pass)";
+			if( differs )
+				cout << "  OUTPUT DIFFERS";
+			cout << endl;
+		}
+	}
+	catch( VNC::Exc const& e )
+	{
+		cerr << "Flagrant decoder error: " << (char const*)e << endl;
+		return 1;
+	}
+
+	return 0;
+}
+
+#else
+
+int main( int, char* argv[] )
+{
+	std::cerr << argv[0] << ": built without VNC_HAVE_H264; see the Makefile." << std::endl;
+	return 1;
+}
+
+#endif
@@ -0,0 +1,225 @@
+/*!
+  \file inflate-backend.cpp
+  \brief System zlib, zlib-ng and shared library inflate backends.
+*/
+
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <zlib.h>
+#if defined(VNC_HAVE_ZLIBNG)
+#include <zlib-ng.h>
+#endif
+#if !defined(_WIN32)
+#include <dlfcn.h>
+#endif
+
+#include "inflate-backend.h"
+
+using namespace std;
+
+namespace VNC
+{
+
+	static voidpf ZAlloc( voidpf, uInt items, uInt size )
+	{
+		return malloc( items * size );
+	}
+
+	static void ZFree( voidpf, voidpf address )
+	{
+		free( address );
+	}
+
+	//! Entry points of a library with zlib's interface.
+	struct ZlibFunctions
+	{
+		int (*inflateInit_)( z_streamp strm, char const* version, int stream_size );
+		int (*inflate)( z_streamp strm, int flush );
+		int (*inflateReset)( z_streamp strm );
+		int (*inflateEnd)( z_streamp strm );
+	};
+
+	//! The zlib this program is linked with.
+	static ZlibFunctions const s_system_zlib = { ::inflateInit_, ::inflate, ::inflateReset, ::inflateEnd };
+
+	//! A stream through zlib's interface, from whichever library supplies it.
+	class ZlibInflater : public Inflater
+	{
+	public:
+		ZlibInflater( ZlibFunctions const& z )
+			: m_z( z )
+		{
+			memset( &m_zs, 0, sizeof( m_zs ) );
+			m_zs.zalloc = ZAlloc;
+			m_zs.zfree = ZFree;
+			if( m_z.inflateInit_( &m_zs, ZLIB_VERSION, (int)sizeof( m_zs ) ) != Z_OK )
+				throw Exc( "unable to initialize zlib" );
+		}
+
+		virtual ~ZlibInflater()
+		{
+			m_z.inflateEnd( &m_zs );
+		}
+
+		virtual bool Inflate( InflateBuffers& io )
+		{
+			m_zs.next_in = (Bytef*)io.next_in;
+			m_zs.avail_in = io.avail_in;
+			m_zs.next_out = (Bytef*)io.next_out;
+			m_zs.avail_out = io.avail_out;
+			int result = m_z.inflate( &m_zs, Z_SYNC_FLUSH );
+			io.next_in = m_zs.next_in;
+			io.avail_in = m_zs.avail_in;
+			io.next_out = m_zs.next_out;
+			io.avail_out = m_zs.avail_out;
+			return result == Z_OK || result == Z_BUF_ERROR;
+		}
+
+		virtual void Reset()
+		{
+			if( m_z.inflateReset( &m_zs ) != Z_OK )
+				throw Exc( "unable to reset zlib stream" );
+		}
+
+	private:
+		ZlibFunctions const& m_z;   //!< library entry points
+		z_stream m_zs;              //!< zlib stream
+	};
+
+	//! The zlib this program is linked with.
+	class SystemZlibBackend : public InflateBackend
+	{
+	public:
+		virtual char const* GetName() const { return "zlib"; }
+		virtual Inflater* CreateInflater() { return new ZlibInflater( s_system_zlib ); }
+	};
+
+	//! A shared library with zlib's interface, such as a SIMD-optimized zlib fork.
+	class SharedZlibBackend : public InflateBackend
+	{
+	public:
+		SharedZlibBackend( char const* path )
+			: m_path( path )
+		{
+#if defined(_WIN32)
+			throw Exc( "loading an inflate library at runtime isn't supported on this platform" );
+#else
+			// RTLD_LOCAL keeps its symbols from replacing the system zlib's
+			void* lib = dlopen( path, RTLD_NOW | RTLD_LOCAL );
+			if( lib == NULL )
+				throw Exc( string( "unable to load inflate library " ) + path );
+			m_z.inflateInit_ = (int (*)( z_streamp, char const*, int ))dlsym( lib, "inflateInit_" );
+			m_z.inflate = (int (*)( z_streamp, int ))dlsym( lib, "inflate" );
+			m_z.inflateReset = (int (*)( z_streamp ))dlsym( lib, "inflateReset" );
+			m_z.inflateEnd = (int (*)( z_streamp ))dlsym( lib, "inflateEnd" );
+			if( m_z.inflateInit_ == NULL || m_z.inflate == NULL || m_z.inflateReset == NULL || m_z.inflateEnd == NULL )
+			{
+				dlclose( lib );
+				throw Exc( string( path ) + " doesn't have zlib's interface" );
+			}
+#endif
+		}
+
+		virtual char const* GetName() const { return m_path.c_str(); }
+		virtual Inflater* CreateInflater() { return new ZlibInflater( m_z ); }
+
+	private:
+		string m_path;       //!< library path
+		ZlibFunctions m_z;   //!< its entry points
+	};
+
+#if defined(VNC_HAVE_ZLIBNG)
+	//! A stream through zlib-ng's native interface.
+	class ZlibNgInflater : public Inflater
+	{
+	public:
+		ZlibNgInflater()
+		{
+			memset( &m_zs, 0, sizeof( m_zs ) );
+			if( zng_inflateInit( &m_zs ) != Z_OK )
+				throw Exc( "unable to initialize zlib-ng" );
+		}
+
+		virtual ~ZlibNgInflater()
+		{
+			zng_inflateEnd( &m_zs );
+		}
+
+		virtual bool Inflate( InflateBuffers& io )
+		{
+			m_zs.next_in = io.next_in;
+			m_zs.avail_in = io.avail_in;
+			m_zs.next_out = io.next_out;
+			m_zs.avail_out = io.avail_out;
+			int result = zng_inflate( &m_zs, Z_SYNC_FLUSH );
+			io.next_in = m_zs.next_in;
+			io.avail_in = m_zs.avail_in;
+			io.next_out = m_zs.next_out;
+			io.avail_out = m_zs.avail_out;
+			return result == Z_OK || result == Z_BUF_ERROR;
+		}
+
+		virtual void Reset()
+		{
+			if( zng_inflateReset( &m_zs ) != Z_OK )
+				throw Exc( "unable to reset zlib-ng stream" );
+		}
+
+	private:
+		zng_stream m_zs;   //!< zlib-ng stream
+	};
+
+	//! zlib-ng, built in.
+	class ZlibNgBackend : public InflateBackend
+	{
+	public:
+		virtual char const* GetName() const { return "zlib-ng"; }
+		virtual Inflater* CreateInflater() { return new ZlibNgInflater; }
+	};
+#endif
+
+	static SystemZlibBackend s_system_backend;
+#if defined(VNC_HAVE_ZLIBNG)
+	static ZlibNgBackend s_zlibng_backend;
+#endif
+	static InflateBackend* s_default_backend = &s_system_backend;
+
+	InflateBackend& FindInflateBackend( char const* name )
+	{
+		if( !strcmp( name, s_system_backend.GetName() ) )
+			return s_system_backend;
+#if defined(VNC_HAVE_ZLIBNG)
+		if( !strcmp( name, s_zlibng_backend.GetName() ) )
+			return s_zlibng_backend;
+#endif
+		if( strchr( name, '/' ) == NULL )
+			throw Exc( string( "unknown inflate backend " ) + name );
+
+		// libraries stay loaded for good, and are only loaded once
+		static map< string, SharedZlibBackend* > libraries;
+		SharedZlibBackend*& lib = libraries[name];
+		if( lib == NULL )
+			lib = new SharedZlibBackend( name );
+		return *lib;
+	}
+
+	void ListInflateBackends( vector< string >& names )
+	{
+		names.push_back( s_system_backend.GetName() );
+#if defined(VNC_HAVE_ZLIBNG)
+		names.push_back( s_zlibng_backend.GetName() );
+#endif
+	}
+
+	InflateBackend& GetDefaultInflateBackend()
+	{
+		return *s_default_backend;
+	}
+
+	void SetDefaultInflateBackend( InflateBackend& backend )
+	{
+		s_default_backend = &backend;
+	}
+
+};
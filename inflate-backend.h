@@ -0,0 +1,81 @@
+/*!
+  \file inflate-backend.h
+  \brief Interchangeable zlib-compatible inflate implementations.
+
+  ZlibReader does its decompression through an InflateBackend, so a
+  faster zlib can be swapped in without touching the decoders: zlib-ng
+  when it is built in, or any shared library with zlib's interface,
+  loaded by path at runtime.
+*/
+
+#ifndef INFLATE_BACKEND_H
+#define INFLATE_BACKEND_H
+
+#include <string>
+#include <vector>
+#include "vnctypes.h"
+
+namespace VNC
+{
+
+	//! Input and output windows of an inflate call, as in zlib's z_stream.
+	struct InflateBuffers
+	{
+		Uint8 const* next_in;   //!< next compressed byte
+		Uint32 avail_in;        //!< compressed bytes available at next_in
+		Uint8* next_out;        //!< where the next decompressed byte goes
+		Uint32 avail_out;       //!< space left at next_out
+	};
+
+	//! One decompression stream.
+	class Inflater
+	{
+	public:
+		virtual ~Inflater() {}
+
+		//! Decompresses as much as the buffers allow, flushing all output.
+		/*!
+		  Advances the buffers past what was used, like zlib's inflate with Z_SYNC_FLUSH.
+		  \param io input and output windows
+		  \returns false if the data is corrupt or the stream has ended
+		*/
+		virtual bool Inflate( InflateBuffers& io ) = 0;
+
+		//! Starts a new stream, discarding the old dictionary.
+		virtual void Reset() = 0;
+	};
+
+	//! A zlib-compatible inflate implementation.
+	class InflateBackend
+	{
+	public:
+		virtual ~InflateBackend() {}
+
+		//! Retrieves the name this backend is found by.
+		virtual char const* GetName() const = 0;
+
+		//! Starts a new decompression stream, owned by the caller.
+		virtual Inflater* CreateInflater() = 0;
+	};
+
+	//! Finds an inflate backend.
+	/*!
+	  Throws Exc if there is no such backend.
+	  \param name "zlib", "zlib-ng" if it was built in, or the path of a
+	  shared library with zlib's interface
+	  \returns the backend, which lives until the program exits
+	*/
+	InflateBackend& FindInflateBackend( char const* name );
+
+	//! Lists the backends built into this program.
+	void ListInflateBackends( std::vector< std::string >& names );
+
+	//! Retrieves the backend new ZlibReaders use; system zlib unless changed.
+	InflateBackend& GetDefaultInflateBackend();
+
+	//! Changes the backend new ZlibReaders use.
+	void SetDefaultInflateBackend( InflateBackend& backend );
+
+};
+
+#endif
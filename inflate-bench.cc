@@ -0,0 +1,163 @@
+/*!
+  \file inflate-bench.cc
+  \brief Measures inflate backends on captured zlib streams.
+
+  Each input file is one zlib stream as a server sends it: the
+  compressed payloads of a connection's ZLIB or ZRLE rectangles, in
+  order, without their length prefixes. Every backend inflates every
+  file a number of times with sync flushes, the way ZlibReader does,
+  and the decompressed throughput is reported in MB/s. The output of
+  each backend is checksummed so a broken one can't look fast.
+*/
+
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <unistd.h>
+#include <sys/time.h>
+#include <zlib.h>
+#include "inflate-backend.h"
+
+using namespace std;
+
+#define BENCH_OUT_SIZE  16384   //!< output chunk, the size of ZlibReader's buffer
+
+/*!
+  Displays command line usage information.
+  \param path path to this executable, generally from argv[0]
+*/
+static void Usage( char const* path )
+{
+	cerr << "Usage:" << path << " [-n passes] [-b backend]... stream..." << endl
+		 << "    -n passes        times to inflate each stream (default: 10)" << endl
+		 << "    -b backend       zlib, zlib-ng if built in, or a library path (default: all built in)" << endl
+		 << "    stream           zlib data captured from ZLIB or ZRLE rectangles" << endl;
+}
+
+//! Current time in seconds.
+static double Now()
+{
+	timeval tv;
+	gettimeofday( &tv, NULL );
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/*!
+  Inflates a whole stream once.
+  \param backend backend to use
+  \param data compressed stream
+  \param checksum set to the Adler-32 of the output
+  \returns number of decompressed bytes
+*/
+static unsigned long InflateStream( VNC::InflateBackend& backend, vector< VNC::Uint8 > const& data, uLong& checksum )
+{
+	VNC::Inflater* inflater = backend.CreateInflater();
+	VNC::Uint8 out[BENCH_OUT_SIZE];
+	VNC::InflateBuffers io;
+	io.next_in = data.empty() ? NULL : &data[0];
+	io.avail_in = data.size();
+	unsigned long total = 0;
+	checksum = adler32( 0, NULL, 0 );
+	do
+	{
+		io.next_out = out;
+		io.avail_out = sizeof( out );
+		bool ok = inflater->Inflate( io );
+		unsigned amt = sizeof( out ) - io.avail_out;
+		if( !ok || ( amt == 0 && io.avail_in > 0 ) )
+		{
+			delete inflater;
+			throw VNC::Exc( "stream is corrupt or ends early" );
+		}
+		checksum = adler32( checksum, out, amt );
+		total += amt;
+	} while( io.avail_in > 0 || io.avail_out == 0 );
+	delete inflater;
+	return total;
+}
+
+int main( int argc, char* argv[] )
+{
+	int opt_passes = 10;
+	vector< string > backends;
+	int ch;
+	while( ( ch = getopt( argc, argv, "n:b:" ) ) != -1 )
+	{
+		switch( ch )
+		{
+		case 'n':
+			opt_passes = atoi( optarg );
+			if( opt_passes < 1 )
+			{
+				cerr << "Invalid pass count " << opt_passes << " selected." << endl;
+				return 1;
+			}
+			break;
+
+		case 'b':
+			backends.push_back( optarg );
+			break;
+
+		default:
+			Usage( argv[0] );
+			return 1;
+		}
+	}
+	if( optind >= argc )
+	{
+		Usage( argv[0] );
+		return 1;
+	}
+	if( backends.empty() )
+		VNC::ListInflateBackends( backends );
+
+	try
+	{
+		for( int f = optind; f < argc; ++f )
+		{
+			ifstream file( argv[f], ios::binary );
+			if( !file )
+			{
+				cerr << "Unable to read " << argv[f] << "." << endl;
+				return 1;
+			}
+			vector< VNC::Uint8 > data( ( istreambuf_iterator< char >( file ) ), istreambuf_iterator< char >() );
+
+			cout << argv[f] << ": " << data.size() << " bytes compressed" << endl;
+			uLong expected = 0;
+			for( unsigned b = 0; b < backends.size(); ++b )
+			{
+				VNC::InflateBackend& backend = VNC::FindInflateBackend( backends[b].c_str() );
+
+				// one untimed pass to check the output and warm up
+				uLong checksum;
+				unsigned long size = InflateStream( backend, data, checksum );
+				if( b == 0 )
+					expected = checksum;
+
+				double start = Now();
+				for( int i = 0; i < opt_passes; ++i )
+					InflateStream( backend, data, checksum );
+				double seconds = Now() - start;
+
+				cout << "    " << setw( 24 ) << left << backend.GetName() << right
+					 << setw( 10 ) << fixed << setprecision( 1 ) << size * (double)opt_passes / seconds / 1e6 << " MB/s"
+					 << "  (" << size << " bytes, ratio " << setprecision( 2 ) << (double)size / data.size() << ")";
+				if( checksum != expected )
+					cout << "  OUTPUT DIFFERS";
+				cout << endl;
+			}
+		}
+	}
+	catch( VNC::Exc const& e )
+	{
+		cerr << "Flagrant inflate error: " << (char const*)e << endl;
+		return 1;
+	}
+
+	return 0;
+}
@@ -12,6 +12,7 @@
 #include <signal.h>
 #include "vnc.h"
 #include "vnc-sdl.h"
+#include "vnc-tls.h"
 #include <SDL/SDL_thread.h>
 
 #define CLIENT_VERSION 0.1f          //!< client release number
@@ -27,9 +28,22 @@ bool g_quit = false;                 //!< global quit flag
 static void Usage( char const* path )
 {
 	cerr << "Edifying VNC Client of Ook, version " << setprecision(2) << CLIENT_VERSION << endl
-		 << "Usage:" << path << " [-p port] [-a password] [-v] [-d encoding] hostname" << endl
+		 << "Usage:" << path << " [-p port] [-a password] [-t] [-T] [-c cafile] [-j threads] [-r] [-q quality] [-z inflate] [-k kernels] [-n] [-b] [-f fps] [-u] [-v] [-d encoding] hostname" << endl
 		 << "    -p port          TCP port to connect with" << endl
 		 << "    -a password      VNC authentication password" << endl
+		 << "    -t               require an encrypted (VeNCrypt/TLS) session with a verified server certificate" << endl
+		 << "    -T               like -t, but also accept anonymous TLS, which can't detect a man in the middle" << endl
+		 << "    -c cafile        trusted certificates for -t (default: system store)" << endl
+		 << "    -j threads       decoding threads (default: one per processor)" << endl
+		 << "    -r               decode independent rectangles of an update in parallel; while an update is spread" << endl
+		 << "                     over several threads, each rectangle is decoded on one, without ZRLE's or zlib's pipelines" << endl
+		 << "    -q quality       allow lossy JPEG, ZYWRLE and H.264 updates at this quality, 0-9 (default: lossless)" << endl
+		 << "    -z inflate       zlib implementation: zlib, zlib-ng if built in, or a library path (default: zlib)" << endl
+		 << "    -n               keep the server's native pixel format and convert it here" << endl
+		 << "    -b               draw into a shadow framebuffer, so full-width scrolls move rows rather than pixels" << endl
+		 << "    -f fps           present whole updates from a separate thread, at most this often (implies -b)" << endl
+		 << "    -u               hash the framebuffer in tiles and present only those that changed (implies -b)" << endl
+		 << "    -k kernels       blit kernels: scalar, or sse2 or avx2 if built in (default: fastest this processor runs)" << endl
 		 << "    -d encoding      disable a particular encoding by name" << endl;
 }
 
@@ -67,9 +81,21 @@ int main( int argc, char* argv[] )
 	int opt_port = VNC_DEFAULT_PORT;
 	char const* opt_hostname = NULL;
 	bool opt_verbose = false;
-	bool opt_enable_hextile = true, opt_enable_corre = true, opt_enable_rre = true, opt_enable_zrle = true, opt_enable_copyrect = true, opt_enable_zlib = true;
+	bool opt_tls = false;
+	bool opt_anonymous_tls = false;
+	char const* opt_cafile = "";
+	int opt_threads = (int)sysconf( _SC_NPROCESSORS_ONLN );
+	bool opt_parallel_rects = false;
+	int opt_quality = -1;
+	char const* opt_inflate = NULL;
+	char const* opt_kernels = NULL;
+	bool opt_native_format = false;
+	bool opt_shadow = false;
+	int opt_present_rate = 0;
+	bool opt_tile_hashing = false;
+	bool opt_enable_h264 = true, opt_enable_tight = true, opt_enable_hextile = true, opt_enable_zlibhex = true, opt_enable_corre = true, opt_enable_rre = true, opt_enable_zrle = true, opt_enable_zywrle = true, opt_enable_trle = true, opt_enable_copyrect = true, opt_enable_zlib = true;
 	
-	while( ( ch = getopt( argc, argv, "va:p:d:" ) ) != -1 )
+	while( ( ch = getopt( argc, argv, "va:p:d:tTc:j:rq:z:k:nbf:u" ) ) != -1 )
 	{
 		switch( ch )
 		{
@@ -93,14 +119,83 @@ int main( int argc, char* argv[] )
 			opt_verbose = true;
 			break;
 
+		case 't':
+			opt_tls = true;
+			break;
+
+		case 'T':
+			opt_tls = true;
+			opt_anonymous_tls = true;
+			break;
+
+		case 'c':
+			opt_cafile = optarg;
+			break;
+
+		case 'j':
+			opt_threads = atoi( optarg );
+			if( opt_threads < 1 )
+			{
+				cerr << "Invalid thread count " << opt_threads << " selected." << endl;
+				return 1;
+			}
+			break;
+
+		case 'r':
+			opt_parallel_rects = true;
+			break;
+
+		case 'q':
+			opt_quality = atoi( optarg );
+			if( opt_quality < 0 || opt_quality > 9 )
+			{
+				cerr << "Invalid quality level " << opt_quality << " selected." << endl;
+				return 1;
+			}
+			break;
+
+		case 'z':
+			opt_inflate = optarg;
+			break;
+
+		case 'k':
+			opt_kernels = optarg;
+			break;
+
+		case 'n':
+			opt_native_format = true;
+			break;
+
+		case 'b':
+			opt_shadow = true;
+			break;
+
+		case 'f':
+			opt_present_rate = atoi( optarg );
+			if( opt_present_rate < 1 || opt_present_rate > 1000 )
+			{
+				cerr << "Invalid frame rate " << opt_present_rate << " selected." << endl;
+				return 1;
+			}
+			break;
+
+		case 'u':
+			opt_tile_hashing = true;
+			break;
+
 		case 'd':
 			{
 				if( !strcasecmp( optarg, "hextile" ) )        { opt_enable_hextile = false; }
+				else if( !strcasecmp( optarg, "zlibhex" ) )   { opt_enable_zlibhex = false; }
 				else if( !strcasecmp( optarg, "corre" ) )     { opt_enable_corre = false; }
 				else if( !strcasecmp( optarg, "rre" ) )       { opt_enable_rre = false; }
 				else if( !strcasecmp( optarg, "zrle" ) )      { opt_enable_zrle = false; }
+				else if( !strcasecmp( optarg, "zywrle" ) )    { opt_enable_zywrle = false; }
+				else if( !strcasecmp( optarg, "trle" ) )      { opt_enable_trle = false; }
 				else if( !strcasecmp( optarg, "copyrect" ) )  { opt_enable_copyrect = false; }
 				else if( !strcasecmp( optarg, "zlib" ) )      { opt_enable_zlib = false; }
+				else if( !strcasecmp( optarg, "tight" ) )     { opt_enable_tight = false; }
+				else if( !strcasecmp( optarg, "h264" ) )      { opt_enable_h264 = false; }
 				else { Usage( program_path ); return 1; }
 			}
 			break;
@@ -139,17 +234,51 @@ int main( int argc, char* argv[] )
 
 		// Set up the network connection.
 		if( opt_verbose ) cerr << "Connecting to " << opt_hostname << " on port " << opt_port << "..." << endl;
-		VNC::SDLNetworkClient client( opt_hostname, (VNC::Uint16) opt_port );
+		VNC::SDLNetworkClient tcp( opt_hostname, (VNC::Uint16) opt_port );
+
+		// Layer TLS on top if asked to. It stays inert until the handshake starts it.
+		VNC::TLSNetworkClient tls( tcp, opt_hostname, opt_cafile, opt_anonymous_tls );
+		VNC::NetworkClient& client = opt_tls ? (VNC::NetworkClient&)tls : (VNC::NetworkClient&)tcp;
+
+		// Start the decoding threads. A single thread is no better than decoding in place.
+		if( opt_threads < 1 ) opt_threads = 1;
+		if( opt_verbose ) cerr << "Decoding with " << opt_threads << " thread(s)." << endl;
+		VNC::SDLWorkerPool workers( opt_threads > 1 ? opt_threads : 0 );
+
+		// Pick the zlib implementation before any decoder makes a zlib stream.
+		if( opt_inflate != NULL )
+			VNC::SetDefaultInflateBackend( VNC::FindInflateBackend( opt_inflate ) );
+		if( opt_verbose ) cerr << "Inflating with " << VNC::GetDefaultInflateBackend().GetName() << "." << endl;
+
+		// Pick the blit kernels before the display takes them.
+		if( opt_kernels != NULL )
+			VNC::SetBlitKernels( VNC::FindBlitKernels( opt_kernels ) );
+		if( opt_verbose ) cerr << "Blitting with " << VNC::GetBlitKernels().name << " kernels." << endl;
 
 		// Create decoders in order of preference.
 		vector< VNC::Decoder* > decoders;
-//		::VNC::VNC_DECODER( ZRLE ) dec_zrle( client ); if( opt_enable_zrle ) decoders.push_back( &dec_zrle );
+#if defined(VNC_HAVE_H264)
+		// H.264 is lossy too, and only worth it for video, but then by a wide margin
+		::VNC::VNC_DECODER( H264 ) dec_h264( client ); if( opt_enable_h264 && opt_quality >= 0 ) decoders.push_back( &dec_h264 );
+#else
+		(void)opt_enable_h264;
+#endif
+		::VNC::VNC_DECODER( TIGHT ) dec_tight( client ); if( opt_enable_tight ) decoders.push_back( &dec_tight );
+		dec_tight.SetQualityLevel( opt_quality );
+		// ZYWRLE is always lossy, so it is only offered when lossy updates are allowed
+		::VNC::VNC_DECODER( ZYWRLE ) dec_zywrle( client ); if( opt_enable_zywrle && opt_quality >= 0 ) decoders.push_back( &dec_zywrle );
+		dec_zywrle.SetQualityLevel( opt_quality );
+		::VNC::VNC_DECODER( ZRLE ) dec_zrle( client ); if( opt_enable_zrle ) decoders.push_back( &dec_zrle );
 		::VNC::VNC_DECODER( ZLIB ) dec_zlib( client ); if( opt_enable_zlib ) decoders.push_back( &dec_zlib );
+		::VNC::VNC_DECODER( ZLIBHEX ) dec_zlibhex( client ); if( opt_enable_zlibhex ) decoders.push_back( &dec_zlibhex );
+		::VNC::VNC_DECODER( TRLE ) dec_trle( client ); if( opt_enable_trle ) decoders.push_back( &dec_trle );
 		::VNC::VNC_DECODER( HEXTILE ) dec_hextile( client ); if( opt_enable_hextile ) decoders.push_back( &dec_hextile );
 		::VNC::VNC_DECODER( CORRE ) dec_corre( client ); if( opt_enable_corre ) decoders.push_back( &dec_corre );
 		::VNC::VNC_DECODER( RRE ) dec_rre( client ); if( opt_enable_rre ) decoders.push_back( &dec_rre );
 		::VNC::VNC_DECODER( COPYRECT ) dec_copyrect( client ); if( opt_enable_copyrect ) decoders.push_back( &dec_copyrect );
 		::VNC::VNC_DECODER( RAW ) dec_raw( client ); decoders.push_back( &dec_raw );
+		for( unsigned i = 0; i < decoders.size(); ++i )
+			decoders[i]->SetWorkerPool( &workers );
 
 		// Verbose spew.
 		if( opt_verbose )
@@ -176,12 +305,15 @@ int main( int argc, char* argv[] )
 			cerr << "Native format of '" << rfb.GetDesktopName() << "':" << endl
 				 << "    " << rfb.GetDesktopWidth() << "x" << rfb.GetDesktopHeight() << " pixels" << endl
 				 << "    " << fmt.bits << " bits per pixel" << endl
-				 << "    " << (fmt.big_endian ? "big endian" : "little endian") << endl;
+				 << "    " << (fmt.big_endian ? "big endian" : "little endian") << endl
+				 << "    " << (VNC::IsTrueColor( fmt ) ? "true color" : "color mapped, not supported; asking for true color") << endl;
 		}
 
 		// Create the display and attach it to the protocol handler.
-		VNC::SDLDisplay display( rfb );
+		VNC::SDLDisplay display( rfb, opt_native_format, opt_shadow, opt_present_rate, opt_tile_hashing );
 		rfb.SetDisplay( &display );
+		if( opt_parallel_rects && opt_threads > 1 )
+			rfb.SetParallelUpdates( &workers, opt_verbose );
 		
 		// Create the network update thread.
  		net_thread = SDL_CreateThread( NetworkThread, (void*)&rfb );
@@ -204,6 +336,17 @@ int main( int argc, char* argv[] )
 			cerr << "Decoder usage statistics:" << endl;
 			for( unsigned i = 0; i < decoders.size(); ++i )
 				cerr << "    " << decoders[i]->GetNumProcessed() << " " << decoders[i]->GetName() << " packets" << endl;
+			VNC::ScratchArena const& scratch = rfb.GetScratchArena();
+			cerr << "Scratch memory: " << scratch.GetNumRequests() << " buffers from "
+				 << scratch.GetNumHeapAllocations() << " heap allocations, "
+				 << scratch.GetHighWater() << " bytes at most" << endl;
+			unsigned long updates, frames;
+			display.GetPresentStats( updates, frames );
+			cerr << "Presentation: " << updates << " updates shown in " << frames << " frames" << endl;
+			unsigned long tiles, unchanged, pixels, kept;
+			if( display.GetTileHashStats( tiles, unchanged, pixels, kept ) )
+				cerr << "Tile hashing: " << unchanged << " of " << tiles << " tiles unchanged, "
+					 << ( pixels - kept ) << " of " << pixels << " damaged pixels not presented" << endl;
 		}
 	}
 	catch ( VNC::Exc& e )
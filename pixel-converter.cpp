@@ -0,0 +1,219 @@
+/*!
+  \file pixel-converter.cpp
+  \brief Converts pixels from the server's layout to the display's.
+*/
+
+#include <cstring>
+#include "pixel-converter.h"
+
+namespace VNC
+{
+
+	// true if a channel maximum is 2^n - 1, so its bits can simply be shifted
+	static bool IsSolidMask( Uint32 mask )
+	{
+		return mask != 0 && ( mask & ( mask + 1 ) ) == 0;
+	}
+
+	// returns the number of bits in a solid bitmask
+	static unsigned MaskSize( Uint32 mask )
+	{
+		unsigned i = 0;
+		while( mask )
+		{
+			++i;
+			mask >>= 1;
+		}
+		return i;
+	}
+
+	//! Moves one channel from its place in one layout to its place in another, rescaling it.
+	static Uint32 ScaleChannel( Uint32 pixel, Uint32 from_shift, Uint32 from_mask, Uint32 to_shift, Uint32 to_mask )
+	{
+		if( from_mask == 0 )
+			return 0;
+		Uint32 value = ( pixel >> from_shift ) & from_mask;
+		if( IsSolidMask( from_mask ) && IsSolidMask( to_mask ) )
+		{
+			// drop or add low bits, as the vector kernels do
+			unsigned from_bits = MaskSize( from_mask ), to_bits = MaskSize( to_mask );
+			value = from_bits > to_bits ? value >> ( from_bits - to_bits ) : value << ( to_bits - from_bits );
+		}
+		else
+			value = ( value * to_mask + from_mask / 2 ) / from_mask;
+		return value << to_shift;
+	}
+
+	//! Works out the ChannelShifts for one channel; both maxima must be solid.
+	static void SetChannelShifts( ChannelShifts& shifts, int c, Uint32 from_shift, Uint32 from_mask, Uint32 to_shift, Uint32 to_mask )
+	{
+		unsigned from_bits = MaskSize( from_mask ), to_bits = MaskSize( to_mask );
+		if( from_bits >= to_bits )
+		{
+			shifts.right[c] = from_shift + ( from_bits - to_bits );
+			shifts.mask[c] = to_mask;
+			shifts.left[c] = to_shift;
+		}
+		else
+		{
+			shifts.right[c] = from_shift;
+			shifts.mask[c] = from_mask;
+			shifts.left[c] = to_shift + ( to_bits - from_bits );
+		}
+	}
+
+	//! Stores a converted pixel; packed 24-bit pixels go lowest byte first, like BlitKernels::fill24.
+	template< int BYTES >
+	static inline void StorePixel( Uint8* dst, Uint32 pixel )
+	{
+		if( BYTES == 1 )
+			*dst = (Uint8)pixel;
+		else if( BYTES == 2 )
+		{
+			Uint16 p = (Uint16)pixel;
+			memcpy( dst, &p, 2 );
+		}
+		else if( BYTES == 3 )
+		{
+			dst[0] = pixel & 0xff;
+			dst[1] = ( pixel >> 8 ) & 0xff;
+			dst[2] = ( pixel >> 16 ) & 0xff;
+		}
+		else
+			memcpy( dst, &pixel, 4 );
+	}
+
+	//! Converts a row a byte of each pixel at a time, each byte's contribution coming from its own table.
+	/*!
+	  The tables already account for both byte orders and every shift,
+	  so the loop is the same for any pair of layouts of these sizes.
+	*/
+	template< typename SRC, int DST_BYTES >
+	static void ConvertWithTables( Uint32 const (*tables)[256], Uint8* dst, Uint8 const* src, unsigned count )
+	{
+		for( ; count > 0; --count, src += sizeof( SRC ), dst += DST_BYTES )
+		{
+			SRC in;
+			memcpy( &in, src, sizeof( SRC ) );
+			Uint32 pixel = in;
+			Uint32 out = tables[0][pixel & 0xff];
+			if( sizeof( SRC ) >= 2 )
+				out |= tables[1][( pixel >> 8 ) & 0xff];
+			if( sizeof( SRC ) == 4 )
+				out |= tables[2][( pixel >> 16 ) & 0xff] | tables[3][pixel >> 24];
+			StorePixel< DST_BYTES >( dst, out );
+		}
+	}
+
+	//! A row converter using per-byte tables.
+	typedef void (*TableRowFunc)( Uint32 const (*tables)[256], Uint8* dst, Uint8 const* src, unsigned count );
+
+	//! Picks the table loop for an incoming pixel type and outgoing size.
+	template< typename SRC >
+	static TableRowFunc PickTableRow( unsigned to_bytes )
+	{
+		switch( to_bytes )
+		{
+		case 1:  return ConvertWithTables< SRC, 1 >;
+		case 2:  return ConvertWithTables< SRC, 2 >;
+		case 3:  return ConvertWithTables< SRC, 3 >;
+		default: return ConvertWithTables< SRC, 4 >;
+		}
+	}
+
+	PixelConverter::PixelConverter( PixelFormat const& from, PixelFormat const& to, BlitKernels const& kernels )
+		: m_from( from ),
+		  m_to( to ),
+		  m_kernels( kernels ),
+		  m_use_shifts( false ),
+		  m_table_row( NULL )
+	{
+		if( from.bytes != 1 && from.bytes != 2 && from.bytes != 4 )
+			throw Exc( "invalid color depth for pixel conversion" );
+		if( to.bytes < 1 || to.bytes > 4 )
+			throw Exc( "invalid color depth for pixel conversion" );
+		m_swap_from = from.bytes > 1 && from.big_endian != ( VNC_HOST_BIG_ENDIAN != 0 );
+		m_swap_to = ( to.bytes == 2 || to.bytes == 4 ) && to.big_endian != ( VNC_HOST_BIG_ENDIAN != 0 );
+
+		// odd channel maxima have to be rescaled with arithmetic, which
+		// doesn't split into independent bytes
+		if( !IsSolidMask( from.red_mask ) || !IsSolidMask( from.green_mask ) || !IsSolidMask( from.blue_mask )
+			|| !IsSolidMask( to.red_mask ) || !IsSolidMask( to.green_mask ) || !IsSolidMask( to.blue_mask ) )
+			return;
+
+		if( from.bytes == 4 && to.bytes == 4 && !m_swap_to )
+		{
+			m_use_shifts = true;
+			m_shifts.swap = m_swap_from;
+			SetChannelShifts( m_shifts, 0, from.red_shift, from.red_mask, to.red_shift, to.red_mask );
+			SetChannelShifts( m_shifts, 1, from.green_shift, from.green_mask, to.green_shift, to.green_mask );
+			SetChannelShifts( m_shifts, 2, from.blue_shift, from.blue_mask, to.blue_shift, to.blue_mask );
+			return;
+		}
+
+		// every bit of the result comes from one bit of the source, so the
+		// result is the OR of what each source byte makes on its own
+		for( unsigned i = 0; i < from.bytes; ++i )
+			for( Uint32 b = 0; b < 256; ++b )
+				m_tables[i][b] = ConvertValue( b << ( i * 8 ) );
+		switch( from.bytes )
+		{
+		case 1:  m_table_row = PickTableRow< Uint8 >( to.bytes );   break;
+		case 2:  m_table_row = PickTableRow< Uint16 >( to.bytes );  break;
+		default: m_table_row = PickTableRow< Uint32 >( to.bytes );  break;
+		}
+	}
+
+	Uint32 PixelConverter::ConvertValue( Uint32 pixel ) const
+	{
+		if( m_swap_from )
+			pixel = m_from.bytes == 2 ? SwapPixel( (Uint16)pixel ) : SwapPixel( pixel );
+		Uint32 out = ScaleChannel( pixel, m_from.red_shift, m_from.red_mask, m_to.red_shift, m_to.red_mask )
+			| ScaleChannel( pixel, m_from.green_shift, m_from.green_mask, m_to.green_shift, m_to.green_mask )
+			| ScaleChannel( pixel, m_from.blue_shift, m_from.blue_mask, m_to.blue_shift, m_to.blue_mask );
+		if( m_swap_to )
+			out = m_to.bytes == 2 ? SwapPixel( (Uint16)out ) : SwapPixel( out );
+		else if( m_to.bytes == 3 && m_to.big_endian )
+			out = SwapPixel( out ) >> 8;   // stored lowest byte first
+		return out;
+	}
+
+	Uint32 PixelConverter::ConvertPixel( Uint32 pixel ) const
+	{
+		return ConvertValue( pixel );
+	}
+
+	void PixelConverter::ConvertRow( Uint8* dst, Uint8 const* src, unsigned count ) const
+	{
+		if( m_use_shifts )
+		{
+			m_kernels.convert32( dst, src, count, m_shifts );
+			return;
+		}
+		if( m_table_row != NULL )
+		{
+			m_table_row( m_tables, dst, src, count );
+			return;
+		}
+
+		for( ; count > 0; --count, src += m_from.bytes, dst += m_to.bytes )
+		{
+			Uint32 pixel;
+			switch( m_from.bytes )
+			{
+			case 1:  pixel = *src;  break;
+			case 2:  { Uint16 p; memcpy( &p, src, 2 ); pixel = p; }  break;
+			default: memcpy( &pixel, src, 4 );  break;
+			}
+			pixel = ConvertValue( pixel );
+			switch( m_to.bytes )
+			{
+			case 1:  StorePixel< 1 >( dst, pixel );  break;
+			case 2:  StorePixel< 2 >( dst, pixel );  break;
+			case 3:  StorePixel< 3 >( dst, pixel );  break;
+			default: StorePixel< 4 >( dst, pixel );  break;
+			}
+		}
+	}
+
+};
@@ -0,0 +1,75 @@
+/*!
+  \file pixel-converter.h
+  \brief Converts pixels from the server's layout to the display's.
+
+  Normally the display picks the pixel format and the server transcodes
+  every pixel into it. A display can instead keep the server's native
+  format, whatever its byte order and channel positions, and convert
+  here. That moves the per-pixel work from a server that may be hosting
+  many sessions to the client.
+
+  Rows go through the fastest path the pair of formats allows: the
+  vectorized BlitKernels::convert32 when both sides are 32-bit, per-byte
+  lookup tables for the other sizes, and arithmetic on each channel for
+  channel maxima that aren't 2^n - 1.
+*/
+
+#ifndef PIXEL_CONVERTER_H
+#define PIXEL_CONVERTER_H
+
+#include "vnctypes.h"
+#include "blit-kernels.h"
+
+namespace VNC
+{
+
+	class PixelConverter
+	{
+	public:
+
+		//! Constructor.
+		/*!
+		  Throws Exc if either format has a pixel size that can't be converted.
+		  \param from layout of the pixels coming in; 1, 2 or 4 bytes
+		  \param to layout to write; 1, 2, 3 (packed) or 4 bytes
+		  \param kernels kernels for the 32-bit to 32-bit case
+		*/
+		PixelConverter( PixelFormat const& from, PixelFormat const& to, BlitKernels const& kernels );
+
+		//! Converts one pixel, such as the colour of a fill.
+		/*!
+		  \param pixel pixel in the \a from format, as decoders hand it over
+		  \returns the pixel in the \a to format, ready to be stored
+		*/
+		Uint32 ConvertPixel( Uint32 pixel ) const;
+
+		//! Converts a run of pixels. Thread safe.
+		/*!
+		  \param dst where to write count pixels in the \a to format
+		  \param src count pixels in the \a from format
+		  \param count number of pixels
+		*/
+		void ConvertRow( Uint8* dst, Uint8 const* src, unsigned count ) const;
+
+	private:
+
+		//! Converts a pixel with arithmetic on each channel; what the tables are built from.
+		Uint32 ConvertValue( Uint32 pixel ) const;
+
+		//! Row converter using m_tables.
+		typedef void (*TableRowFunc)( Uint32 const (*tables)[256], Uint8* dst, Uint8 const* src, unsigned count );
+
+		PixelFormat m_from;           //!< incoming layout
+		PixelFormat m_to;             //!< outgoing layout
+		bool m_swap_from;             //!< incoming pixels aren't in the host's byte order
+		bool m_swap_to;               //!< outgoing pixels aren't in the host's byte order
+		BlitKernels const& m_kernels; //!< kernels for the 32-bit case
+		bool m_use_shifts;            //!< rows go through m_kernels.convert32
+		ChannelShifts m_shifts;       //!< how, if so
+		TableRowFunc m_table_row;     //!< otherwise the table loop for the two sizes, or NULL for ConvertValue
+		Uint32 m_tables[4][256];      //!< what each byte of an incoming pixel contributes to the outgoing one
+	};
+
+};
+
+#endif
@@ -0,0 +1,117 @@
+/*!
+  \file replay.h
+  \brief Stand-ins for the network and the screen, for the benchmarks that replay captures.
+*/
+
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include <vector>
+#include <cstring>
+#include <zlib.h>
+#include "vnc.h"
+#include "vnc-wire.h"
+
+/*!
+  \brief Plays back a capture, ignoring what the client says.
+  The server's answers are already in the capture.
+*/
+class ReplayClient : public VNC::Wire::MemoryClient
+{
+public:
+	ReplayClient( VNC::Uint8 const* data, VNC::Uint32 length ) : MemoryClient( data, length ) {}
+	virtual void SendBytes( VNC::Uint8 const*, unsigned int ) {}
+};
+
+/*!
+  \brief Display drawing into memory, in the format the client had when capturing.
+  Hands out direct rows, as SDLDisplay does for its surface.
+*/
+class MemoryDisplay : public VNC::Display
+{
+public:
+
+	/*!
+	  \param rfb RFB protocol object to work with
+	  \param bits pixel size the client asked for, or 0 for the server's format
+	*/
+	MemoryDisplay( VNC::RFBProto& rfb, int bits )
+		: Display( rfb ),
+		  m_width( rfb.GetDesktopWidth() )
+	{
+		// the layouts SDLDisplay usually ends up with; only the pixel size,
+		// and for ZRLE whether pixels fit in three bytes, affect decoding
+		VNC::PixelFormat& f = m_format;
+		switch( bits )
+		{
+		case 8:
+			f.bytes = 1;  f.bits = 8;
+			f.red_mask = 7;  f.green_mask = 7;  f.blue_mask = 3;
+			f.red_shift = 0;  f.green_shift = 3;  f.blue_shift = 6;
+			break;
+		case 16:
+			f.bytes = 2;  f.bits = 16;
+			f.red_mask = 31;  f.green_mask = 63;  f.blue_mask = 31;
+			f.red_shift = 11;  f.green_shift = 5;  f.blue_shift = 0;
+			break;
+		case 32:
+			f.bytes = 4;  f.bits = 24;
+			f.red_mask = 255;  f.green_mask = 255;  f.blue_mask = 255;
+			f.red_shift = 16;  f.green_shift = 8;  f.blue_shift = 0;
+			break;
+		}
+		if( bits != 0 )
+		{
+			f.big_endian = VNC_HOST_BIG_ENDIAN != 0;
+			f.true_color = true;
+		}
+		m_pixels.resize( (size_t)m_width * rfb.GetDesktopHeight() * m_format.bytes );
+	}
+
+	virtual void BeginDrawing() {}
+	virtual void EndDrawing( VNC::ScreenRect const& ) {}
+
+	virtual void WritePixels( int x, int y, int count, VNC::Uint8* data )
+	{
+		memcpy( Pixel( x, y ), data, count * m_format.bytes );
+	}
+
+	virtual void WriteUniformPixels( int x, int y, int count, VNC::Uint32 pixel )
+	{
+		VNC::Uint8* dst = Pixel( x, y );
+		for( int i = 0; i < count; ++i, dst += m_format.bytes )
+			memcpy( dst, &pixel, m_format.bytes );
+	}
+
+	virtual void CopyPixels( int sx, int sy, int dx, int dy, int w, int h )
+	{
+		if( sy >= dy )
+		{
+			for( int y = 0; y < h; ++y )
+				memmove( Pixel( dx, dy + y ), Pixel( sx, sy + y ), w * m_format.bytes );
+		}
+		else
+		{
+			for( int y = h-1; y >= 0; --y )
+				memmove( Pixel( dx, dy + y ), Pixel( sx, sy + y ), w * m_format.bytes );
+		}
+	}
+
+	virtual VNC::Uint8* GetDirectRow( int x, int y ) { return Pixel( x, y ); }
+
+	//! Returns the Adler-32 of the framebuffer.
+	uLong GetChecksum() const { return adler32( adler32( 0, NULL, 0 ), &m_pixels[0], m_pixels.size() ); }
+
+protected:
+
+	virtual bool UpdateInput() { return true; }
+
+private:
+
+	VNC::Uint8* Pixel( int x, int y ) { return &m_pixels[( (size_t)y * m_width + x ) * m_format.bytes]; }
+
+	int m_width;                       //!< framebuffer width, in pixels
+	std::vector< VNC::Uint8 > m_pixels; //!< the framebuffer
+};
+
+#endif
@@ -0,0 +1,88 @@
+/*!
+  \file scratch-arena.cpp
+  \brief Implementation of the decoders' scratch memory.
+*/
+
+#include "scratch-arena.h"
+
+#define SCRATCH_ALIGN        16            //!< alignment of every block handed out
+#define SCRATCH_MIN_CHUNK    ( 64 * 1024 ) //!< smallest chunk taken from the heap
+
+//! Rounds a size up to a multiple of SCRATCH_ALIGN.
+#define SCRATCH_ROUND( size ) ( ( (size) + SCRATCH_ALIGN - 1 ) & ~(size_t)( SCRATCH_ALIGN - 1 ) )
+
+namespace VNC
+{
+
+	ScratchArena::ScratchArena()
+		: m_chunks( NULL ),
+		  m_chunk_used( 0 ),
+		  m_used( 0 ),
+		  m_high_water( 0 ),
+		  m_requests( 0 ),
+		  m_heap_allocations( 0 )
+	{
+	}
+
+	ScratchArena::~ScratchArena()
+	{
+		FreeChunks();
+	}
+
+	void* ScratchArena::Allocate( size_t bytes )
+	{
+		++m_requests;
+		bytes = SCRATCH_ROUND( bytes );
+		if( m_chunks == NULL || m_chunks->size - m_chunk_used < bytes )
+		{
+			// at least double, so a growing update needs few chunks
+			size_t size = m_chunks == NULL ? SCRATCH_MIN_CHUNK : m_chunks->size * 2;
+			AddChunk( size < bytes ? bytes : size );
+		}
+		Uint8* block = (Uint8*)m_chunks + SCRATCH_ROUND( sizeof( Chunk ) ) + m_chunk_used;
+		m_chunk_used += bytes;
+		m_used += bytes;
+		return block;
+	}
+
+	void ScratchArena::Reset()
+	{
+		if( m_used > m_high_water )
+			m_high_water = m_used;
+		if( m_chunks != NULL && m_chunks->next != NULL )
+		{
+			// the space left at the ends of old chunks is wasted, so the
+			// replacement only needs room for what was actually used
+			FreeChunks();
+			AddChunk( m_high_water );
+		}
+		m_chunk_used = 0;
+		m_used = 0;
+	}
+
+	size_t ScratchArena::GetHighWater() const
+	{
+		return m_used > m_high_water ? m_used : m_high_water;
+	}
+
+	void ScratchArena::AddChunk( size_t size )
+	{
+		Chunk* chunk = (Chunk*)new Uint8[SCRATCH_ROUND( sizeof( Chunk ) ) + size];
+		chunk->next = m_chunks;
+		chunk->size = size;
+		m_chunks = chunk;
+		m_chunk_used = 0;
+		++m_heap_allocations;
+	}
+
+	void ScratchArena::FreeChunks()
+	{
+		while( m_chunks != NULL )
+		{
+			Chunk* next = m_chunks->next;
+			delete[] (Uint8*)m_chunks;
+			m_chunks = next;
+		}
+	}
+
+};
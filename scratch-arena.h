@@ -0,0 +1,128 @@
+/*!
+  \file scratch-arena.h
+  \brief Per-session scratch memory for decoders.
+
+  Decoders need temporary buffers for every rectangle: received pixels,
+  rows on their way to the display, compressed data waiting for a
+  worker. Rather than going to the heap each time, they take them from
+  a ScratchArena, which the protocol empties after each framebuffer
+  update. The arena keeps the memory it got, so once it has seen the
+  largest update of a session it stops allocating altogether.
+*/
+
+#ifndef SCRATCH_ARENA_H
+#define SCRATCH_ARENA_H
+
+#include <cstddef>
+#include <cstring>
+#include "vnctypes.h"
+
+#define SCRATCH_BYTES_MIN  4096   //!< smallest block a ScratchBytes takes
+
+namespace VNC
+{
+
+	class ScratchArena
+	{
+	public:
+
+		ScratchArena();
+		~ScratchArena();
+
+		//! Hands out memory that stays valid until the next Reset.
+		/*!
+		  The memory is uninitialized and aligned for any pixel or vector type.
+		  Not thread safe; only the network thread allocates.
+		  \param bytes size of the block
+		  \returns the block
+		*/
+		void* Allocate( size_t bytes );
+
+		//! Hands out an array of count Ts; see Allocate( size_t ).
+		template< typename T >
+		T* Allocate( size_t count ) { return (T*)Allocate( count * sizeof( T ) ); }
+
+		//! Takes back everything handed out since the last reset.
+		/*!
+		  If the memory came from more than one heap block, they are
+		  replaced by a single block big enough for all of it, so the same
+		  load fits without further heap allocations.
+		*/
+		void Reset();
+
+		//! Retrieves the number of blocks handed out.
+		unsigned long GetNumRequests() const { return m_requests; }
+
+		//! Retrieves the number of times the arena had to go to the heap.
+		unsigned long GetNumHeapAllocations() const { return m_heap_allocations; }
+
+		//! Retrieves the most memory in use between two resets, in bytes.
+		size_t GetHighWater() const;
+
+	private:
+
+		// blocks are handed out by address, so the arena isn't copied
+		ScratchArena( ScratchArena const& );
+		ScratchArena& operator=( ScratchArena const& );
+
+		//! A piece of heap memory, with the blocks handed out following the header.
+		struct Chunk
+		{
+			Chunk* next;    //!< next older chunk
+			size_t size;    //!< usable bytes after the header
+		};
+
+		//! Allocates a chunk and makes it the current one.
+		void AddChunk( size_t size );
+
+		//! Frees every chunk.
+		void FreeChunks();
+
+		Chunk* m_chunks;                     //!< chunks, the one being handed out first
+		size_t m_chunk_used;                 //!< bytes handed out from the current chunk
+		size_t m_used;                       //!< bytes handed out since the last reset
+		size_t m_high_water;                 //!< most bytes handed out between two resets
+		unsigned long m_requests;            //!< blocks handed out
+		unsigned long m_heap_allocations;    //!< chunks allocated
+	};
+
+	//! Bytes in scratch memory, growing as more are added.
+	struct ScratchBytes
+	{
+		ScratchBytes() : data( NULL ), length( 0 ), capacity( 0 ) {}
+
+		//! Makes room for more data at the end.
+		/*!
+		  Moves the data if it has to, so offsets into it stay valid but
+		  pointers don't. What it moves out of stays in the arena until reset.
+		  \param scratch memory to grow into
+		  \param count bytes to add
+		  \param min_size smallest block to take when growing
+		  \returns where they go
+		*/
+		Uint8* Append( ScratchArena& scratch, Uint32 count, Uint32 min_size = SCRATCH_BYTES_MIN )
+		{
+			if( length + count > capacity )
+			{
+				Uint32 size = capacity * 2 > length + count ? capacity * 2 : length + count;
+				if( size < min_size )
+					size = min_size;
+				Uint8* bigger = scratch.Allocate< Uint8 >( size );
+				if( length > 0 )
+					memcpy( bigger, data, length );
+				data = bigger;
+				capacity = size;
+			}
+			Uint8* at = data + length;
+			length += count;
+			return at;
+		}
+
+		Uint8* data;        //!< the bytes
+		Uint32 length;      //!< bytes in use
+		Uint32 capacity;    //!< bytes available at data
+	};
+
+};
+
+#endif
@@ -0,0 +1,169 @@
+/*!
+  \file tile-hashes.cpp
+  \brief Finds which parts of a framebuffer really changed.
+*/
+
+#include <cstring>
+#include "tile-hashes.h"
+
+namespace VNC
+{
+
+	static inline Uint32 Rotate( Uint32 x, int n )
+	{
+		return ( x << n ) | ( x >> ( 32 - n ) );
+	}
+
+	// spreads every bit of a lane over the whole word
+	static inline Uint32 Finish( Uint32 h )
+	{
+		h ^= h >> 16;
+		h *= 0x85ebca6b;
+		h ^= h >> 13;
+		h *= 0xc2b2ae35;
+		h ^= h >> 16;
+		return h;
+	}
+
+	TileHashes::TileHashes( int width, int height, int bpp )
+		: m_width( width ),
+		  m_height( height ),
+		  m_bpp( bpp ),
+		  m_columns( ( width + TILE_HASH_SIZE - 1 ) / TILE_HASH_SIZE ),
+		  m_pass( 0 ),
+		  m_num_tiles( 0 ),
+		  m_num_unchanged( 0 ),
+		  m_num_pixels( 0 ),
+		  m_num_kept( 0 )
+	{
+		int tiles = m_columns * ( ( height + TILE_HASH_SIZE - 1 ) / TILE_HASH_SIZE );
+		m_hashes.resize( tiles * 2 );
+		m_known.resize( tiles, 0 );
+		m_checked.resize( tiles, 0 );
+		m_changed.resize( tiles, 0 );
+	}
+
+	void TileHashes::HashTile( int tx, int ty, Uint8 const* const* rows, Uint32 hash[2] ) const
+	{
+		int x = tx * TILE_HASH_SIZE, y = ty * TILE_HASH_SIZE;
+		int w = m_width - x < TILE_HASH_SIZE ? m_width - x : TILE_HASH_SIZE;
+		int h = m_height - y < TILE_HASH_SIZE ? m_height - y : TILE_HASH_SIZE;
+		unsigned bytes = w * m_bpp;
+
+		// alternate words go to alternate accumulators, so the multiplies
+		// of one don't wait on the other; each step is reversible, so a
+		// single changed word always changes the result
+		Uint32 a0 = 0x811c9dc5, a1 = 0x2545f491, b0 = 0x9e3779b9, b1 = 0x7f4a7c15;
+		for( int row = y; row < y + h; ++row )
+		{
+			Uint8 const* p = rows[row] + x * m_bpp;
+			unsigned i = 0;
+			for( ; i + 8 <= bytes; i += 8 )
+			{
+				Uint32 w0, w1;
+				memcpy( &w0, p + i, 4 );
+				memcpy( &w1, p + i + 4, 4 );
+				a0 = ( a0 ^ w0 ) * 0x01000193;
+				b0 = Rotate( b0 ^ w0, 15 ) * 0x85ebca77;
+				a1 = ( a1 ^ w1 ) * 0x01000193;
+				b1 = Rotate( b1 ^ w1, 15 ) * 0x85ebca77;
+			}
+			if( i < bytes )
+			{
+				// every row of a tile is the same length, so padding the end
+				// with zeros can't make two tiles alike
+				Uint32 w0 = 0, w1 = 0;
+				unsigned n = bytes - i;
+				memcpy( &w0, p + i, n < 4 ? n : 4 );
+				if( n > 4 )
+					memcpy( &w1, p + i + 4, n - 4 );
+				a0 = ( a0 ^ w0 ) * 0x01000193;
+				b0 = Rotate( b0 ^ w0, 15 ) * 0x85ebca77;
+				a1 = ( a1 ^ w1 ) * 0x01000193;
+				b1 = Rotate( b1 ^ w1, 15 ) * 0x85ebca77;
+			}
+		}
+		hash[0] = Finish( a0 ^ Rotate( a1, 16 ) );
+		hash[1] = Finish( b0 ^ Rotate( b1, 16 ) );
+	}
+
+	void TileHashes::Filter( DamageList const& damage, Uint8 const* const* rows, DamageList& changed )
+	{
+		if( ++m_pass == 0 )
+		{
+			// the pass numbers have wrapped; forget the old ones
+			m_checked.assign( m_checked.size(), 0 );
+			m_pass = 1;
+		}
+
+		// hash each tile the damage touches, once however many rectangles touch it
+		std::vector< ScreenRect > const& rects = damage.GetRects();
+		for( unsigned i = 0; i < rects.size(); ++i )
+		{
+			ScreenRect const& rect = rects[i];
+			if( rect.w == 0 || rect.h == 0 )
+				continue;
+			for( int ty = rect.y / TILE_HASH_SIZE; ty <= ( rect.y + rect.h - 1 ) / TILE_HASH_SIZE; ++ty )
+				for( int tx = rect.x / TILE_HASH_SIZE; tx <= ( rect.x + rect.w - 1 ) / TILE_HASH_SIZE; ++tx )
+				{
+					int t = ty * m_columns + tx;
+					if( m_checked[t] == m_pass )
+						continue;
+					m_checked[t] = m_pass;
+
+					Uint32 hash[2];
+					HashTile( tx, ty, rows, hash );
+					++m_num_tiles;
+					if( m_known[t] && hash[0] == m_hashes[t * 2] && hash[1] == m_hashes[t * 2 + 1] )
+					{
+						m_changed[t] = 0;
+						++m_num_unchanged;
+						continue;
+					}
+					m_hashes[t * 2] = hash[0];
+					m_hashes[t * 2 + 1] = hash[1];
+					m_known[t] = 1;
+					m_changed[t] = 1;
+				}
+		}
+
+		// keep what falls on tiles that changed, a run of them across at a time
+		for( unsigned i = 0; i < rects.size(); ++i )
+		{
+			ScreenRect const& rect = rects[i];
+			if( rect.w == 0 || rect.h == 0 )
+				continue;
+			m_num_pixels += (unsigned long)rect.w * rect.h;
+			int tx1 = rect.x / TILE_HASH_SIZE, tx2 = ( rect.x + rect.w - 1 ) / TILE_HASH_SIZE;
+			for( int ty = rect.y / TILE_HASH_SIZE; ty <= ( rect.y + rect.h - 1 ) / TILE_HASH_SIZE; ++ty )
+			{
+				int y1 = ty * TILE_HASH_SIZE > rect.y ? ty * TILE_HASH_SIZE : rect.y;
+				int y2 = ( ty + 1 ) * TILE_HASH_SIZE < rect.y + rect.h ? ( ty + 1 ) * TILE_HASH_SIZE : rect.y + rect.h;
+				for( int tx = tx1; tx <= tx2; )
+				{
+					if( !m_changed[ty * m_columns + tx] )
+					{
+						++tx;
+						continue;
+					}
+					int start = tx;
+					while( tx <= tx2 && m_changed[ty * m_columns + tx] )
+						++tx;
+					int x1 = start * TILE_HASH_SIZE > rect.x ? start * TILE_HASH_SIZE : rect.x;
+					int x2 = tx * TILE_HASH_SIZE < rect.x + rect.w ? tx * TILE_HASH_SIZE : rect.x + rect.w;
+					changed.Add( ScreenRect( x1, y1, x2 - x1, y2 - y1 ) );
+					m_num_kept += (unsigned long)( x2 - x1 ) * ( y2 - y1 );
+				}
+			}
+		}
+	}
+
+	void TileHashes::GetStats( unsigned long& tiles, unsigned long& unchanged, unsigned long& pixels, unsigned long& kept ) const
+	{
+		tiles = m_num_tiles;
+		unchanged = m_num_unchanged;
+		pixels = m_num_pixels;
+		kept = m_num_kept;
+	}
+
+};
@@ -0,0 +1,81 @@
+/*!
+  \file tile-hashes.h
+  \brief Finds which parts of a framebuffer really changed.
+
+  Servers often resend areas whose pixels are the same as before: a
+  blinking caret drawn back as it was, or a timer refreshing the whole
+  screen. A shadow framebuffer can be split into fixed tiles with a hash
+  of each, kept up to date as damage comes in; damage falling on tiles
+  whose hash didn't change needn't be presented at all.
+
+  Hashes are 64 bits, made from two 32-bit lanes mixed differently, so a
+  change going unnoticed is vanishingly unlikely rather than impossible.
+*/
+
+#ifndef TILE_HASHES_H
+#define TILE_HASHES_H
+
+#include <vector>
+#include "vnctypes.h"
+#include "damage-list.h"
+
+#define TILE_HASH_SIZE  32   //!< width and height of a tile, in pixels
+
+namespace VNC
+{
+
+	class TileHashes
+	{
+	public:
+
+		//! Constructor. No tile is known yet, so the first damage to each is always kept.
+		/*!
+		  \param width framebuffer width, in pixels
+		  \param height framebuffer height, in pixels
+		  \param bpp bytes per pixel
+		*/
+		TileHashes( int width, int height, int bpp );
+
+		//! Keeps only the damage on tiles whose pixels changed since they were last hashed.
+		/*!
+		  Each tile touched by the damage is hashed once, whole, and its
+		  hash remembered; of the damage, only the parts on tiles whose
+		  hash differs are added to \a changed.
+		  \param damage areas drawn
+		  \param rows where each row of the framebuffer is
+		  \param changed where to add the areas worth presenting
+		*/
+		void Filter( DamageList const& damage, Uint8 const* const* rows, DamageList& changed );
+
+		//! Retrieves how much damage was filtered, and how much of it was kept.
+		/*!
+		  \param tiles tiles hashed
+		  \param unchanged of those, tiles that hashed as before
+		  \param pixels pixels of damage filtered
+		  \param kept of those, pixels kept for presenting
+		*/
+		void GetStats( unsigned long& tiles, unsigned long& unchanged, unsigned long& pixels, unsigned long& kept ) const;
+
+	private:
+
+		//! Hashes the pixels of one tile.
+		void HashTile( int tx, int ty, Uint8 const* const* rows, Uint32 hash[2] ) const;
+
+		int m_width;                   //!< framebuffer width, in pixels
+		int m_height;                  //!< framebuffer height, in pixels
+		int m_bpp;                     //!< bytes per pixel
+		int m_columns;                 //!< tiles across
+		std::vector< Uint32 > m_hashes; //!< two words for each tile, row by row
+		std::vector< Uint8 > m_known;  //!< whether each tile's hash has been taken yet
+		std::vector< Uint32 > m_checked; //!< the Filter call that last hashed each tile
+		std::vector< Uint8 > m_changed; //!< whether it changed then
+		Uint32 m_pass;                 //!< number of the current Filter call
+		unsigned long m_num_tiles;     //!< tiles hashed
+		unsigned long m_num_unchanged; //!< tiles that hashed as before
+		unsigned long m_num_pixels;    //!< pixels of damage filtered
+		unsigned long m_num_kept;      //!< pixels kept
+	};
+
+};
+
+#endif
@@ -109,10 +109,24 @@ static Uint32 XlateSDLtoX11( int keysym )
 namespace VNC
 {
 
-	SDLDisplay::SDLDisplay( RFBProto& rfb )
+	SDLDisplay::SDLDisplay( RFBProto& rfb, bool native_format, bool shadow, int present_rate, bool tile_hashing )
 		: Display( rfb ),
 		  m_display( NULL ),
-		  m_quit( false )
+		  m_quit( false ),
+		  m_kernels( GetBlitKernels() ),
+		  m_native_format( native_format ),
+		  m_converter( NULL ),
+		  m_shadow( shadow || present_rate > 0 || tile_hashing ),
+		  m_row_bytes( 0 ),
+		  m_tile_hashes( NULL ),
+		  m_in_update( false ),
+		  m_present_rate( present_rate ),
+		  m_present_thread( NULL ),
+		  m_frame_mutex( NULL ),
+		  m_frame_cond( NULL ),
+		  m_present_quit( false ),
+		  m_num_updates( 0 ),
+		  m_num_frames( 0 )
 	{
 		if( SDL_Init( SDL_INIT_VIDEO ) < 0 )
 			throw ExcSDLInit();
@@ -125,6 +139,29 @@ namespace VNC
 			throw ExcSDLVideo();
 
 		ReconcilePixelFormat();
+
+		m_row_bytes = m_display->w * m_display->format->BytesPerPixel;
+		m_rows.resize( m_display->h );
+		if( m_shadow )
+		{
+			// rows start 16 bytes apart, whatever order they end up in
+			int stride = ( m_row_bytes + 15 ) & ~15;
+			m_shadow_pixels.resize( (size_t)stride * m_display->h );
+			for( int y = 0; y < m_display->h; ++y )
+				m_rows[y] = &m_shadow_pixels[(size_t)stride * y];
+			if( tile_hashing )
+				m_tile_hashes = new TileHashes( m_display->w, m_display->h, m_display->format->BytesPerPixel );
+
+			// a second framebuffer holds the last finished update, so the
+			// presentation thread never waits on one being received
+			if( present_rate > 0 )
+			{
+				m_frame_pixels.resize( m_shadow_pixels.size() );
+				m_frame_rows.resize( m_display->h );
+				for( int y = 0; y < m_display->h; ++y )
+					m_frame_rows[y] = &m_frame_pixels[(size_t)stride * y];
+			}
+		}
 		
 		SDL_UpdateRect( m_display, 0, 0, 0, 0 );
 		SDL_WM_SetCaption( m_rfb.GetDesktopName().c_str(),
@@ -132,15 +169,50 @@ namespace VNC
 		SDL_EnableKeyRepeat( SDL_DEFAULT_REPEAT_DELAY,
 							 SDL_DEFAULT_REPEAT_INTERVAL );
 
+		if( m_present_rate > 0 )
+		{
+			m_frame_mutex = SDL_CreateMutex();
+			m_frame_cond = SDL_CreateCond();
+			if( m_frame_mutex != NULL && m_frame_cond != NULL )
+				m_present_thread = SDL_CreateThread( PresentThread, this );
+			if( m_present_thread == NULL )
+			{
+				StopPresenting();
+				throw ExcSDLThread();
+			}
+		}
+
 		ScreenRect rect( 0, 0, m_rfb.GetDesktopWidth(), m_rfb.GetDesktopHeight() );
 		rfb.SendUpdateRequest( rect, false );
 	}
 
 	SDLDisplay::~SDLDisplay()
 	{
+		StopPresenting();
+		delete m_tile_hashes;
+		delete m_converter;
 		SDL_Quit();
 	}
 
+	void SDLDisplay::StopPresenting()
+	{
+		if( m_present_thread != NULL )
+		{
+			SDL_LockMutex( m_frame_mutex );
+			m_present_quit = true;
+			SDL_CondSignal( m_frame_cond );
+			SDL_UnlockMutex( m_frame_mutex );
+			SDL_WaitThread( m_present_thread, NULL );
+			m_present_thread = NULL;
+		}
+		if( m_frame_cond != NULL )
+			SDL_DestroyCond( m_frame_cond );
+		if( m_frame_mutex != NULL )
+			SDL_DestroyMutex( m_frame_mutex );
+		m_frame_cond = NULL;
+		m_frame_mutex = NULL;
+	}
+
 	bool SDLDisplay::CheckKeyCombos()
 	{
 		SDLMod mod = SDL_GetModState();
@@ -238,6 +310,7 @@ namespace VNC
 
 	void SDLDisplay::ReconcilePixelFormat()
 	{
+		PixelFormat server = m_format;
 		switch( m_display->format->BytesPerPixel )
 		{
 		case 1:   Setup8bpp();     break;
@@ -246,6 +319,19 @@ namespace VNC
 		case 4:   Setup16or32bit(); break;
 		default:  throw Exc( "strange color depth returned from SDL" );
 		}		
+
+		// the server's own format is only any use if we can draw it; if not,
+		// the surface's format is asked for instead, as without -n
+		if( m_native_format && IsTrueColor( server ) )
+		{
+			// m_format now describes the surface, apart from its size
+			PixelFormat surface = m_format;
+			surface.bytes = m_display->format->BytesPerPixel;
+			surface.bits = m_display->format->BitsPerPixel;
+			if( !SamePixelLayout( server, surface ) )
+				m_converter = new PixelConverter( server, surface, m_kernels );
+			m_format = server;
+		}
 	}
 
 	// returns the number of bits in a solid bitmask	
@@ -270,7 +356,7 @@ namespace VNC
 		int gshift = 2;
 		int bshift = 0;
 		
-		if( m_format.bytes == 1 )
+		if( m_format.bytes == 1 && IsTrueColor( m_format ) )
 		{
 			// take the server's preferred values if possible
 			rbits = MaskSize( m_format.red_mask );
@@ -282,8 +368,8 @@ namespace VNC
 		}
 
 		int rmask = (1 << rbits) - 1;
-		int gmask = (1 << rbits) - 1;
-		int bmask = (1 << rbits) - 1;
+		int gmask = (1 << gbits) - 1;
+		int bmask = (1 << bbits) - 1;
 		
 		SDL_Color colormap[256];
 		for( Uint32 i = 0; i < 256; ++i )
@@ -303,6 +389,7 @@ namespace VNC
 		m_format.green_shift = gshift;
 		m_format.blue_shift = bshift;
 		m_format.big_endian = 0;
+		m_format.true_color = true;
 	}
 
 	void SDLDisplay::Setup16or32bit()
@@ -320,120 +407,398 @@ namespace VNC
 #else
 		m_format.big_endian = false;
 #endif
+		m_format.true_color = true;
 	}
 	
+	void SDLDisplay::SetSurfaceRows()
+	{
+		// a locked surface may have moved since it was last locked
+		Uint8* pixels = (Uint8*)m_display->pixels;
+		if( m_rows[0] == pixels )
+			return;
+		for( int y = 0; y < m_display->h; ++y )
+			m_rows[y] = pixels + m_display->pitch * y;
+	}
+
 	void SDLDisplay::BeginDrawing()
 	{
+		// within an update everything is already prepared
+		if( m_in_update )
+			return;
+
+		// the shadow framebuffer is ours; the surface is only needed to present
+		if( m_shadow )
+			return;
+
 		// prepare the surface for drawing
 		SDL_LockSurface( m_display );
+		SetSurfaceRows();
 	}
 		
 	void SDLDisplay::EndDrawing( ScreenRect const& rect )
 	{
-		// release the surface
-		SDL_UnlockSurface( m_display );
-		SDL_UpdateRect( m_display, rect.x, rect.y, rect.w, rect.h );
+		m_damage.Add( rect );
+		if( !m_in_update )
+			FinishDrawing();
 	}
-	
-	void SDLDisplay::WritePixels( int x, int y, int count, Uint8* data )
+
+	void SDLDisplay::BeginUpdate()
 	{
-		int bpp = m_display->format->BytesPerPixel;
-		if (bpp == 3) 
+		BeginDrawing();
+		m_in_update = true;
+	}
+
+	void SDLDisplay::EndUpdate()
+	{
+		m_in_update = false;
+		FinishDrawing();
+	}
+
+	void SDLDisplay::FinishDrawing()
+	{
+		if( m_present_thread != NULL )
 		{
-			Uint8* pixels = (Uint8*)m_display->pixels + m_display->pitch * y + x * bpp;
-			while (count > 0) {
-				*pixels++ = *data++;
-				*pixels++ = *data++;
-				*pixels++ = *data++;
-				*data++;
-			    count--;
+			// copy the damage into the presented frame and hand it over;
+			// whatever the presentation thread hasn't shown yet is merged
+			// with it, and shown as one frame
+			SDL_LockMutex( m_frame_mutex );
+			DamageList const* finished = &m_damage;
+			if( m_tile_hashes != NULL )
+			{
+				m_changed.Clear();
+				m_tile_hashes->Filter( m_damage, &m_rows[0], m_changed );
+				finished = &m_changed;
+			}
+			int bpp = m_display->format->BytesPerPixel;
+			std::vector< ScreenRect > const& rects = finished->GetRects();
+			for( unsigned i = 0; i < rects.size(); ++i )
+			{
+				ScreenRect const& rect = rects[i];
+				for( int y = rect.y; y < rect.y + rect.h; ++y )
+					m_kernels.copy( m_frame_rows[y] + rect.x * bpp, m_rows[y] + rect.x * bpp, rect.w * bpp );
+				m_pending.Add( rect );
 			}
+			m_damage.Clear();
+			++m_num_updates;
+			SDL_CondSignal( m_frame_cond );
+			SDL_UnlockMutex( m_frame_mutex );
+			return;
 		}
+
+		// tiles drawn back as they were needn't go anywhere
+		DamageList const* shown = &m_damage;
+		if( m_tile_hashes != NULL )
+		{
+			m_changed.Clear();
+			m_tile_hashes->Filter( m_damage, &m_rows[0], m_changed );
+			shown = &m_changed;
+		}
+
+		if( m_shadow )
+			CopyShadow( shown->GetRects(), m_rows );
 		else
+			SDL_UnlockSurface( m_display );
+		ShowRects( shown->GetRects() );
+		m_damage.Clear();
+		++m_num_updates;
+		++m_num_frames;
+	}
+
+	void SDLDisplay::CopyShadow( std::vector< ScreenRect > const& rects, std::vector< Uint8* > const& rows )
+	{
+		// resolve the rows into the surface's layout
+		SDL_LockSurface( m_display );
+		int bpp = m_display->format->BytesPerPixel;
+		for( unsigned i = 0; i < rects.size(); ++i )
+		{
+			ScreenRect const& rect = rects[i];
+			Uint8* pixels = (Uint8*)m_display->pixels + m_display->pitch * rect.y + rect.x * bpp;
+			for( int y = rect.y; y < rect.y + rect.h; ++y, pixels += m_display->pitch )
+				m_kernels.copy( pixels, rows[y] + rect.x * bpp, rect.w * bpp );
+		}
+		SDL_UnlockSurface( m_display );
+	}
+
+	void SDLDisplay::ShowRects( std::vector< ScreenRect > const& rects )
+	{
+		// show everything drawn at once
+		m_update_rects.resize( rects.size() );
+		for( unsigned i = 0; i < rects.size(); ++i )
 		{
-			Uint8* pixels = (Uint8*)m_display->pixels;
-			memcpy( pixels + m_display->pitch * y + x * bpp, data, count * bpp );
+			m_update_rects[i].x = rects[i].x;
+			m_update_rects[i].y = rects[i].y;
+			m_update_rects[i].w = rects[i].w;
+			m_update_rects[i].h = rects[i].h;
 		}
+		if( !m_update_rects.empty() )
+			SDL_UpdateRects( m_display, m_update_rects.size(), &m_update_rects[0] );
 	}
 
+	void SDLDisplay::GetPresentStats( unsigned long& updates, unsigned long& frames ) const
+	{
+		if( m_frame_mutex != NULL )
+			SDL_LockMutex( m_frame_mutex );
+		updates = m_num_updates;
+		frames = m_num_frames;
+		if( m_frame_mutex != NULL )
+			SDL_UnlockMutex( m_frame_mutex );
+	}
+
+	bool SDLDisplay::GetTileHashStats( unsigned long& tiles, unsigned long& unchanged, unsigned long& pixels, unsigned long& kept ) const
+	{
+		if( m_tile_hashes == NULL )
+			return false;
+		if( m_frame_mutex != NULL )
+			SDL_LockMutex( m_frame_mutex );
+		m_tile_hashes->GetStats( tiles, unchanged, pixels, kept );
+		if( m_frame_mutex != NULL )
+			SDL_UnlockMutex( m_frame_mutex );
+		return true;
+	}
+
+	int SDLDisplay::PresentThread( void* _display )
+	{
+		SDLDisplay* display = (SDLDisplay*)_display;
+		display->PresentFrames();
+		return 0;
+	}
+
+	void SDLDisplay::PresentFrames()
+	{
+		Uint32 interval = 1000 / m_present_rate;
+		Uint32 next = SDL_GetTicks();
+		std::vector< ScreenRect > rects;
+		SDL_LockMutex( m_frame_mutex );
+		for( ;; )
+		{
+			while( m_pending.IsEmpty() && !m_present_quit )
+				SDL_CondWait( m_frame_cond, m_frame_mutex );
+			if( m_present_quit )
+				break;
+
+			// wait for the frame to be due, letting the network thread carry
+			// on; updates that finish meanwhile are shown together, and the
+			// states between them never are
+			Uint32 now = SDL_GetTicks();
+			if( (Sint32)( next - now ) > 0 )
+			{
+				SDL_UnlockMutex( m_frame_mutex );
+				SDL_Delay( next - now );
+				SDL_LockMutex( m_frame_mutex );
+				if( m_present_quit )
+					break;
+				now = next;
+			}
+
+			// the network thread only copies whole updates into the frame,
+			// under the lock, so while we have it the frame is between updates
+			rects = m_pending.GetRects();
+			m_pending.Clear();
+			CopyShadow( rects, m_frame_rows );
+			++m_num_frames;
+			SDL_UnlockMutex( m_frame_mutex );
+
+			ShowRects( rects );
+			next = now + interval;   // from when this frame was due, or later if it was late
+			SDL_LockMutex( m_frame_mutex );
+		}
+		SDL_UnlockMutex( m_frame_mutex );
+	}
 	
+	void SDLDisplay::WritePixels( int x, int y, int count, Uint8* data )
+	{
+		int bpp = m_display->format->BytesPerPixel;
+		Uint8* pixels = m_rows[y] + x * bpp;
+		if( m_converter )
+			m_converter->ConvertRow( pixels, data, count );
+		else if( bpp == 3 )
+			m_kernels.pack32to24( pixels, data, count );
+		else
+			m_kernels.copy( pixels, data, count * bpp );
+	}
+
 	void SDLDisplay::WriteUniformPixels( int x, int y, int count, Uint32 pixel )
 	{
 		int bpp = m_display->format->BytesPerPixel;
+		Uint8* pixels = m_rows[y] + x * bpp;
+		pixel = SurfacePixel( pixel );
 		switch( bpp )
 		{
-		case 1:
-			{
-				Uint8 val = (Uint8)pixel;
-				Uint8* pixels = (Uint8*)m_display->pixels;
-				memset( pixels + m_display->pitch * y + x * bpp, val, count );				
-			}
-			break;
-			
-		case 2:
-			{
-				Uint16 val = (Uint16)pixel;
-				Uint16* pixels = (Uint16*)((Uint8*)m_display->pixels + m_display->pitch * y) + x;
-				Uint16* end = pixels + count;
-				while( pixels < end )
-				{
-					*pixels = val;
-					++pixels;
-				}
-			}
-			break;
-		case 3:
-			{
-				Uint8* pixels = (Uint8*)((Uint8*)m_display->pixels + m_display->pitch * y) + x * bpp;
-				while( count > 0 )
-				{
-					*pixels++ = pixel & 0xff;
-		            *pixels++ = (pixel >> 8) & 0xff;
-		            *pixels++ = (pixel >> 16) & 0xff;
-		            count--;
-				}
-			}
-			break;
-			
-		case 4:
-			{
-				Uint32* pixels = (Uint32*)((Uint8*)m_display->pixels + m_display->pitch * y) + x;
-				Uint32* end = pixels + count;
-				while( pixels < end )
-				{
-					*pixels = pixel;
-					++pixels;
-				}				
-			}
-			break;
-			
-		default:
-			throw Exc( "invalid color depth for WriteUniformPixels" );
+		case 1:  m_kernels.fill8( pixels, (Uint8)pixel, count );    break;
+		case 2:  m_kernels.fill16( pixels, (Uint16)pixel, count );  break;
+		case 3:  m_kernels.fill24( pixels, pixel, count );          break;
+		case 4:  m_kernels.fill32( pixels, pixel, count );          break;
+		default: throw Exc( "invalid color depth for WriteUniformPixels" );
 		}
 	}
 	
 	void SDLDisplay::CopyPixels( int sx, int sy, int dx, int dy, int w, int h )
 	{
 		int bpp = m_display->format->BytesPerPixel;
-		Uint8* pixels = (Uint8*)m_display->pixels;
-		if( sy > dy )
+		if( m_shadow && sx == 0 && dx == 0 && w == m_display->w && sy != dy )
+		{
+			ScrollRows( sy, dy, h );
+			return;
+		}
+
+		if( sy == dy )
 		{
+			// the rows may overlap themselves
 			for( int y = 0; y < h; ++y )
-			{
-				memcpy( pixels + m_display->pitch * (dy + y) + (dx * bpp),
-						pixels + m_display->pitch * (sy + y) + (sx * bpp),
-						w * bpp );
-			}
+				memmove( m_rows[dy + y] + dx * bpp, m_rows[sy + y] + sx * bpp, w * bpp );
+		}
+		else if( sy > dy )
+		{
+			for( int y = 0; y < h; ++y )
+				m_kernels.copy( m_rows[dy + y] + dx * bpp, m_rows[sy + y] + sx * bpp, w * bpp );
 		}
 		else
 		{
 			for( int y = h-1; y >= 0; --y )
-			{
-				memcpy( pixels + m_display->pitch * (dy + y) + (dx * bpp),
-						 pixels + m_display->pitch * (sy + y) + (sx * bpp),
-						 w * bpp );
-			}
+				m_kernels.copy( m_rows[dy + y] + dx * bpp, m_rows[sy + y] + sx * bpp, w * bpp );
+		}
+	}
+
+	void SDLDisplay::ScrollRows( int sy, int dy, int h )
+	{
+		// the destination rows that aren't also source rows give up their
+		// buffers... Scrolls of other bands can run at the same time with
+		// -r, each on rows of its own, so the spare buffers are kept here
+		int offset = dy - sy;
+		std::vector< Uint8* > spare_rows;
+		spare_rows.reserve( offset > 0 ? offset : -offset );
+		for( int y = dy; y < dy + h; ++y )
+		{
+			if( y < sy || y >= sy + h )
+				spare_rows.push_back( m_rows[y] );
+		}
+
+		// ...the destination takes over the source rows' buffers, working
+		// away from the direction of the move so none is overwritten early...
+		if( offset > 0 )
+		{
+			for( int y = dy + h - 1; y >= dy; --y )
+				m_rows[y] = m_rows[y - offset];
+		}
+		else
+		{
+			for( int y = dy; y < dy + h; ++y )
+				m_rows[y] = m_rows[y - offset];
+		}
+
+		// ...and the source rows left uncovered, which now share a buffer
+		// with a destination row, get the spare ones back with a copy of
+		// their pixels; only as many rows as the distance moved
+		for( int y = sy; y < sy + h; ++y )
+		{
+			if( y >= dy && y < dy + h )
+				continue;
+			Uint8* row = spare_rows.back();
+			spare_rows.pop_back();
+			m_kernels.copy( row, m_rows[y], m_row_bytes );
+			m_rows[y] = row;
 		}
 	}
 	
+	//! Fills a rectangle of the framebuffer with one of the fill kernels.
+	/*!
+	  \param fill kernel for the surface's depth
+	  \param rows where each row of the framebuffer is
+	  \param run_pitch bytes from one row to the next if they are evenly spaced, or 0
+	  \param bpp bytes per pixel of the surface
+	  \param rect area to fill
+	  \param pixel pixel value
+	*/
+	template< typename PIXEL >
+	static void FillRows( void (*fill)( Uint8*, PIXEL, unsigned ), Uint8* const* rows, int run_pitch, int bpp, ScreenRect const& rect, PIXEL pixel )
+	{
+		if( rect.w * bpp == run_pitch )
+		{
+			// whole rows with nothing between them are one run
+			fill( rows[rect.y] + rect.x * bpp, pixel, rect.w * rect.h );
+			return;
+		}
+		for( int y = rect.y; y < rect.y + rect.h; ++y )
+			fill( rows[y] + rect.x * bpp, pixel, rect.w );
+	}
+
+	void SDLDisplay::WriteRect( ScreenRect const& rect, Uint8 const* data, int pitch )
+	{
+		int bpp = m_display->format->BytesPerPixel;
+		Uint8* const* rows = &m_rows[rect.y];
+		if( m_converter )
+		{
+			for( int y = 0; y < rect.h; ++y, data += pitch )
+				m_converter->ConvertRow( rows[y] + rect.x * bpp, data, rect.w );
+			return;
+		}
+		if( bpp == 3 )
+		{
+			// our pixels are 32-bit; the surface keeps three bytes of each
+			for( int y = 0; y < rect.h; ++y, data += pitch )
+				m_kernels.pack32to24( rows[y] + rect.x * bpp, data, rect.w );
+			return;
+		}
+
+		int row_bytes = rect.w * bpp;
+		if( !m_shadow && pitch == row_bytes && m_display->pitch == row_bytes )
+		{
+			// full width rows line up on both sides; one copy does them all
+			m_kernels.copy( rows[0], data, row_bytes * rect.h );
+			return;
+		}
+		for( int y = 0; y < rect.h; ++y, data += pitch )
+			m_kernels.copy( rows[y] + rect.x * bpp, data, row_bytes );
+	}
+
+	void SDLDisplay::FillRect( ScreenRect const& rect, Uint32 pixel )
+	{
+		SolidRect fill;
+		fill.rect = rect;
+		fill.pixel = pixel;
+		FillRects( &fill, 1 );
+	}
+
+	void SDLDisplay::FillRects( SolidRect const* rects, int count )
+	{
+		// the depth is the same for every rectangle, so pick the kernel once
+		Uint8* const* rows = &m_rows[0];
+		int run_pitch = m_shadow ? 0 : m_display->pitch;
+		switch( m_display->format->BytesPerPixel )
+		{
+		case 1:
+			for( int i = 0; i < count; ++i )
+				FillRows< Uint8 >( m_kernels.fill8, rows, run_pitch, 1, rects[i].rect, (Uint8)SurfacePixel( rects[i].pixel ) );
+			break;
+
+		case 2:
+			for( int i = 0; i < count; ++i )
+				FillRows< Uint16 >( m_kernels.fill16, rows, run_pitch, 2, rects[i].rect, (Uint16)SurfacePixel( rects[i].pixel ) );
+			break;
+
+		case 3:
+			for( int i = 0; i < count; ++i )
+				FillRows< Uint32 >( m_kernels.fill24, rows, run_pitch, 3, rects[i].rect, SurfacePixel( rects[i].pixel ) );
+			break;
+
+		case 4:
+			for( int i = 0; i < count; ++i )
+				FillRows< Uint32 >( m_kernels.fill32, rows, run_pitch, 4, rects[i].rect, SurfacePixel( rects[i].pixel ) );
+			break;
+
+		default:
+			throw Exc( "invalid color depth for FillRects" );
+		}
+	}
+
+	Uint8* SDLDisplay::GetDirectRow( int x, int y )
+	{
+		// 24-bit surfaces hold packed pixels, which don't match our format,
+		// and neither do surfaces we convert into
+		int bpp = m_display->format->BytesPerPixel;
+		if( bpp != (int)m_format.bytes || m_converter )
+			return NULL;
+		return m_rows[y] + x * bpp;
+	}
+
 };
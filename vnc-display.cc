@@ -23,5 +23,23 @@ namespace VNC
 	{
 		return this->UpdateInput();
 	}
+
+	void Display::WriteRect( ScreenRect const& rect, Uint8 const* data, int pitch )
+	{
+		for( int y = 0; y < rect.h; ++y )
+			WritePixels( rect.x, rect.y + y, rect.w, (Uint8*)data + y * pitch );
+	}
+
+	void Display::FillRect( ScreenRect const& rect, Uint32 pixel )
+	{
+		for( int y = 0; y < rect.h; ++y )
+			WriteUniformPixels( rect.x, rect.y + y, rect.w, pixel );
+	}
+
+	void Display::FillRects( SolidRect const* rects, int count )
+	{
+		for( int i = 0; i < count; ++i )
+			FillRect( rects[i].rect, rects[i].pixel );
+	}
 	
 };
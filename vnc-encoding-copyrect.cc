@@ -6,6 +6,7 @@
 
 #include <iostream>
 #include "vnc.h"
+#include "vnc-wire.h"
 
 using namespace std;
 
@@ -14,14 +15,17 @@ namespace VNC
 
 	DEFINE_VNC_DECODER( COPYRECT )
 	{
-		++m_processed;
-		
-		Uint16 src_x, src_y;
-		m_net.ReceiveBytes( (Uint8*)&src_x, 2 ); src_x = VNC_SWAP_BE_16( src_x );
-		m_net.ReceiveBytes( (Uint8*)&src_y, 2 ); src_y = VNC_SWAP_BE_16( src_y );
+		Wire::CopyRect src;
+		Wire::Receive( in.net, src );
 		disp.BeginDrawing();
-		disp.CopyPixels( src_x, src_y, rect.x, rect.y, rect.w, rect.h );
+		disp.CopyPixels( src.src_x, src.src_y, rect.x, rect.y, rect.w, rect.h );
 		disp.EndDrawing( rect );
 	}
 
+	bool DecoderCOPYRECT::Frame( ScreenRect const& /* rect */, Display& /* disp */, Wire::Recorder& data )
+	{
+		++m_processed;
+		data.Skip( Wire::CopyRect::SIZE );
+		return true;
+	}
 };
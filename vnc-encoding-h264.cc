@@ -0,0 +1,311 @@
+/*!
+  \file vnc-encoding-h264.cc
+  \brief Implementation of the Open H.264 update encoding type.
+
+  Each rectangle is a run of H.264 access units for one video stream;
+  the server keeps a separate stream, and we a separate decoder, for
+  every distinct rectangle on the screen. Frames are decoded with
+  FFmpeg's libavcodec and converted from YUV to the display's pixel
+  format a row at a time, straight into the surface when it allows.
+
+  Only built when VNC_HAVE_H264 is defined; see the Makefile.
+*/
+
+#if defined(VNC_HAVE_H264)
+
+#include <string.h>
+#include <vector>
+#include "vnc.h"
+#include "vnc-wire.h"
+
+extern "C"
+{
+#include <libavcodec/avcodec.h>
+#include <libavutil/frame.h>
+#include <libavutil/pixfmt.h>
+}
+
+using namespace std;
+
+#define H264_MAX_CONTEXTS    64     //!< streams kept at once; the least recently used goes first
+#define H264_MAX_LENGTH      ( 64 * 1024 * 1024 )   //!< largest rectangle payload we accept
+
+#if defined(__GNUC__) || defined(__clang__)
+# define H264_LANES          4      //!< pixels converted per vector step
+#else
+# define H264_LANES          1
+#endif
+
+namespace VNC
+{
+
+#if defined(__GNUC__) || defined(__clang__)
+	typedef Int32 YuvVector __attribute__(( vector_size( H264_LANES * sizeof( Int32 ) ) ));   //!< one component of H264_LANES pixels
+#else
+	typedef Int32 YuvVector;
+#endif
+
+	//! One H.264 stream: a rectangle of the screen and its decoder.
+	struct DecoderH264::Context
+	{
+		ScreenRect rect;          //!< area the stream covers
+		AVCodecContext* codec;    //!< libavcodec decoder state
+	};
+
+	//! Fixed point YUV to RGB matrix, scaled by 256.
+	struct YuvCoeffs
+	{
+		int y_offset;   //!< black level
+		int y_scale;    //!< luma gain
+		int v_red;      //!< red from Cr
+		int u_green;    //!< green from Cb, subtracted
+		int v_green;    //!< green from Cr, subtracted
+		int u_blue;     //!< blue from Cb
+	};
+
+	//! BT.601 for studio range (16-235) and full range (0-255) video.
+	static YuvCoeffs const s_bt601_studio = { 16, 298, 409, 100, 208, 516 };
+	static YuvCoeffs const s_bt601_full = { 0, 256, 359, 88, 183, 454 };
+
+	//! How 8-bit colour components are packed into display pixels.
+	struct H264Format
+	{
+		H264Format( PixelFormat const& fmt )
+		{
+			Uint32 const masks[3] = { fmt.red_mask, fmt.green_mask, fmt.blue_mask };
+			Uint32 const shifts[3] = { fmt.red_shift, fmt.green_shift, fmt.blue_shift };
+			for( int c = 0; c < 3; ++c )
+			{
+				int bits = 0;
+				while( bits < 32 && ( masks[c] >> bits ) != 0 )
+					++bits;
+				loss[c] = bits < 8 ? 8 - bits : 0;
+				shift[c] = shifts[c];
+			}
+		}
+
+		int loss[3];    //!< low bits dropped from each 8-bit component
+		int shift[3];   //!< red, green and blue shifts
+	};
+
+	//! Clamps every lane to 0..255 without branching.
+	static inline YuvVector Clamp255( YuvVector v )
+	{
+		v &= ~( v >> 31 );                 // negative lanes to 0
+		YuvVector over = ( 255 - v ) >> 31;   // all ones where above 255
+		return ( v & ~over ) | ( 255 & over );
+	}
+
+	//! Converts a row of 4:2:0 video to display pixels.
+	/*!
+	  The arithmetic is done on H264_LANES pixels at a time.
+	  \param k colour matrix
+	  \param hf display pixel layout
+	  \param yp luma row
+	  \param up Cb row, at half horizontal resolution
+	  \param vp Cr row, at half horizontal resolution
+	  \param dst output row
+	  \param w width in pixels
+	*/
+	template< typename PIXEL, bool SWAP >
+	static void ConvertRow( YuvCoeffs const& k, H264Format const& hf, Uint8 const* yp, Uint8 const* up, Uint8 const* vp,
+							PIXEL* dst, int w )
+	{
+		for( int x = 0; x < w; x += H264_LANES )
+		{
+			int n = ( w - x ) < H264_LANES ? ( w - x ) : H264_LANES;
+			Int32 yl[H264_LANES], ul[H264_LANES], vl[H264_LANES];
+			for( int i = 0; i < H264_LANES; ++i )
+			{
+				int j = i < n ? x + i : x;   // repeat a valid pixel past the end of the row
+				yl[i] = yp[j];
+				ul[i] = up[j >> 1];
+				vl[i] = vp[j >> 1];
+			}
+			YuvVector yy, u, v;
+			memcpy( &yy, yl, sizeof( yy ) );
+			memcpy( &u, ul, sizeof( u ) );
+			memcpy( &v, vl, sizeof( v ) );
+
+			YuvVector c = ( yy - k.y_offset ) * k.y_scale + 128;
+			u -= 128;
+			v -= 128;
+			YuvVector r = Clamp255( ( c + v * k.v_red ) >> 8 );
+			YuvVector g = Clamp255( ( c - u * k.u_green - v * k.v_green ) >> 8 );
+			YuvVector b = Clamp255( ( c + u * k.u_blue ) >> 8 );
+			YuvVector pixels = ( ( r >> hf.loss[0] ) << hf.shift[0] ) |
+							   ( ( g >> hf.loss[1] ) << hf.shift[1] ) |
+							   ( ( b >> hf.loss[2] ) << hf.shift[2] );
+
+			Int32 out[H264_LANES];
+			memcpy( out, &pixels, sizeof( out ) );
+			for( int i = 0; i < n; ++i )
+				dst[x + i] = OrderPixel< SWAP >( (PIXEL)out[i] );
+		}
+	}
+
+	//! Draws a decoded frame, cropped to its rectangle.
+	/*!
+	  \param row space for a row of the rectangle, for when the display doesn't hand out its own
+	*/
+	template< typename PIXEL, bool SWAP >
+	static void DrawFrame( AVFrame const* frame, ScreenRect const& rect, Display& disp, PIXEL* row )
+	{
+		if( frame->format != AV_PIX_FMT_YUV420P && frame->format != AV_PIX_FMT_YUVJ420P )
+			throw Exc( "H.264 frame is not 4:2:0 video" );
+		bool full_range = frame->format == AV_PIX_FMT_YUVJ420P || frame->color_range == AVCOL_RANGE_JPEG;
+		YuvCoeffs const& k = full_range ? s_bt601_full : s_bt601_studio;
+		H264Format hf( disp.GetPixelFormat() );
+
+		int w = frame->width < rect.w ? frame->width : rect.w;
+		int h = frame->height < rect.h ? frame->height : rect.h;
+		for( int y = 0; y < h; ++y )
+		{
+			Uint8 const* yp = frame->data[0] + y * frame->linesize[0];
+			Uint8 const* up = frame->data[1] + ( y >> 1 ) * frame->linesize[1];
+			Uint8 const* vp = frame->data[2] + ( y >> 1 ) * frame->linesize[2];
+			PIXEL* direct = (PIXEL*)disp.GetDirectRow( rect.x, rect.y + y );
+			if( direct != NULL )
+			{
+				ConvertRow< PIXEL, SWAP >( k, hf, yp, up, vp, direct, w );
+				continue;
+			}
+			ConvertRow< PIXEL, SWAP >( k, hf, yp, up, vp, row, w );
+			disp.WritePixels( rect.x, rect.y + y, w, (Uint8*)row );
+		}
+	}
+
+	//! Frees a stream's decoder.
+	static void DeleteContext( DecoderH264::Context* context )
+	{
+		avcodec_free_context( &context->codec );
+		delete context;
+	}
+
+	DecoderH264::DecoderH264( NetworkClient& net )
+		: Decoder( net ),
+		  m_packet( NULL ),
+		  m_frame( NULL )
+	{
+		m_packet = av_packet_alloc();
+		m_frame = av_frame_alloc();
+		if( m_packet == NULL || m_frame == NULL )
+		{
+			av_packet_free( &m_packet );
+			av_frame_free( &m_frame );
+			throw Exc( "unable to allocate H.264 decoder buffers" );
+		}
+	}
+
+	DecoderH264::~DecoderH264()
+	{
+		ResetContexts();
+		av_packet_free( &m_packet );
+		av_frame_free( &m_frame );
+	}
+
+	void DecoderH264::ResetContexts()
+	{
+		for( unsigned i = 0; i < m_contexts.size(); ++i )
+			DeleteContext( m_contexts[i] );
+		m_contexts.clear();
+	}
+
+	DecoderH264::Context* DecoderH264::GetContext( ScreenRect const& rect, bool reset )
+	{
+		// look for the stream, and move it to the front
+		for( unsigned i = 0; i < m_contexts.size(); ++i )
+		{
+			Context* context = m_contexts[i];
+			if( context->rect.x != rect.x || context->rect.y != rect.y || context->rect.w != rect.w || context->rect.h != rect.h )
+				continue;
+			m_contexts.erase( m_contexts.begin() + i );
+			if( reset )
+			{
+				DeleteContext( context );
+				break;
+			}
+			m_contexts.insert( m_contexts.begin(), context );
+			return context;
+		}
+
+		if( m_contexts.size() >= H264_MAX_CONTEXTS )
+		{
+			DeleteContext( m_contexts.back() );
+			m_contexts.pop_back();
+		}
+
+		AVCodec const* codec = avcodec_find_decoder( AV_CODEC_ID_H264 );
+		if( codec == NULL )
+			throw Exc( "libavcodec has no H.264 decoder" );
+		Context* context = new Context;
+		context->rect = rect;
+		context->codec = avcodec_alloc_context3( codec );
+		if( context->codec == NULL )
+		{
+			delete context;
+			throw Exc( "unable to allocate an H.264 decoder" );
+		}
+		context->codec->flags |= AV_CODEC_FLAG_LOW_DELAY;
+		if( avcodec_open2( context->codec, codec, NULL ) < 0 )
+		{
+			DeleteContext( context );
+			throw Exc( "unable to open an H.264 decoder" );
+		}
+		m_contexts.insert( m_contexts.begin(), context );
+		return context;
+	}
+
+	void DecoderH264::operator() ( ScreenRect const& rect, Display& disp )
+	{
+		++m_processed;
+
+		Uint32 length = Wire::ReceiveValue< Uint32 >( m_net );
+		Uint32 flags = Wire::ReceiveValue< Uint32 >( m_net );
+		if( length > H264_MAX_LENGTH )
+			throw Exc( "H.264 rectangle is too large" );
+
+		// libavcodec reads a little past the end of its input
+		m_data.resize( length + AV_INPUT_BUFFER_PADDING_SIZE );
+		if( length > 0 )
+			m_net.ReceiveBytes( &m_data[0], length );
+		memset( &m_data[length], 0, AV_INPUT_BUFFER_PADDING_SIZE );
+
+		if( flags & RFB_H264_RESET_ALL_CONTEXTS )
+			ResetContexts();
+		Context* context = GetContext( rect, ( flags & RFB_H264_RESET_CONTEXT ) != 0 );
+		if( length == 0 )
+			return;
+
+		m_packet->data = &m_data[0];
+		m_packet->size = length;
+		if( avcodec_send_packet( context->codec, m_packet ) < 0 )
+			throw Exc( "invalid H.264 data" );
+
+		// draw every frame that comes out; normally there is exactly one
+		Uint8* row = m_scratch->Allocate< Uint8 >( rect.w * disp.GetPixelFormat().bytes );
+		disp.BeginDrawing();
+		for( ;; )
+		{
+			int result = avcodec_receive_frame( context->codec, m_frame );
+			if( result == AVERROR( EAGAIN ) || result == AVERROR_EOF )
+				break;
+			if( result < 0 )
+				throw Exc( "unable to decode H.264 frame" );
+
+			switch( GetPixelKernel( disp.GetPixelFormat() ) )
+			{
+			case PIXEL_KERNEL_8:          DrawFrame< Uint8, false >( m_frame, rect, disp, (Uint8*)row );   break;
+			case PIXEL_KERNEL_16:         DrawFrame< Uint16, false >( m_frame, rect, disp, (Uint16*)row ); break;
+			case PIXEL_KERNEL_16_SWAPPED: DrawFrame< Uint16, true >( m_frame, rect, disp, (Uint16*)row );  break;
+			case PIXEL_KERNEL_32:         DrawFrame< Uint32, false >( m_frame, rect, disp, (Uint32*)row ); break;
+			case PIXEL_KERNEL_32_SWAPPED: DrawFrame< Uint32, true >( m_frame, rect, disp, (Uint32*)row );  break;
+			}
+			av_frame_unref( m_frame );
+		}
+		disp.EndDrawing( rect );
+	}
+
+};
+
+#endif
@@ -1,166 +1,333 @@
 /*!
   \file vnc-encoding-hextile.cc
-  \brief Implementation of the hextile encoding for VNC.
+  \brief Implementation of the hextile and ZlibHex encodings for VNC.
   \author John R. Hall
 */
 
 #include <SDL/SDL.h>
 #include <iostream>
+#include <string.h>
 #include "vnc.h"
+#include "vnc-wire.h"
 
 using namespace std;
 
-#define GET_UINT32( var ) m_net.ReceiveBytes( (Uint8*)&var, 4 ); var = VNC_SWAP_BE_32( var );
-#define GET_UINT32_NOSWAP( var ) m_net.ReceiveBytes( (Uint8*)&var, 4 );
+#define HEXTILE_TILE_SOLID       0                  //!< parsed tile is its background colour only
+#define HEXTILE_TILE_SUBRECTS    1                  //!< parsed tile is a background with subrects
+#define HEXTILE_TILE_RAW         2                  //!< parsed tile is raw pixels
+#define HEXTILE_MAX_TILE_BYTES   ( 255 * ( 4 + 2 ) )  //!< largest tile body kept after parsing: 255 coloured subrects
 
-#define NET_UINT32( var ) Uint32 var; GET_UINT32( var );
-#define NET_UINT32_NOSWAP( var ) Uint32 var; GET_UINT32_NOSWAP( var );
+namespace VNC
+{
 
-#define GET_UINT16( var ) m_net.ReceiveBytes( (Uint8*)&var, 2 ); var = VNC_SWAP_BE_16( var );
-#define GET_UINT16_NOSWAP( var ) m_net.ReceiveBytes( (Uint8*)&var, 2 );
+	//! Colours carried over from one hextile tile to the next.
+	struct HextileState
+	{
+		Uint32 tile_bg_color;      //!< background of the last tile that set one
+		Uint32 subtile_fg_color;   //!< foreground of the last tile that set one
+	};
 
-#define NET_UINT16( var ) Uint16 var; GET_UINT16( var );
-#define NET_UINT16_NOSWAP( var ) Uint16 var; GET_UINT16_NOSWAP( var );
+	//! A parsed tile, waiting to be drawn.
+	/*!
+	  Tiles are parsed a row at a time, then drawn together, so that each
+	  one reaches the display in a single pass and neighbouring solid
+	  tiles of the same colour become one fill.
+	*/
+	struct HextileTile
+	{
+		Uint8 type;              //!< HEXTILE_TILE_xxx
+		Uint8 num_subrects;      //!< subrects in data
+		Uint8 subrect_size;      //!< bytes per subrect: 2, plus a pixel if each has its own colour
+		Uint32 bg;               //!< background colour
+		Uint32 fg;               //!< colour of subrects that don't have their own
+		Uint8 const* data;       //!< raw pixels, or subrects as they came off the wire
+	};
 
-#define NET_UINT8( var ) Uint8 var; m_net.ReceiveBytes( &var, 1 );
+	//! Parses the body of a non-raw hextile tile, after its subencoding byte.
+	/*!
+	  \param src where the tile body comes from: the network, or a zlib stream for ZlibHex
+	  \param encoding tile subencoding
+	  \param state colours shared across tiles
+	  \param tile set to the parsed tile
+	  \param data room for HEXTILE_MAX_TILE_BYTES of subrects
+	*/
+	template< typename PIXEL, typename SOURCE >
+	static void ParseTileBody( SOURCE& src, Uint8 encoding, HextileState& state, HextileTile& tile, Uint8* data )
+	{
+		int const bpp = sizeof( PIXEL );
 
+		// the colours and the subrect count are read together
+		Uint8 header[4 + 4 + 1];
+		int header_size = ( ( encoding & RFB_HEXTILE_BG_SPECIFIED ) ? bpp : 0 ) + ( ( encoding & RFB_HEXTILE_FG_SPECIFIED ) ? bpp : 0 )
+						+ ( ( encoding & RFB_HEXTILE_ANY_SUBRECTS ) ? 1 : 0 );
+		if( header_size > 0 )
+			src.ReadBytes( header, header_size );
 
-namespace VNC
-{
+		Uint8 const* p = header;
+		if( encoding & RFB_HEXTILE_BG_SPECIFIED )
+		{
+			// new background color for the entire tile
+			state.tile_bg_color = Wire::LoadPixel< PIXEL >( p );
+			p += bpp;
+		}
+		if( encoding & RFB_HEXTILE_FG_SPECIFIED )
+		{
+			// new foreground color for all subrects in this tile
+			state.subtile_fg_color = Wire::LoadPixel< PIXEL >( p );
+			p += bpp;
+		}
+
+		tile.bg = state.tile_bg_color;
+		tile.fg = state.subtile_fg_color;
+		tile.num_subrects = ( encoding & RFB_HEXTILE_ANY_SUBRECTS ) ? *p : 0;
+		tile.subrect_size = ( encoding & RFB_HEXTILE_SUBRECTS_COLORED ) ? bpp + 2 : 2;
+		tile.type = tile.num_subrects > 0 ? HEXTILE_TILE_SUBRECTS : HEXTILE_TILE_SOLID;
+		tile.data = data;
+		if( tile.num_subrects > 0 )
+			src.ReadBytes( data, tile.num_subrects * tile.subrect_size );
+	}
+
+	//! Parses a raw hextile tile.
+	template< typename PIXEL, typename SOURCE >
+	static void ParseRawTile( SOURCE& src, int tile_width, int tile_height, HextileTile& tile, Uint8* data )
+	{
+		tile.type = HEXTILE_TILE_RAW;
+		tile.data = data;
+		src.ReadBytes( data, tile_width * tile_height * sizeof( PIXEL ) );
+	}
 
-	static void FillSolidRect( Display& disp, ScreenRect const& rect, Uint32 pixel )
+	//! Draws a tile with subrects into a buffer, then writes the buffer to the display.
+	template< typename PIXEL >
+	static void DrawSubrectTile( Display& disp, ScreenRect const& tile_rect, HextileTile const& tile )
 	{
-		for( unsigned y = 0; y < rect.h; ++y )
+		PIXEL pixels[16 * 16];
+		PIXEL bg = (PIXEL)tile.bg;
+		int w = tile_rect.w;
+		int h = tile_rect.h;
+		for( int i = 0; i < w * h; ++i )
+			pixels[i] = bg;
+
+		Uint8 const* p = tile.data;
+		for( int subrect = 0; subrect < tile.num_subrects; ++subrect, p += tile.subrect_size )
 		{
-			disp.WriteUniformPixels( rect.x, rect.y+y, rect.w, pixel );
+			PIXEL color = (PIXEL)tile.fg;
+			Uint8 const* geometry = p;
+			if( tile.subrect_size > 2 )
+			{
+				memcpy( &color, p, sizeof( PIXEL ) );
+				geometry += sizeof( PIXEL );
+			}
+
+			// subrects are meant to fit the tile; clip any that don't, rather than draw elsewhere
+			int x1 = geometry[0] >> 4;
+			int y1 = geometry[0] & 0x0F;
+			int x2 = x1 + 1 + ( geometry[1] >> 4 );
+			int y2 = y1 + 1 + ( geometry[1] & 0x0F );
+			if( x2 > w ) x2 = w;
+			if( y2 > h ) y2 = h;
+			for( int y = y1; y < y2; ++y )
+				for( PIXEL* dst = pixels + y * w + x1, * end = pixels + y * w + x2; dst < end; ++dst )
+					*dst = color;
 		}
+
+		disp.WriteRect( tile_rect, (Uint8*)pixels, w * sizeof( PIXEL ) );
 	}
 
-	static Uint32 NetPixel( NetworkClient& net, int bpp )
+	//! Draws a row of parsed tiles.
+	/*!
+	  \param disp display to draw on
+	  \param rect the whole rectangle
+	  \param tile_y offset of the row in the rectangle
+	  \param tile_height height of the row
+	  \param tiles the row's tiles, left to right
+	  \param fills room for a fill per tile
+	*/
+	template< typename PIXEL >
+	static void DrawTileRow( Display& disp, ScreenRect const& rect, int tile_y, int tile_height, HextileTile const* tiles, SolidRect* fills )
 	{
-		NetworkClient& m_net = net;
-		switch( bpp )
+		int y = rect.y + tile_y;
+		int count = ( rect.w + 15 ) / 16;
+		int num_fills = 0;
+		for( int i = 0; i < count; )
 		{
-		case 1:
-			{				
-				NET_UINT8( val );
-				return (Uint32)val;
+			int x = rect.x + i * 16;
+			int tile_width = ( rect.w - i * 16 ) < 16 ? ( rect.w - i * 16 ) : 16;
+			HextileTile const& tile = tiles[i];
+			if( tile.type == HEXTILE_TILE_SOLID )
+			{
+				// neighbouring tiles of the same colour are filled together
+				int end = i + 1;
+				while( end < count && tiles[end].type == HEXTILE_TILE_SOLID && tiles[end].bg == tile.bg )
+					++end;
+				int width = ( end == count ? rect.w : end * 16 ) - i * 16;
+				fills[num_fills].rect = ScreenRect( x, y, width, tile_height );
+				fills[num_fills].pixel = tile.bg;
+				++num_fills;
+				i = end;
+				continue;
 			}
-			
-		case 2:
+
+			if( tile.type == HEXTILE_TILE_RAW )
 			{
-				NET_UINT16_NOSWAP( val );
-				return (Uint32)val;
+				disp.WriteRect( ScreenRect( x, y, tile_width, tile_height ), tile.data, tile_width * sizeof( PIXEL ) );
 			}
-			
-		case 4:
+			else
 			{
-				NET_UINT32_NOSWAP( val );
-				return (Uint32)val;
+				DrawSubrectTile< PIXEL >( disp, ScreenRect( x, y, tile_width, tile_height ), tile );
 			}
-			
-		default:
-			throw Exc( "invalid color depth for RRE decoder" );
+			++i;
 		}
+
+		// the solid runs don't overlap anything else, so they go in one batch
+		if( num_fills > 0 )
+			disp.FillRects( fills, num_fills );
 	}
-	
-	DEFINE_VNC_DECODER( HEXTILE )
+
+	//! Starts inflating a block of tile data compressed on one of the ZlibHex streams, straight off the network.
+	static void ReceiveZlibTile( NetworkClient& net, ZlibReader& zr )
 	{
-		++m_processed;
-		
-		Uint32 tile_bg_color = 0;    // these are running values that can
-		Uint32 subtile_fg_color = 0; //   be shared across tiles
-		int bpp = disp.GetPixelFormat().bytes;
-		Uint8* raw_pixel_buf = new Uint8[ bpp * 16 * 16 ];  // buffer for raw 
+		Uint16 length = Wire::ReceiveValue< Uint16 >( net );
+		zr.SetStream( net, length );
+	}
 
-		disp.BeginDrawing();
+	//! Receives and draws a hextile or ZlibHex rectangle, a row of tiles at a time.
+	/*!
+	  \param net connection to the server
+	  \param scratch memory for the parsed tiles
+	  \param rect rectangle to decode
+	  \param disp display to draw on
+	  \param raw_reader ZlibHex stream for raw tiles, or NULL for plain hextile
+	  \param hex_reader ZlibHex stream for other tiles, or NULL for plain hextile
+	*/
+	template< typename PIXEL >
+	static void DecodeTiles( NetworkClient& net, ScratchArena& scratch, ScreenRect const& rect, Display& disp,
+							 ZlibReader* raw_reader, ZlibReader* hex_reader )
+	{
+		HextileState state = { 0, 0 };   // running values that can be shared across tiles
+		int tiles_per_row = ( rect.w + 15 ) / 16;
+		HextileTile* tiles = scratch.Allocate< HextileTile >( tiles_per_row );
+		Uint8* data = scratch.Allocate< Uint8 >( tiles_per_row * HEXTILE_MAX_TILE_BYTES );
+		SolidRect* fills = scratch.Allocate< SolidRect >( tiles_per_row );
+		Wire::NetSource src( net );
 
-		// iterate through each 16x16 tile in this rect
+		// parse each row of 16x16 tiles, then draw it
 		for( int tile_y = 0; tile_y < rect.h; tile_y += 16 )
 		{
 			int tile_height = (rect.h - tile_y) < 16 ? (rect.h - tile_y) : 16;
-			for( int tile_x = 0; tile_x < rect.w; tile_x += 16 )
+			for( int i = 0; i < tiles_per_row; ++i )
 			{
-				int tile_width = (rect.w - tile_x) < 16 ? (rect.w - tile_x) : 16;
-				int num_subrects = 0;
-				bool subrects_colored;
-				
-				NET_UINT8( encoding );
-				if( encoding & RFB_HEXTILE_RAW )
+				int tile_width = (rect.w - i * 16) < 16 ? (rect.w - i * 16) : 16;
+				Uint8* tile_data = data + i * HEXTILE_MAX_TILE_BYTES;
+
+				// for ZlibHex, any tile may come through zlib
+				Uint8 encoding = src.ReadByte();
+				if( raw_reader != NULL && ( encoding & RFB_ZLIBHEX_ZLIB_RAW ) )
+				{
+					// raw pixels on the raw stream; the other bits don't matter
+					ReceiveZlibTile( net, *raw_reader );
+					ParseRawTile< PIXEL >( *raw_reader, tile_width, tile_height, tiles[i], tile_data );
+					raw_reader->Finish();
+				}
+				else if( encoding & RFB_HEXTILE_RAW )
 				{
 					// the other bits don't matter; process a raw tile
-					m_net.ReceiveBytes( raw_pixel_buf, tile_width * tile_height * bpp );
-					for( int y = 0; y < tile_height; ++y )
-					{
-						disp.WritePixels( rect.x + tile_x, rect.y + tile_y + y, tile_width, raw_pixel_buf + bpp * tile_width * y );
-					}
+					ParseRawTile< PIXEL >( src, tile_width, tile_height, tiles[i], tile_data );
+				}
+				else if( hex_reader != NULL && ( encoding & RFB_ZLIBHEX_ZLIB_HEX ) )
+				{
+					// an ordinary tile body on the encoded stream
+					ReceiveZlibTile( net, *hex_reader );
+					ParseTileBody< PIXEL >( *hex_reader, encoding, state, tiles[i], tile_data );
+					hex_reader->Finish();
 				}
 				else
 				{
-					// process a complex tile
-					
-					if( encoding & RFB_HEXTILE_BG_SPECIFIED )
-					{
-						// new background color for the entire tile
-						tile_bg_color = NetPixel( m_net, bpp );
-					}
-
-					if( encoding & RFB_HEXTILE_FG_SPECIFIED )
-					{
-						// new foreground color for all subrects in this tile
-						subtile_fg_color = NetPixel( m_net, bpp );
-					}
-
-					if( encoding & RFB_HEXTILE_ANY_SUBRECTS )
-					{
-						// this tile contains subrectangels
-						NET_UINT8( tmp );
-						num_subrects = tmp;
-					}
-					else
-					{
-						// this tile contains no subrects, just the solid background
-						num_subrects = 0;
-					}
-
-					if( encoding & RFB_HEXTILE_SUBRECTS_COLORED )
-						// each subrect has its own foreground color
-						subrects_colored = true;
-					else
-						// all subrects share subtile_fg_color
-						subrects_colored = false;
-
-					// fill the background
-					ScreenRect tile_rect( tile_x + rect.x, tile_y + rect.y, tile_width, tile_height );
-					FillSolidRect( disp, tile_rect, tile_bg_color );
-
-					// draw subrects
-					for( int subrect = 0; subrect < num_subrects; ++subrect )
-					{
-						Uint32 subrect_pixel;
-
-						// if subtiles have their own FG colors, read a color
-						if( subrects_colored )
-							subrect_pixel = NetPixel( m_net, bpp );
-						else
-							subrect_pixel = subtile_fg_color;
-
-						// read the dimensions of this tile
-						NET_UINT8( packed_xy );
-						NET_UINT8( packed_wh );
-						ScreenRect subtile_rect( tile_rect.x + ((packed_xy >> 4) & 0x0F), tile_rect.y + (packed_xy & 0x0F),
-												 1 + ((packed_wh >> 4) & 0x0F), 1 + (packed_wh & 0x0F) );
-
-						// draw it
-						FillSolidRect( disp, subtile_rect, subrect_pixel );
-					}
+					ParseTileBody< PIXEL >( src, encoding, state, tiles[i], tile_data );
 				}
 			}
+			DrawTileRow< PIXEL >( disp, rect, tile_y, tile_height, tiles, fills );
 		}
+	}
 
+	//! Receives and draws a hextile or ZlibHex rectangle, in any pixel size.
+	static void DecodeHextile( NetworkClient& net, ScratchArena& scratch, ScreenRect const& rect, Display& disp,
+							   ZlibReader* raw_reader, ZlibReader* hex_reader )
+	{
+		switch( disp.GetPixelFormat().bytes )
+		{
+		case 1:  DecodeTiles< Uint8 >( net, scratch, rect, disp, raw_reader, hex_reader );  break;
+		case 2:  DecodeTiles< Uint16 >( net, scratch, rect, disp, raw_reader, hex_reader ); break;
+		case 4:  DecodeTiles< Uint32 >( net, scratch, rect, disp, raw_reader, hex_reader ); break;
+		default: throw Exc( "invalid color depth for hextile decoder" );
+		}
+	}
+
+	//! Receives the body of a non-raw hextile tile without drawing it, for framing.
+	static void SkipTileBody( Wire::Recorder& data, Uint8 encoding, int bpp )
+	{
+		if( encoding & RFB_HEXTILE_BG_SPECIFIED )
+			data.Skip( bpp );
+		if( encoding & RFB_HEXTILE_FG_SPECIFIED )
+			data.Skip( bpp );
+		if( encoding & RFB_HEXTILE_ANY_SUBRECTS )
+		{
+			Uint8 num_subrects = Wire::ReceiveValue< Uint8 >( data );
+			data.Skip( num_subrects * ( ( encoding & RFB_HEXTILE_SUBRECTS_COLORED ) ? bpp + 2 : 2 ) );
+		}
+	}
+
+	//! Receives a hextile or ZlibHex rectangle without drawing it, for framing.
+	/*!
+	  \param zlib true for ZlibHex, whose tiles may be compressed
+	*/
+	static void SkipTiles( Wire::Recorder& data, ScreenRect const& rect, int bpp, bool zlib )
+	{
+		for( int tile_y = 0; tile_y < rect.h; tile_y += 16 )
+		{
+			int tile_height = (rect.h - tile_y) < 16 ? (rect.h - tile_y) : 16;
+			for( int tile_x = 0; tile_x < rect.w; tile_x += 16 )
+			{
+				int tile_width = (rect.w - tile_x) < 16 ? (rect.w - tile_x) : 16;
+				Uint8 encoding = Wire::ReceiveValue< Uint8 >( data );
+				// in the same order of precedence as the decoders
+				if( zlib && ( encoding & RFB_ZLIBHEX_ZLIB_RAW ) )
+					data.Skip( Wire::ReceiveValue< Uint16 >( data ) );
+				else if( encoding & RFB_HEXTILE_RAW )
+					data.Skip( tile_width * tile_height * bpp );
+				else if( zlib && ( encoding & RFB_ZLIBHEX_ZLIB_HEX ) )
+					data.Skip( Wire::ReceiveValue< Uint16 >( data ) );
+				else
+					SkipTileBody( data, encoding, bpp );
+			}
+		}
+	}
+
+	DEFINE_VNC_DECODER( HEXTILE )
+	{
+		disp.BeginDrawing();
+		DecodeHextile( in.net, in.scratch, rect, disp, NULL, NULL );
 		disp.EndDrawing( rect );
-		
-		delete raw_pixel_buf;
 	}
-	
+
+	bool DecoderHEXTILE::Frame( ScreenRect const& rect, Display& disp, Wire::Recorder& data )
+	{
+		++m_processed;
+		SkipTiles( data, rect, disp.GetPixelFormat().bytes, false );
+		return true;
+	}
+
+	DEFINE_VNC_DECODER( ZLIBHEX )
+	{
+		disp.BeginDrawing();
+		DecodeHextile( in.net, in.scratch, rect, disp, &m_raw_reader, &m_hex_reader );
+		disp.EndDrawing( rect );
+	}
+
+	bool DecoderZLIBHEX::Frame( ScreenRect const& rect, Display& disp, Wire::Recorder& data )
+	{
+		++m_processed;
+		SkipTiles( data, rect, disp.GetPixelFormat().bytes, true );
+		return true;
+	}
+
 };
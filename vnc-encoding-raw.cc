@@ -6,26 +6,49 @@
 
 #include <iostream>
 #include "vnc.h"
+#include "vnc-wire.h"
 
 using namespace std;
 
+#define RAW_BATCH_BYTES  16384   //!< bytes received at a time when rows can't go straight to the display
+
 namespace VNC
 {
 
 	DEFINE_VNC_DECODER( RAW )
 	{
-		++m_processed;
+		// the pixels are already in the display's format, so memory use
+		// shouldn't grow with the rectangle: rows go straight into the
+		// display when it allows, or else through a small buffer
+		unsigned row_bytes = rect.w * disp.GetPixelFormat().bytes;
+		unsigned batch = row_bytes > 0 ? RAW_BATCH_BYTES / row_bytes : rect.h;
+		if( batch == 0 )
+			batch = 1;
+		Uint8* rows = in.scratch.Allocate< Uint8 >( batch * row_bytes );
 
-		unsigned int count = rect.w*rect.h*disp.GetPixelFormat().bytes;
-		Uint8* buf = new Uint8[count];
-		m_net.ReceiveBytes( buf, count );
 		disp.BeginDrawing();
-		for( unsigned y = 0; y < rect.h; ++y )
+		for( unsigned y = 0; y < rect.h; )
 		{
-			disp.WritePixels( rect.x, rect.y + y, rect.w, buf + disp.GetPixelFormat().bytes * rect.w * y );
+			Uint8* direct = disp.GetDirectRow( rect.x, rect.y + y );
+			if( direct != NULL )
+			{
+				in.net.ReceiveBytes( direct, row_bytes );
+				++y;
+				continue;
+			}
+
+			unsigned count = rect.h - y < batch ? rect.h - y : batch;
+			in.net.ReceiveBytes( rows, count * row_bytes );
+			disp.WriteRect( ScreenRect( rect.x, rect.y + y, rect.w, count ), rows, row_bytes );
+			y += count;
 		}
 		disp.EndDrawing( rect );
-		delete buf;
 	}
 
+	bool DecoderRAW::Frame( ScreenRect const& rect, Display& disp, Wire::Recorder& data )
+	{
+		++m_processed;
+		data.Skip( rect.w * rect.h * disp.GetPixelFormat().bytes );
+		return true;
+	}
 };
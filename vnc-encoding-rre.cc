@@ -7,107 +7,238 @@
 #include <SDL/SDL.h>
 #include <iostream>
 #include "vnc.h"
+#include "vnc-wire.h"
 
 using namespace std;
 
-
-#define GET_UINT32( var ) m_net.ReceiveBytes( (Uint8*)&var, 4 ); var = VNC_SWAP_BE_32( var );
-#define GET_UINT32_NOSWAP( var ) m_net.ReceiveBytes( (Uint8*)&var, 4 );
-
-#define NET_UINT32( var ) Uint32 var; GET_UINT32( var );
-#define NET_UINT32_NOSWAP( var ) Uint32 var; GET_UINT32_NOSWAP( var );
-
-#define GET_UINT16( var ) m_net.ReceiveBytes( (Uint8*)&var, 2 ); var = VNC_SWAP_BE_16( var );
-#define GET_UINT16_NOSWAP( var ) m_net.ReceiveBytes( (Uint8*)&var, 2 );
-
-#define NET_UINT16( var ) Uint16 var; GET_UINT16( var );
-#define NET_UINT16_NOSWAP( var ) Uint16 var; GET_UINT16_NOSWAP( var );
-
-#define NET_UINT8( var ) Uint8 var; m_net.ReceiveBytes( &var, 1 );
+#define RRE_BATCH_SUBRECTS  16384   //!< subrects received and drawn at a time
+#define RRE_BAND_ROWS       16      //!< composed rows written to the display at a time
 
 namespace VNC
 {
 
-	static void FillSolidRect( Display& disp, ScreenRect const& rect, Uint32 pixel )
+	//! A subrect, clipped to its rectangle and ready to draw.
+	struct RRESpan
+	{
+		int x1, x2;      //!< columns covered, relative to the rectangle, end exclusive
+		int y1, y2;      //!< rows covered, relative to the rectangle, end exclusive
+		Uint32 pixel;    //!< colour
+	};
+
+	//! Draws a batch of subrects, a scanline at a time.
+	/*!
+	  The subrects are bucketed by the row they start on. Walking down the
+	  rectangle, each row keeps the list of subrects that cover it, in the
+	  order they were sent so that later ones still win where they overlap.
+	  Composed rows go to the display a band at a time, and runs of rows
+	  with no subrects as one fill.
+	  \param disp display to draw on
+	  \param rect the whole rectangle
+	  \param spans the batch's subrects, in wire order
+	  \param count number of subrects
+	  \param bg background colour to compose rows on, or NULL if the background
+	  was drawn by an earlier batch and only the subrects are drawn
+	  \param scratch memory for the buckets and the row
+	*/
+	template< typename PIXEL >
+	static void DrawSpans( Display& disp, ScreenRect const& rect, RRESpan const* spans, int count, Uint32 const* bg, ScratchArena& scratch )
 	{
-		for( unsigned y = 0; y < rect.h; ++y )
+		if( bg == NULL )
 		{
-			disp.WriteUniformPixels( rect.x, rect.y+y, rect.w, pixel );
+			// nothing to compose on; the display fills them over what is there, in order
+			SolidRect* fills = scratch.Allocate< SolidRect >( count );
+			for( int i = 0; i < count; ++i )
+			{
+				RRESpan const& s = spans[i];
+				fills[i].rect = ScreenRect( rect.x + s.x1, rect.y + s.y1, s.x2 - s.x1, s.y2 - s.y1 );
+				fills[i].pixel = s.pixel;
+			}
+			disp.FillRects( fills, count );
+			return;
 		}
-	}
 
-	static Uint32 NetPixel( NetworkClient& net, int bpp )
-	{
-		NetworkClient& m_net = net;
-		switch( bpp )
+		// counting sort by first row; that keeps wire order within each row
+		int* first = scratch.Allocate< int >( rect.h + 1 );
+		int* order = scratch.Allocate< int >( count );
+		for( int y = 0; y <= rect.h; ++y )
+			first[y] = 0;
+		for( int i = 0; i < count; ++i )
+			++first[spans[i].y1 + 1];
+		for( int y = 0; y < rect.h; ++y )
+			first[y + 1] += first[y];
+		int* next = scratch.Allocate< int >( rect.h );
+		for( int y = 0; y < rect.h; ++y )
+			next[y] = first[y];
+		for( int i = 0; i < count; ++i )
+			order[next[spans[i].y1]++] = i;
+
+		int* active = scratch.Allocate< int >( count );
+		int* merged = scratch.Allocate< int >( count );
+		int num_active = 0;
+		PIXEL* band = scratch.Allocate< PIXEL >( rect.w * RRE_BAND_ROWS );
+		int band_y = 0;        // first row in the band
+		int band_rows = 0;     // composed rows waiting in the band
+		int empty_y = 0;       // first of the rows without subrects before this one
+		for( int y = 0; y < rect.h; ++y )
 		{
-		case 1:
+			// drop subrects that have ended, and merge in those that start here
+			int n = 0;
+			int a = 0;
+			int b = first[y];
+			int b_end = first[y + 1];
+			while( a < num_active || b < b_end )
 			{
-				NET_UINT8( val );
-				return (Uint32)val;
+				int i;
+				if( b == b_end || ( a < num_active && active[a] < order[b] ) )
+					i = active[a++];
+				else
+					i = order[b++];
+				if( spans[i].y2 > y )
+					merged[n++] = i;
 			}
-			
-		case 2:
+			int* swap = active;
+			active = merged;
+			merged = swap;
+			num_active = n;
+
+			if( num_active == 0 )
 			{
-				NET_UINT16_NOSWAP( val );
-				return (Uint32)val;
+				if( band_rows > 0 )
+				{
+					disp.WriteRect( ScreenRect( rect.x, rect.y + band_y, rect.w, band_rows ), (Uint8*)band, rect.w * sizeof( PIXEL ) );
+					band_rows = 0;
+					empty_y = y;
+				}
+				continue;
 			}
-			
-		case 4:
+
+			if( empty_y < y && band_rows == 0 )
+				disp.FillRect( ScreenRect( rect.x, rect.y + empty_y, rect.w, y - empty_y ), *bg );
+			if( band_rows == RRE_BAND_ROWS )
 			{
-				NET_UINT32_NOSWAP( val );
-				return (Uint32)val;
+				disp.WriteRect( ScreenRect( rect.x, rect.y + band_y, rect.w, band_rows ), (Uint8*)band, rect.w * sizeof( PIXEL ) );
+				band_rows = 0;
 			}
-			
-		default:
-			throw Exc( "invalid color depth for RRE decoder" );
+			if( band_rows == 0 )
+				band_y = y;
+
+			PIXEL* row = band + band_rows * rect.w;
+			PIXEL fill = (PIXEL)*bg;
+			for( int x = 0; x < rect.w; ++x )
+				row[x] = fill;
+			for( int k = 0; k < num_active; ++k )
+			{
+				RRESpan const& s = spans[active[k]];
+				PIXEL pixel = (PIXEL)s.pixel;
+				for( PIXEL* dst = row + s.x1, * end = row + s.x2; dst < end; ++dst )
+					*dst = pixel;
+			}
+			++band_rows;
+			empty_y = y + 1;
 		}
+
+		if( band_rows > 0 )
+			disp.WriteRect( ScreenRect( rect.x, rect.y + band_y, rect.w, band_rows ), (Uint8*)band, rect.w * sizeof( PIXEL ) );
+		else if( empty_y < rect.h )
+			disp.FillRect( ScreenRect( rect.x, rect.y + empty_y, rect.w, rect.h - empty_y ), *bg );
 	}
-	
-	DEFINE_VNC_DECODER( RRE )
+
+	//! Receives and draws the subrects of an RRE or CoRRE rectangle.
+	/*!
+	  Subrects are received in bulk, a batch at a time. The first batch is
+	  drawn on the background; any after it, only in rectangles with a
+	  great many subrects, are drawn over what the earlier ones left.
+	  \param net connection to receive from
+	  \param scratch memory for the subrects
+	  \param rect the whole rectangle
+	  \param disp display to draw on
+	  \param num_subrects number of subrects that follow the background
+	*/
+	template< typename PIXEL, typename SUBRECT >
+	static void DrawSubrects( NetworkClient& net, ScratchArena& scratch, ScreenRect const& rect, Display& disp, Uint32 num_subrects )
 	{
-		++m_processed;
+		int bpp = sizeof( PIXEL );
+		Uint32 bg_pixel = Wire::ReceivePixel( net, bpp );
+		if( num_subrects == 0 )
+		{
+			disp.FillRect( rect, bg_pixel );
+			return;
+		}
 
-		int bpp = disp.GetPixelFormat().bytes;
-		NET_UINT32( num_subrects );
-		Uint32 bg_pixel = NetPixel( m_net, bpp ); 
-		
-		disp.BeginDrawing();
-		FillSolidRect( disp, rect, bg_pixel );
-		for( unsigned i = 0; i < num_subrects; ++i )
+		int record = bpp + SUBRECT::SIZE;
+		int batch = num_subrects < RRE_BATCH_SUBRECTS ? num_subrects : RRE_BATCH_SUBRECTS;
+		Uint8* buf = scratch.Allocate< Uint8 >( batch * record );
+		RRESpan* spans = scratch.Allocate< RRESpan >( batch );
+		for( Uint32 done = 0; done < num_subrects; )
 		{
-			Uint32 pixel = NetPixel( m_net, bpp );
-			NET_UINT16( x );
-			NET_UINT16( y );
-			NET_UINT16( w );
-			NET_UINT16( h );
-			ScreenRect subrect( rect.x + x, rect.y + y, w, h );
-			FillSolidRect( disp, subrect, pixel );
+			int count = num_subrects - done < (Uint32)batch ? num_subrects - done : batch;
+			net.ReceiveBytes( buf, count * record );
+
+			// clip to the rectangle; empty subrects are dropped
+			int n = 0;
+			for( int i = 0; i < count; ++i )
+			{
+				Uint8 const* p = buf + i * record;
+				SUBRECT sub;
+				Wire::Unpack( p + bpp, p + record, sub );
+				RRESpan& s = spans[n];
+				s.x1 = sub.x < rect.w ? sub.x : rect.w;
+				s.y1 = sub.y < rect.h ? sub.y : rect.h;
+				s.x2 = sub.x + sub.w < rect.w ? sub.x + sub.w : rect.w;
+				s.y2 = sub.y + sub.h < rect.h ? sub.y + sub.h : rect.h;
+				s.pixel = Wire::LoadPixel< PIXEL >( p );
+				if( s.x1 < s.x2 && s.y1 < s.y2 )
+					++n;
+			}
+
+			DrawSpans< PIXEL >( disp, rect, spans, n, done == 0 ? &bg_pixel : NULL, scratch );
+			done += count;
+		}
+	}
+
+	//! Receives and draws an RRE or CoRRE rectangle, in any pixel size.
+	template< typename SUBRECT >
+	static void DecodeRRE( NetworkClient& net, ScratchArena& scratch, ScreenRect const& rect, Display& disp )
+	{
+		Uint32 num_subrects = Wire::ReceiveValue< Uint32 >( net );
+		switch( disp.GetPixelFormat().bytes )
+		{
+		case 1:  DrawSubrects< Uint8, SUBRECT >( net, scratch, rect, disp, num_subrects );  break;
+		case 2:  DrawSubrects< Uint16, SUBRECT >( net, scratch, rect, disp, num_subrects ); break;
+		case 4:  DrawSubrects< Uint32, SUBRECT >( net, scratch, rect, disp, num_subrects ); break;
+		default: throw Exc( "invalid color depth for RRE decoder" );
 		}
+	}
+
+	DEFINE_VNC_DECODER( RRE )
+	{
+		disp.BeginDrawing();
+		DecodeRRE< Wire::RRESubrect >( in.net, in.scratch, rect, disp );
 		disp.EndDrawing( rect );
 	}
 
 	DEFINE_VNC_DECODER( CORRE )
 	{
-		++m_processed;
-		
-		int bpp = disp.GetPixelFormat().bytes;
-		NET_UINT32( num_subrects );
-		Uint32 bg_pixel = NetPixel( m_net, bpp ); 
-		
 		disp.BeginDrawing();
-		FillSolidRect( disp, rect, bg_pixel );
-		for( unsigned i = 0; i < num_subrects; ++i )
-		{
-			Uint32 pixel = NetPixel( m_net, bpp );
-			NET_UINT8( x );
-			NET_UINT8( y );
-			NET_UINT8( w );
-			NET_UINT8( h );
-			ScreenRect subrect( rect.x + x, rect.y + y, w, h );
-			FillSolidRect( disp, subrect, pixel );
-		}
+		DecodeRRE< Wire::CoRRESubrect >( in.net, in.scratch, rect, disp );
 		disp.EndDrawing( rect );
 	}
-	
+
+	bool DecoderRRE::Frame( ScreenRect const& /* rect */, Display& disp, Wire::Recorder& data )
+	{
+		++m_processed;
+		int bpp = disp.GetPixelFormat().bytes;
+		Uint32 num_subrects = Wire::ReceiveValue< Uint32 >( data );
+		data.Skip( bpp + num_subrects * ( bpp + Wire::RRESubrect::SIZE ) );
+		return true;
+	}
+
+	bool DecoderCORRE::Frame( ScreenRect const& /* rect */, Display& disp, Wire::Recorder& data )
+	{
+		++m_processed;
+		int bpp = disp.GetPixelFormat().bytes;
+		Uint32 num_subrects = Wire::ReceiveValue< Uint32 >( data );
+		data.Skip( bpp + num_subrects * ( bpp + Wire::CoRRESubrect::SIZE ) );
+		return true;
+	}
 };
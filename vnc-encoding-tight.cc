@@ -0,0 +1,656 @@
+/*!
+  \file vnc-encoding-tight.cc
+  \brief Implementation of the Tight update encoding type.
+
+  Tight spreads its compressed data over four zlib streams that only depend
+  on their own history. Rectangles are therefore received whole and queued,
+  and when the update is flushed each stream's rectangles are inflated and
+  drawn by a separate worker, in their original order. Rectangles on
+  different streams never overlap while queued; one that would is a signal
+  to flush first. JPEG rectangles don't depend on anything, so each one
+  gets a worker of its own, and is decompressed straight into the display
+  where the display allows that.
+*/
+
+#include <iostream>
+#include <stdio.h>
+#include <string.h>
+#include <setjmp.h>
+#include <vector>
+#include <jpeglib.h>
+#include "vnc.h"
+#include "vnc-wire.h"
+
+using namespace std;
+
+namespace VNC
+{
+
+	//! A received rectangle, waiting to be decoded.
+	struct DecoderTIGHT::Rect
+	{
+		ScreenRect rect;           //!< where it goes
+		Uint8 type;                //!< RFB_TIGHT_BASIC, RFB_TIGHT_FILL or RFB_TIGHT_JPEG
+		int stream;                //!< zlib stream the data belongs to, or -1 if it isn't compressed
+		int lane;                  //!< rectangles in the same lane are decoded in order by one worker
+		Uint8 filter;              //!< RFB_TIGHT_FILTER_xxx
+		int palette_size;          //!< number of colours for the palette filter
+		Uint32 palette[256];       //!< palette colours, already converted to display pixels
+		Uint8* data;               //!< filtered data, compressed unless stream is -1; scratch memory
+		Uint32 length;             //!< bytes of data
+	};
+
+	//! Decodes one lane's rectangles on a worker thread.
+	/*!
+	  Lanes are kept from one flush to the next, along with their row
+	  buffers, so that decoding doesn't go to the heap once they are big enough.
+	*/
+	class DecoderTIGHT::Lane : public Job
+	{
+	public:
+		Lane( DecoderTIGHT& decoder ) : id( 0 ), disp( NULL ), m_decoder( decoder ) {}
+
+		virtual void Run()
+		{
+			for( unsigned i = 0; i < rects.size(); ++i )
+				m_decoder.Decode( *rects[i], *disp, scratch );
+		}
+
+		int id;                    //!< the Rect::lane it is decoding
+		Display* disp;             //!< display to draw on
+		vector< Rect* > rects;     //!< rectangles in update order
+		vector< Uint8 > scratch;   //!< row buffers for the rectangle being decoded
+
+	private:
+		DecoderTIGHT& m_decoder;
+	};
+
+	//! Grows a lane's scratch buffer to at least the given size.
+	static Uint8* GetScratch( vector< Uint8 >& scratch, size_t bytes )
+	{
+		if( scratch.size() < bytes )
+			scratch.resize( bytes );
+		return &scratch[0];
+	}
+
+	//! How TPIXELs relate to the display's pixel format.
+	struct TightFormat
+	{
+		TightFormat( PixelFormat const& _fmt )
+			: fmt( _fmt )
+		{
+			// 24-bit colour in 32-bit pixels is sent as three bytes: red, green, blue
+			tpixel_size = ( fmt.bytes == 4 && fmt.bits == 24 && fmt.red_mask == 255 &&
+							fmt.green_mask == 255 && fmt.blue_mask == 255 ) ? 3 : fmt.bytes;
+		}
+
+		PixelFormat fmt;   //!< display pixel format
+		int tpixel_size;   //!< bytes per TPIXEL on the wire
+	};
+
+	//! Builds a display pixel from its colour components.
+	template< typename PIXEL, bool SWAP >
+	static inline PIXEL PackPixel( TightFormat const& tf, Uint32 r, Uint32 g, Uint32 b )
+	{
+		PIXEL pixel = (PIXEL)( ( r << tf.fmt.red_shift ) | ( g << tf.fmt.green_shift ) | ( b << tf.fmt.blue_shift ) );
+		return OrderPixel< SWAP >( pixel );
+	}
+
+	//! Converts a row of TPIXELs to display pixels.
+	template< typename PIXEL, bool SWAP >
+	static void ConvertTPixels( TightFormat const& tf, Uint8 const* src, PIXEL* dst, int count )
+	{
+		if( tf.tpixel_size == (int)sizeof( PIXEL ) )
+		{
+			memcpy( dst, src, count * sizeof( PIXEL ) );
+			return;
+		}
+		for( int i = 0; i < count; ++i, src += 3 )
+			dst[i] = PackPixel< PIXEL, SWAP >( tf, src[0], src[1], src[2] );
+	}
+
+	//! Converts a single TPIXEL to a display pixel.
+	static Uint32 ConvertTPixel( TightFormat const& tf, Uint8 const* src )
+	{
+		switch( GetPixelKernel( tf.fmt ) )
+		{
+		case PIXEL_KERNEL_8:          { Uint8 pixel; ConvertTPixels< Uint8, false >( tf, src, &pixel, 1 ); return pixel; }
+		case PIXEL_KERNEL_16:         { Uint16 pixel; ConvertTPixels< Uint16, false >( tf, src, &pixel, 1 ); return pixel; }
+		case PIXEL_KERNEL_16_SWAPPED: { Uint16 pixel; ConvertTPixels< Uint16, true >( tf, src, &pixel, 1 ); return pixel; }
+		case PIXEL_KERNEL_32:         { Uint32 pixel; ConvertTPixels< Uint32, false >( tf, src, &pixel, 1 ); return pixel; }
+		default:                      { Uint32 pixel; ConvertTPixels< Uint32, true >( tf, src, &pixel, 1 ); return pixel; }
+		}
+	}
+
+	//! Supplies a rectangle's filtered data, from its zlib stream or as is.
+	class TightSource
+	{
+	public:
+		TightSource( ZlibReader* zr, Uint8* data, Uint32 length )
+			: m_zr( zr ), m_data( data ), m_length( length ), m_pos( 0 )
+		{
+			if( m_zr != NULL )
+				m_zr->SetStream( m_data, m_length );
+		}
+
+		void Read( Uint8* buf, int length )
+		{
+			if( m_zr != NULL )
+			{
+				m_zr->ReadBytes( buf, length );
+				return;
+			}
+			if( m_pos + length > m_length )
+				throw Exc( "Tight rectangle data is too short" );
+			memcpy( buf, &m_data[m_pos], length );
+			m_pos += length;
+		}
+
+		//! Uses up the rest of the rectangle's zlib data, so the stream stays in step.
+		void Finish()
+		{
+			if( m_zr != NULL )
+				m_zr->Finish();
+		}
+
+	private:
+		ZlibReader* m_zr;
+		Uint8* m_data;
+		Uint32 m_length;
+		unsigned m_pos;
+	};
+
+	//! Splits a row of deltas into colour components, for the gradient filter.
+	template< typename PIXEL, bool SWAP >
+	static void GetComponents( TightFormat const& tf, Uint8 const* src, int* comp, int count )
+	{
+		if( tf.tpixel_size == 3 )
+		{
+			for( int i = 0; i < count * 3; ++i )
+				comp[i] = src[i];
+			return;
+		}
+		for( int i = 0; i < count; ++i )
+		{
+			PIXEL pixel;
+			memcpy( &pixel, src + i * sizeof( PIXEL ), sizeof( PIXEL ) );
+			pixel = OrderPixel< SWAP >( pixel );
+			comp[i * 3] = pixel >> tf.fmt.red_shift;
+			comp[i * 3 + 1] = pixel >> tf.fmt.green_shift;
+			comp[i * 3 + 2] = pixel >> tf.fmt.blue_shift;
+		}
+	}
+
+	//! Inflates and unfilters a rectangle, writing it to the display a row at a time.
+	/*!
+	  \param scratch the lane's buffer, for the rows being worked on
+	*/
+	template< typename PIXEL, bool SWAP >
+	static void DecodeRows( DecoderTIGHT::Rect const& r, TightFormat const& tf, TightSource& src, Display& disp,
+							vector< Uint8 >& scratch )
+	{
+		// gradient component rows first, so they stay aligned, then a row of pixels and one of data
+		int w = r.rect.w;
+		int comps = r.filter == RFB_TIGHT_FILTER_GRADIENT ? w * 3 : 0;
+		Uint8* block = GetScratch( scratch, 3 * comps * sizeof( int ) + w * sizeof( PIXEL ) + w * tf.tpixel_size );
+		int* prev = (int*)block;
+		int* cur = prev + comps;
+		int* delta = cur + comps;
+		PIXEL* pixels = (PIXEL*)( delta + comps );
+		Uint8* row = (Uint8*)( pixels + w );
+
+		if( r.filter == RFB_TIGHT_FILTER_PALETTE )
+		{
+			PIXEL palette[256];
+			for( int i = 0; i < 256; ++i )
+				palette[i] = (PIXEL)r.palette[i];
+			int row_bytes = r.palette_size == 2 ? ( w + 7 ) / 8 : w;
+			for( int y = 0; y < r.rect.h; ++y )
+			{
+				src.Read( &row[0], row_bytes );
+				if( r.palette_size == 2 )
+				{
+					for( int x = 0; x < w; ++x )
+						pixels[x] = palette[( row[x >> 3] >> ( 7 - ( x & 7 ) ) ) & 1];
+				}
+				else
+				{
+					for( int x = 0; x < w; ++x )
+						pixels[x] = palette[row[x]];
+				}
+				disp.WritePixels( r.rect.x, r.rect.y + y, w, (Uint8*)&pixels[0] );
+			}
+		}
+		else if( r.filter == RFB_TIGHT_FILTER_GRADIENT )
+		{
+			// each component is predicted as left + above - above left,
+			// clamped to its range; the data holds the differences
+			int max[3] = { (int)tf.fmt.red_mask, (int)tf.fmt.green_mask, (int)tf.fmt.blue_mask };
+			if( tf.tpixel_size == 3 )
+				max[0] = max[1] = max[2] = 255;
+			memset( prev, 0, comps * sizeof( int ) );
+			for( int y = 0; y < r.rect.h; ++y )
+			{
+				src.Read( &row[0], w * tf.tpixel_size );
+				GetComponents< PIXEL, SWAP >( tf, &row[0], &delta[0], w );
+				for( int x = 0; x < w; ++x )
+				{
+					for( int c = 0; c < 3; ++c )
+					{
+						int i = x * 3 + c;
+						int predicted = prev[i];
+						if( x > 0 )
+						{
+							predicted += cur[i - 3] - prev[i - 3];
+							if( predicted > max[c] )
+								predicted = max[c];
+							else if( predicted < 0 )
+								predicted = 0;
+						}
+						cur[i] = ( predicted + delta[i] ) & max[c];
+					}
+					pixels[x] = PackPixel< PIXEL, SWAP >( tf, cur[x * 3], cur[x * 3 + 1], cur[x * 3 + 2] );
+				}
+				disp.WritePixels( r.rect.x, r.rect.y + y, w, (Uint8*)&pixels[0] );
+				int* swap = prev;
+				prev = cur;
+				cur = swap;
+			}
+		}
+		else
+		{
+			for( int y = 0; y < r.rect.h; ++y )
+			{
+				if( tf.tpixel_size == (int)sizeof( PIXEL ) )
+				{
+					src.Read( (Uint8*)&pixels[0], w * sizeof( PIXEL ) );
+				}
+				else
+				{
+					src.Read( &row[0], w * tf.tpixel_size );
+					ConvertTPixels< PIXEL, SWAP >( tf, &row[0], &pixels[0], w );
+				}
+				disp.WritePixels( r.rect.x, r.rect.y + y, w, (Uint8*)&pixels[0] );
+			}
+		}
+	}
+
+	//! libjpeg error handler state; errors jump back to the decoder instead of exiting.
+	struct TightJpegError
+	{
+		jpeg_error_mgr mgr;                 //!< standard handler, with error_exit replaced
+		jmp_buf jump;                       //!< where to go on an error
+		char message[JMSG_LENGTH_MAX];      //!< what went wrong
+	};
+
+	static void JpegErrorExit( j_common_ptr cinfo )
+	{
+		TightJpegError* err = (TightJpegError*)cinfo->err;
+		(*cinfo->err->format_message)( cinfo, err->message );
+		longjmp( err->jump, 1 );
+	}
+
+	static void JpegOutputMessage( j_common_ptr )
+	{
+		// warnings about slightly broken images aren't worth a console message per frame
+	}
+
+	//! Picks the libjpeg output colour space that produces the display's pixels as is.
+	/*!
+	  \returns a 32-bit JCS_EXT_xxx space, or JCS_RGB if the display needs converted pixels
+	*/
+	static J_COLOR_SPACE GetJpegColorSpace( PixelFormat const& fmt )
+	{
+		if( fmt.bytes != 4 || fmt.red_mask != 255 || fmt.green_mask != 255 || fmt.blue_mask != 255 ||
+			fmt.red_shift % 8 || fmt.green_shift % 8 || fmt.blue_shift % 8 )
+		{
+			return JCS_RGB;
+		}
+
+		// where each component sits in memory
+		int r = fmt.red_shift / 8, g = fmt.green_shift / 8, b = fmt.blue_shift / 8;
+		if( fmt.big_endian )
+		{
+			r = 3 - r;
+			g = 3 - g;
+			b = 3 - b;
+		}
+		// libjpeg fills the unused byte with 0xFF, which the display ignores
+		if( r == 0 && g == 1 && b == 2 ) return JCS_EXT_RGBX;
+		if( r == 2 && g == 1 && b == 0 ) return JCS_EXT_BGRX;
+		if( r == 1 && g == 2 && b == 3 ) return JCS_EXT_XRGB;
+		if( r == 3 && g == 2 && b == 1 ) return JCS_EXT_XBGR;
+		return JCS_RGB;
+	}
+
+	//! Returns how many low bits of an 8-bit component don't fit in a component mask.
+	static int ComponentLoss( unsigned mask )
+	{
+		int loss = 8;
+		for( ; mask != 0 && loss > 0; mask >>= 1 )
+			--loss;
+		return loss;
+	}
+
+	//! Converts a row of 8-bit RGB to display pixels.
+	template< typename PIXEL, bool SWAP >
+	static void ConvertRGB( TightFormat const& tf, Uint8 const* src, Uint8* dst, int count )
+	{
+		int rl = ComponentLoss( tf.fmt.red_mask ), gl = ComponentLoss( tf.fmt.green_mask ), bl = ComponentLoss( tf.fmt.blue_mask );
+		PIXEL* pixels = (PIXEL*)dst;
+		for( int i = 0; i < count; ++i, src += 3 )
+			pixels[i] = PackPixel< PIXEL, SWAP >( tf, src[0] >> rl, src[1] >> gl, src[2] >> bl );
+	}
+
+	//! Decompresses a JPEG rectangle to the display, a row at a time.
+	/*!
+	  If the display's pixels are a libjpeg output format and the display hands
+	  out its rows, libjpeg writes directly into the framebuffer.
+	*/
+	static void DecodeJpeg( DecoderTIGHT::Rect& r, TightFormat const& tf, Display& disp, vector< Uint8 >& scratch )
+	{
+		J_COLOR_SPACE space = GetJpegColorSpace( tf.fmt );
+		if( space != JCS_RGB && disp.GetDirectRow( r.rect.x, r.rect.y ) == NULL )
+			space = JCS_RGB;
+		PixelKernel kernel = GetPixelKernel( tf.fmt );
+		Uint8* pixels = GetScratch( scratch, r.rect.w * ( tf.fmt.bytes + 3 ) );
+		Uint8* rgb = pixels + r.rect.w * tf.fmt.bytes;
+
+		jpeg_decompress_struct cinfo;
+		TightJpegError err;
+		cinfo.err = jpeg_std_error( &err.mgr );
+		err.mgr.error_exit = JpegErrorExit;
+		err.mgr.output_message = JpegOutputMessage;
+		if( setjmp( err.jump ) )
+		{
+			jpeg_destroy_decompress( &cinfo );
+			throw Exc( string( "unable to decode Tight JPEG rectangle: " ) + err.message );
+		}
+
+		jpeg_create_decompress( &cinfo );
+		jpeg_mem_src( &cinfo, r.data, r.length );
+		jpeg_read_header( &cinfo, TRUE );
+		cinfo.out_color_space = space;
+		jpeg_start_decompress( &cinfo );
+		if( cinfo.output_width != r.rect.w || cinfo.output_height != r.rect.h )
+		{
+			jpeg_destroy_decompress( &cinfo );
+			throw Exc( "Tight JPEG image does not match its rectangle" );
+		}
+
+		while( cinfo.output_scanline < cinfo.output_height )
+		{
+			int y = r.rect.y + cinfo.output_scanline;
+			JSAMPROW row;
+			if( space != JCS_RGB )
+			{
+				row = disp.GetDirectRow( r.rect.x, y );
+				jpeg_read_scanlines( &cinfo, &row, 1 );
+				continue;
+			}
+
+			// the display can't take libjpeg's output as is
+			row = rgb;
+			jpeg_read_scanlines( &cinfo, &row, 1 );
+			switch( kernel )
+			{
+			case PIXEL_KERNEL_8:          ConvertRGB< Uint8, false >( tf, rgb, pixels, r.rect.w );  break;
+			case PIXEL_KERNEL_16:         ConvertRGB< Uint16, false >( tf, rgb, pixels, r.rect.w ); break;
+			case PIXEL_KERNEL_16_SWAPPED: ConvertRGB< Uint16, true >( tf, rgb, pixels, r.rect.w );  break;
+			case PIXEL_KERNEL_32:         ConvertRGB< Uint32, false >( tf, rgb, pixels, r.rect.w ); break;
+			case PIXEL_KERNEL_32_SWAPPED: ConvertRGB< Uint32, true >( tf, rgb, pixels, r.rect.w );  break;
+			}
+			disp.WritePixels( r.rect.x, y, r.rect.w, pixels );
+		}
+
+		jpeg_finish_decompress( &cinfo );
+		jpeg_destroy_decompress( &cinfo );
+	}
+
+	//! Reads the length of a compressed block: 7 bits per byte, low bits first, up to 3 bytes.
+	static Uint32 ReceiveCompactLength( NetworkClient& net )
+	{
+		Uint32 length = 0;
+		for( int shift = 0; shift < 21; shift += 7 )
+		{
+			Uint8 b = Wire::ReceiveValue< Uint8 >( net );
+			if( shift == 14 )
+				return length | ( (Uint32)b << 14 );
+			length |= (Uint32)( b & 0x7F ) << shift;
+			if( !( b & 0x80 ) )
+				break;
+		}
+		return length;
+	}
+
+	//! Deletes every object in a list and empties it.
+	template< typename T >
+	static void DeleteAll( vector< T* >& objects )
+	{
+		for( unsigned i = 0; i < objects.size(); ++i )
+			delete objects[i];
+		objects.clear();
+	}
+
+	//! Returns true if two rectangles share any pixels.
+	static bool Overlaps( ScreenRect const& a, ScreenRect const& b )
+	{
+		return a.x < b.x + b.w && b.x < a.x + a.w && a.y < b.y + b.h && b.y < a.y + a.h;
+	}
+
+	void DecoderTIGHT::operator() ( ScreenRect const& rect, Display& disp )
+	{
+		++m_processed;
+
+		TightFormat tf( disp.GetPixelFormat() );
+		Uint8 control = Wire::ReceiveValue< Uint8 >( m_net );
+
+		// the low bits reset streams, which must wait for the rectangles queued on them
+		for( int i = 0; i < RFB_TIGHT_STREAMS; ++i )
+		{
+			if( !( control & ( 1 << i ) ) )
+				continue;
+			for( unsigned j = 0; j < m_pending.size(); ++j )
+			{
+				if( m_pending[j]->stream == i )
+				{
+					Flush( disp );
+					break;
+				}
+			}
+			m_zlib_readers[i].Reset();
+		}
+
+		// the rectangle and its data live in scratch memory until the end of the update
+		Rect* r = m_scratch->Allocate< Rect >( 1 );
+		r->rect = rect;
+		r->type = control & 0xF0;
+		r->stream = -1;
+		r->filter = RFB_TIGHT_FILTER_COPY;
+		r->palette_size = 0;
+		memset( r->palette, 0, sizeof( r->palette ) );
+		r->data = NULL;
+		r->length = 0;
+		if( r->type == RFB_TIGHT_FILL )
+		{
+			Uint8 tpixel[4];
+			m_net.ReceiveBytes( tpixel, tf.tpixel_size );
+			r->palette[0] = ConvertTPixel( tf, tpixel );
+		}
+		else if( r->type == RFB_TIGHT_JPEG )
+		{
+			r->length = ReceiveCompactLength( m_net );
+			if( r->length == 0 )
+				throw Exc( "empty Tight JPEG rectangle" );
+			r->data = m_scratch->Allocate< Uint8 >( r->length );
+			m_net.ReceiveBytes( r->data, r->length );
+		}
+		else if( r->type > RFB_TIGHT_MAX_SUBENCODING )
+		{
+			throw Exc( "unsupported Tight compression type" );
+		}
+		else
+		{
+			// basic compression
+			r->type = RFB_TIGHT_BASIC;
+			if( control & RFB_TIGHT_EXPLICIT_FILTER )
+				r->filter = Wire::ReceiveValue< Uint8 >( m_net );
+			int row_bytes = rect.w * tf.tpixel_size;
+			if( r->filter == RFB_TIGHT_FILTER_PALETTE )
+			{
+				r->palette_size = Wire::ReceiveValue< Uint8 >( m_net ) + 1;
+				Uint8 colors[256 * 4];
+				m_net.ReceiveBytes( colors, r->palette_size * tf.tpixel_size );
+				for( int i = 0; i < r->palette_size; ++i )
+					r->palette[i] = ConvertTPixel( tf, colors + i * tf.tpixel_size );
+				row_bytes = r->palette_size == 2 ? ( rect.w + 7 ) / 8 : rect.w;
+			}
+			else if( r->filter != RFB_TIGHT_FILTER_COPY && r->filter != RFB_TIGHT_FILTER_GRADIENT )
+			{
+				throw Exc( "unknown Tight filter" );
+			}
+
+			// small amounts of data aren't worth compressing
+			r->length = row_bytes * rect.h;
+			if( r->length >= RFB_TIGHT_MIN_TO_COMPRESS )
+			{
+				r->stream = ( control >> 4 ) & ( RFB_TIGHT_STREAMS - 1 );
+				r->length = ReceiveCompactLength( m_net );
+			}
+			if( r->length > 0 )
+			{
+				r->data = m_scratch->Allocate< Uint8 >( r->length );
+				m_net.ReceiveBytes( r->data, r->length );
+			}
+		}
+		Schedule( r, disp );
+	}
+
+	DecoderTIGHT::DecoderTIGHT( NetworkClient& net )
+		: Decoder( net ),
+		  m_quality_level( -1 )
+	{
+	}
+
+	DecoderTIGHT::~DecoderTIGHT()
+	{
+		DeleteAll( m_lanes );
+	}
+
+	void DecoderTIGHT::GetPseudoEncodings( vector< Uint32 >& encodings ) const
+	{
+		if( m_quality_level >= 0 )
+			encodings.push_back( RFB_ENCODING_QUALITY_LEVEL_0 + m_quality_level );
+	}
+
+	void DecoderTIGHT::Schedule( Rect* r, Display& disp )
+	{
+		if( m_pool == NULL || m_pool->GetNumWorkers() < 2 )
+		{
+			m_pending.push_back( r );
+			r->lane = 0;
+			Flush( disp );
+			return;
+		}
+
+		// rectangles that overlap must be drawn in order, so they have to share a lane
+		r->lane = r->stream >= 0 ? r->stream : RFB_TIGHT_STREAMS + m_pending.size();
+		for( unsigned i = 0; i < m_pending.size(); ++i )
+		{
+			if( m_pending[i]->lane != r->lane && Overlaps( m_pending[i]->rect, r->rect ) )
+			{
+				Flush( disp );
+				break;
+			}
+		}
+		m_pending.push_back( r );
+	}
+
+	void DecoderTIGHT::Flush( Display& disp )
+	{
+		if( m_pending.empty() )
+			return;
+
+		// sort the rectangles into lanes, keeping their order
+		unsigned num_lanes = 0;
+		for( unsigned i = 0; i < m_pending.size(); ++i )
+		{
+			Rect* r = m_pending[i];
+			unsigned l = 0;
+			while( l < num_lanes && m_lanes[l]->id != r->lane )
+				++l;
+			if( l == num_lanes )
+			{
+				if( num_lanes == m_lanes.size() )
+					m_lanes.push_back( new Lane( *this ) );
+				m_lanes[l]->id = r->lane;
+				m_lanes[l]->disp = &disp;
+				m_lanes[l]->rects.clear();
+				++num_lanes;
+			}
+			m_lanes[l]->rects.push_back( r );
+		}
+
+		disp.BeginDrawing();
+		try
+		{
+			if( num_lanes == 1 )
+			{
+				m_lanes[0]->Run();
+			}
+			else
+			{
+				for( unsigned i = 0; i < num_lanes; ++i )
+					m_pool->Submit( *m_lanes[i] );
+				m_pool->Wait();
+			}
+		}
+		catch( ... )
+		{
+			EndDrawing( disp );
+			m_pending.clear();
+			throw;
+		}
+		EndDrawing( disp );
+		m_pending.clear();
+	}
+
+	void DecoderTIGHT::EndDrawing( Display& disp )
+	{
+		// each rectangle on its own, rather than the box around them all;
+		// after the first, each is a drawing of its own with nothing in it
+		for( unsigned i = 0; i < m_pending.size(); ++i )
+		{
+			if( i > 0 )
+				disp.BeginDrawing();
+			disp.EndDrawing( m_pending[i]->rect );
+		}
+	}
+
+	void DecoderTIGHT::Decode( Rect& r, Display& disp, vector< Uint8 >& scratch )
+	{
+		TightFormat tf( disp.GetPixelFormat() );
+		if( r.type == RFB_TIGHT_FILL )
+		{
+			disp.FillRect( r.rect, r.palette[0] );
+			return;
+		}
+		if( r.type == RFB_TIGHT_JPEG )
+		{
+			DecodeJpeg( r, tf, disp, scratch );
+			return;
+		}
+
+		TightSource src( r.stream >= 0 ? &m_zlib_readers[r.stream] : NULL, r.data, r.length );
+		switch( GetPixelKernel( tf.fmt ) )
+		{
+		case PIXEL_KERNEL_8:          DecodeRows< Uint8, false >( r, tf, src, disp, scratch );  break;
+		case PIXEL_KERNEL_16:         DecodeRows< Uint16, false >( r, tf, src, disp, scratch ); break;
+		case PIXEL_KERNEL_16_SWAPPED: DecodeRows< Uint16, true >( r, tf, src, disp, scratch );  break;
+		case PIXEL_KERNEL_32:         DecodeRows< Uint32, false >( r, tf, src, disp, scratch ); break;
+		case PIXEL_KERNEL_32_SWAPPED: DecodeRows< Uint32, true >( r, tf, src, disp, scratch );  break;
+		}
+		src.Finish();
+	}
+
+};
@@ -6,48 +6,137 @@
 
 #include <iostream>
 #include "vnc.h"
+#include "vnc-wire.h"
 
 using namespace std;
 
-#define GET_UINT32( var ) m_net.ReceiveBytes( (Uint8*)&var, 4 ); var = VNC_SWAP_BE_32( var );
-#define NET_UINT32( var ) Uint32 var; GET_UINT32( var );
-#define GET_UINT16( var ) m_net.ReceiveBytes( (Uint8*)&var, 2 ); var = VNC_SWAP_BE_16( var );
-#define NET_UINT16( var ) Uint16 var; GET_UINT16( var );
-#define NET_UINT8( var ) Uint8 var; m_net.ReceiveBytes( &var, 1 );
-
 #define ZIP_UINT32( var ) Uint32 var; m_zlib_reader.Read( var );
 #define ZIP_UINT16( var ) Uint16 var; m_zlib_reader.Read( var );
 #define ZIP_UINT8( var )  Uint8 var; m_zlib_reader.Read( var );
 
+#define ZLIB_BATCH_BYTES      16384   //!< decompressed bytes drawn at a time when rows can't go straight to the display
+#define ZLIB_PIPELINE_BATCHES 8       //!< batches of rows that can be waiting for or on workers at once
+
 namespace VNC
 {
 
-	DEFINE_VNC_DECODER( ZLIB )
+	//! Rows inflated by the network thread, for a worker to draw.
+	class ZlibRows : public Job
 	{
-		++m_processed;
+	public:
+		ZlibRows() : disp( NULL ), x( 0 ), y( 0 ), w( 0 ), count( 0 ), row_bytes( 0 ), rows( NULL ) {}
+
+		virtual void Run()
+		{
+			disp->WriteRect( ScreenRect( x, y, w, count ), rows, row_bytes );
+		}
+
+		Display* disp;        //!< display to draw on
+		int x, y, w;          //!< where the first row goes, and its width
+		unsigned count;       //!< rows in the batch
+		unsigned row_bytes;   //!< bytes per row
+		Uint8* rows;          //!< the rows, in scratch memory
+	};
+
+	/*!
+	  Inflates a rectangle that can't go straight to the display, while
+	  workers draw the rows inflated so far. Drawing is a conversion on
+	  some displays, such as those with three-byte pixels.
+	  \param zr decompressed ZLIB data
+	  \param rect rectangle to decode
+	  \param disp display to write to
+	  \param in scratch memory and threads
+	  \param batch rows per batch
+	*/
+	static void InflateRowsPipelined( ZlibReader& zr, ScreenRect const& rect, Display& disp, DecoderInput& in, unsigned batch )
+	{
+		ZlibRows batches[ZLIB_PIPELINE_BATCHES];
+		unsigned row_bytes = rect.w * disp.GetPixelFormat().bytes;
+		int used = 0;
+		try
+		{
+			for( unsigned y = 0; y < rect.h; )
+			{
+				// once every batch is handed out, wait for all of them to be free again
+				if( used == ZLIB_PIPELINE_BATCHES )
+				{
+					in.pool->Wait();
+					used = 0;
+				}
+				ZlibRows& rows = batches[used++];
+				if( rows.rows == NULL )
+					rows.rows = in.scratch.Allocate< Uint8 >( batch * row_bytes );
+				rows.disp = &disp;
+				rows.x = rect.x;
+				rows.y = rect.y + y;
+				rows.w = rect.w;
+				rows.count = rect.h - y < batch ? rect.h - y : batch;
+				rows.row_bytes = row_bytes;
+				zr.ReadBytes( rows.rows, rows.count * row_bytes );
+				in.pool->Submit( rows );
+				y += rows.count;
+			}
+			in.pool->Wait();
+		}
+		catch( ... )
+		{
+			// workers may still be reading the batches
+			try
+			{
+				in.pool->Wait();
+			}
+			catch( ... )
+			{
+			}
+			throw;
+		}
+	}
 
-		// read the length of the compressed data
-		//! \todo sanity check this length
-		NET_UINT32( compressed_length );
+	DEFINE_VNC_DECODER( ZLIB )
+	{
+		// inflate the compressed data as it arrives, a few rows at a time
+		Uint32 compressed_length = Wire::ReceiveValue< Uint32 >( in.net );
+		m_zlib_reader.SetStream( in.net, compressed_length );
 
-		// receive the data and hand it to the decoder
-		Uint8* compressed_buf = new Uint8[compressed_length];
-		m_net.ReceiveBytes( compressed_buf, compressed_length );
-		m_zlib_reader.SetStream( compressed_buf, compressed_length );
+		unsigned row_bytes = rect.w * disp.GetPixelFormat().bytes;
+		unsigned batch = row_bytes > 0 ? ZLIB_BATCH_BYTES / row_bytes : rect.h;
+		if( batch == 0 )
+			batch = 1;
 
-		// write the raw chunk
-		unsigned int count = rect.w*rect.h*disp.GetPixelFormat().bytes;
-		Uint8* buf = new Uint8[count];
-		m_zlib_reader.ReadBytes( buf, count );
 		disp.BeginDrawing();
-		for( unsigned y = 0; y < rect.h; ++y )
+		if( in.pool != NULL && in.pool->GetNumWorkers() > 0 && rect.h > batch && disp.GetDirectRow( rect.x, rect.y ) == NULL )
 		{
-			disp.WritePixels( rect.x, rect.y + y, rect.w, buf + disp.GetPixelFormat().bytes * rect.w * y );
+			// nothing goes straight to the display, so workers can draw while we inflate
+			InflateRowsPipelined( m_zlib_reader, rect, disp, in, batch );
 		}
-		disp.EndDrawing( rect );
-		delete buf;
+		else
+		{
+			Uint8* rows = in.scratch.Allocate< Uint8 >( batch * row_bytes );
+			for( unsigned y = 0; y < rect.h; )
+			{
+				// rows the display lets us write to go straight there
+				Uint8* direct = disp.GetDirectRow( rect.x, rect.y + y );
+				if( direct != NULL )
+				{
+					m_zlib_reader.ReadBytes( direct, row_bytes );
+					++y;
+					continue;
+				}
 
-		delete compressed_buf;		
+				unsigned count = rect.h - y < batch ? rect.h - y : batch;
+				m_zlib_reader.ReadBytes( rows, count * row_bytes );
+				disp.WriteRect( ScreenRect( rect.x, rect.y + y, rect.w, count ), rows, row_bytes );
+				y += count;
+			}
+		}
+		m_zlib_reader.Finish();
+		disp.EndDrawing( rect );
 	}
 
+	bool DecoderZLIB::Frame( ScreenRect const& /* rect */, Display& /* disp */, Wire::Recorder& data )
+	{
+		++m_processed;
+		data.Skip( Wire::ReceiveValue< Uint32 >( data ) );
+		return true;
+	}
 };
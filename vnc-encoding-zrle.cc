@@ -1,44 +1,937 @@
 /*!
   \file vnc-encoding-zrle.cc
-  \brief Implementation of the ZRLE update encoding type.
+  \brief Implementation of the ZRLE, TRLE and ZYWRLE update encoding types.
+
+  TRLE is ZRLE without the zlib layer, in 16x16 tiles, plus two
+  subencodings that reuse the previous tile's palette. ZYWRLE is ZRLE
+  whose raw tiles carry wavelet coefficients instead of pixels. All
+  three decode through the same tile rasterizer.
   \author John R. Hall
 */
 
 #include <iostream>
+#include <string.h>
+#include <vector>
 #include "vnc.h"
+#include "vnc-wire.h"
 
 using namespace std;
 
-#define GET_UINT32( var ) m_net.ReceiveBytes( (Uint8*)&var, 4 ); var = VNC_SWAP_BE_32( var );
-#define NET_UINT32( var ) Uint32 var; GET_UINT32( var );
-#define GET_UINT16( var ) m_net.ReceiveBytes( (Uint8*)&var, 2 ); var = VNC_SWAP_BE_16( var );
-#define NET_UINT16( var ) Uint16 var; GET_UINT16( var );
-#define NET_UINT8( var ) Uint8 var; m_net.ReceiveBytes( &var, 1 );
+#define ZRLE_TILE_SIZE       64    //!< ZRLE tiles are 64x64 pixels, smaller at the right and bottom edges
+#define TRLE_TILE_SIZE       16    //!< TRLE tiles are 16x16 pixels
+
+#define ZRLE_RAW             0     //!< tile is a plain array of CPIXELs
+#define ZRLE_SOLID           1     //!< tile is a single CPIXEL
+#define ZRLE_PACKED_MAX      16    //!< 2..16: palette size, followed by packed palette indices
+#define ZRLE_PACKED_REUSE    127   //!< packed palette indices into the previous tile's palette (TRLE only)
+#define ZRLE_PLAIN_RLE       128   //!< runs of CPIXELs
+#define ZRLE_PALETTE_REUSE   129   //!< runs of indices into the previous tile's palette (TRLE only)
+#define ZRLE_PALETTE_RLE     130   //!< 130..255: palette of (value - 128) entries, then runs of indices
 
-#define ZIP_UINT32( var ) Uint32 var; m_zlib_reader.Read( var );
-#define ZIP_UINT16( var ) Uint16 var; m_zlib_reader.Read( var );
-#define ZIP_UINT8( var )  Uint8 var; m_zlib_reader.Read( var );
+#define ZRLE_PIPELINE_MIN_TILES  4      //!< smallest rectangle, in tiles, whose tiles are drawn on workers
+#define ZRLE_PIPELINE_BATCHES    16     //!< batches of tiles that can be waiting for or on workers at once
+#define ZRLE_BATCH_TILES         8      //!< most tiles in a batch
+#define ZRLE_BATCH_BYTES         16384  //!< initial size of a batch's data
+
+#define ZYWRLE_MAX_LEVEL     3     //!< deepest wavelet transform, used at the lowest qualities
+#if defined(__GNUC__) || defined(__clang__)
+# define ZYWRLE_LANES        16    //!< coefficients per vector in the inverse wavelet
+#else
+# define ZYWRLE_LANES        1
+#endif
+#define ZYWRLE_STRIDE        ( ZRLE_TILE_SIZE + 2 * ZYWRLE_LANES )   //!< coefficient plane row, with room to overrun
 
 namespace VNC
 {
 
+	//! How compressed pixels (CPIXELs) are laid out in the stream.
+	struct CPixelLayout
+	{
+		int size;    //!< bytes per CPIXEL on the wire
+		int offset;  //!< where those bytes go within a full pixel
+	};
+
+	//! Works out the CPIXEL layout for a pixel format.
+	/*!
+	  32-bit true colour pixels whose colour bits fit in three bytes are
+	  sent as those three bytes only.
+	*/
+	static CPixelLayout GetCPixelLayout( PixelFormat const& fmt )
+	{
+		CPixelLayout layout = { (int)fmt.bytes, 0 };
+		if( fmt.bytes == 4 && fmt.bits <= 24 )
+		{
+			Uint32 used = (fmt.red_mask << fmt.red_shift) | (fmt.green_mask << fmt.green_shift) | (fmt.blue_mask << fmt.blue_shift);
+			bool fits_low = (used & 0xFF000000) == 0;
+			bool fits_high = (used & 0x000000FF) == 0;
+			if( fits_low || fits_high )
+			{
+				// the unused byte is the top one in little endian order if
+				// the low bytes are used, and the other way around
+				layout.size = 3;
+				layout.offset = ( fits_low != fmt.big_endian ) ? 0 : 1;
+			}
+		}
+		return layout;
+	}
+
+	//! Reads a run of CPIXELs and expands them to full pixels.
+	template< typename PIXEL, typename SOURCE >
+	static void ReadCPixels( SOURCE& zr, CPixelLayout const& layout, PIXEL* pixels, int count )
+	{
+		if( layout.size == sizeof( PIXEL ) )
+		{
+			zr.ReadBytes( (Uint8*)pixels, count * sizeof( PIXEL ) );
+			return;
+		}
+
+		// three byte CPIXELs: read them packed at the end of the buffer, then spread them out
+		Uint8* packed = (Uint8*)pixels + count * ( sizeof( PIXEL ) - layout.size );
+		zr.ReadBytes( packed, count * layout.size );
+		for( int i = 0; i < count; ++i )
+		{
+			PIXEL pixel = 0;
+			memcpy( (Uint8*)&pixel + layout.offset, packed + i * layout.size, layout.size );
+			pixels[i] = pixel;
+		}
+	}
+
+	//! Reads an RLE run length, after its first byte: 1 plus a sequence of bytes ending with one that isn't 255.
+	template< typename SOURCE >
+	static int ReadRunLength( SOURCE& zr, Uint8 b )
+	{
+		int length = 1 + b;
+		while( b == 255 )
+		{
+			b = zr.ReadByte();
+			length += b;
+		}
+		return length;
+	}
+
+	//! Reads a CPIXEL and the length of its run, together.
+	template< typename PIXEL, typename SOURCE >
+	static PIXEL ReadRun( SOURCE& zr, CPixelLayout const& layout, int& length )
+	{
+		Uint8 buf[5];
+		zr.ReadBytes( buf, layout.size + 1 );
+		PIXEL pixel = 0;
+		memcpy( (Uint8*)&pixel + layout.offset, buf, layout.size );
+		length = ReadRunLength( zr, buf[layout.size] );
+		return pixel;
+	}
+
+#if defined(__GNUC__) || defined(__clang__)
+	typedef Int8 ZywrleVector __attribute__(( vector_size( ZYWRLE_LANES ) ));   //!< signed coefficients, wrapping like the reference's bytes
+#else
+	typedef Int8 ZywrleVector;
+#endif
+
+	//! Loads ZYWRLE_LANES coefficients from anywhere.
+	static inline ZywrleVector LoadCoeffs( Int8 const* p )
+	{
+		ZywrleVector v;
+		memcpy( &v, p, sizeof( v ) );
+		return v;
+	}
+
+	//! Stores ZYWRLE_LANES coefficients anywhere.
+	static inline void StoreCoeffs( Int8* p, ZywrleVector v )
+	{
+		memcpy( p, &v, sizeof( v ) );
+	}
+
+	//! Picks lanes of \a a where \a mask is all ones, and of \a b elsewhere.
+	static inline ZywrleVector Select( ZywrleVector mask, ZywrleVector a, ZywrleVector b )
+	{
+		return ( mask & a ) | ( ~mask & b );
+	}
+
+	//! Piecewise-linear Haar step on pairs of coefficients, in every lane at once.
+	/*!
+	  The transform is its own inverse. Arithmetic wraps at eight bits and
+	  the sign tests look at bit 7, exactly as the byte-wise reference does,
+	  so every lane gives the same result as the scalar version.
+	  \param x0 first coefficient of each pair; becomes the low band
+	  \param x1 second coefficient of each pair; becomes the high band
+	*/
+	static inline void PLHaar( ZywrleVector& x0, ZywrleVector& x1 )
+	{
+		ZywrleVector a = x0;
+		ZywrleVector b = x1;
+		ZywrleVector differ = ( a ^ b ) >> 7;
+
+		// signs differ: b += a, then a -= b if the sum kept b's sign
+		ZywrleVector sum = b + a;
+		ZywrleVector d_high = a - ( sum & ~( ( sum ^ b ) >> 7 ) );
+
+		// same sign: a -= b, then b += a if the difference kept a's sign
+		ZywrleVector diff = a - b;
+		ZywrleVector s_low = b + ( diff & ~( ( diff ^ a ) >> 7 ) );
+
+		x0 = Select( differ, sum, s_low );
+		x1 = Select( differ, d_high, diff );
+	}
+
+	//! Wavelet coefficients of one ZYWRLE tile, as red, green and blue planes.
+	/*!
+	  The planes hold V, Y and U after the transform. Rows are padded so
+	  that the vector loops can run past the tile's width into scratch space
+	  instead of handling a ragged tail.
+	*/
+	struct ZywrleTile
+	{
+		ZywrleTile()
+		{
+			memset( planes, 0, sizeof( planes ) );
+			memset( pairs, 0, sizeof( pairs ) );
+			memset( odd, 0, sizeof( odd ) );
+			for( int level = 0; level <= ZYWRLE_MAX_LEVEL; ++level )
+				for( int x = 0; x < ZYWRLE_STRIDE; ++x )
+				{
+					int step = 1 << level;
+					pairs[level][x] = ( x % step == 0 ) ? -1 : 0;
+					if( level < ZYWRLE_MAX_LEVEL )
+						odd[level][x] = ( x % ( 2 * step ) == step ) ? -1 : 0;
+				}
+		}
+
+		Int8 planes[3][ZRLE_TILE_SIZE][ZYWRLE_STRIDE];   //!< coefficients, by component then row
+		Int8 pairs[ZYWRLE_MAX_LEVEL + 1][ZYWRLE_STRIDE];  //!< all ones in columns that are a multiple of 1 << level
+		Int8 odd[ZYWRLE_MAX_LEVEL][ZYWRLE_STRIDE];        //!< all ones in columns that are 1 << level past a multiple of 2 << level
+		Int8 low[ZYWRLE_STRIDE];                          //!< row pass results for the first of each pair
+		Int8 high[ZYWRLE_LANES + ZYWRLE_STRIDE];          //!< row pass results for the second, with room to look back
+	};
+
+	//! Undoes one level of the wavelet on one plane: columns, then rows.
+	/*!
+	  \param t coefficient storage and lane masks
+	  \param plane red, green or blue plane
+	  \param w width of the transformed area, a multiple of 2 << level
+	  \param h height of the transformed area, a multiple of 2 << level
+	  \param level transform level, 0 being the finest
+	*/
+	static void InverseWaveletLevel( ZywrleTile& t, int plane, int w, int h, int level )
+	{
+		int step = 1 << level;
+		Int8 (*rows)[ZYWRLE_STRIDE] = t.planes[plane];
+
+		// vertical pairs: rows y and y + step, in the columns this level touches
+		Int8 const* mask = t.pairs[level];
+		for( int y = 0; y < h; y += 2 * step )
+		{
+			Int8* r0 = rows[y];
+			Int8* r1 = rows[y + step];
+			for( int x = 0; x < w; x += ZYWRLE_LANES )
+			{
+				ZywrleVector a = LoadCoeffs( r0 + x );
+				ZywrleVector b = LoadCoeffs( r1 + x );
+				ZywrleVector a2 = a;
+				ZywrleVector b2 = b;
+				PLHaar( a2, b2 );
+				ZywrleVector m = LoadCoeffs( mask + x );
+				StoreCoeffs( r0 + x, Select( m, a2, a ) );
+				StoreCoeffs( r1 + x, Select( m, b2, b ) );
+			}
+		}
+
+		// horizontal pairs: columns x and x + step, on the rows this level touches;
+		// both halves of each pair are worked out before the row is rewritten
+		Int8 const* first = t.pairs[level + 1];
+		Int8 const* second = t.odd[level];
+		Int8* high = t.high + ZYWRLE_LANES;
+		for( int y = 0; y < h; y += step )
+		{
+			Int8* row = rows[y];
+			for( int x = 0; x < w; x += ZYWRLE_LANES )
+			{
+				ZywrleVector a = LoadCoeffs( row + x );
+				ZywrleVector b = LoadCoeffs( row + x + step );
+				PLHaar( a, b );
+				StoreCoeffs( t.low + x, a );
+				StoreCoeffs( high + x, b );
+			}
+			for( int x = 0; x < w; x += ZYWRLE_LANES )
+			{
+				ZywrleVector v = Select( LoadCoeffs( second + x ), LoadCoeffs( high + x - step ), LoadCoeffs( row + x ) );
+				StoreCoeffs( row + x, Select( LoadCoeffs( first + x ), LoadCoeffs( t.low + x ), v ) );
+			}
+		}
+	}
+
+	//! How colour components sit in display pixels, for ZYWRLE.
+	/*!
+	  Coefficients travel in the colour components of ordinary pixels,
+	  scaled up to eight bits as the reference does for 15 and 16 bit colour.
+	*/
+	struct ZywrleFormat
+	{
+		ZywrleFormat( PixelFormat const& fmt )
+		{
+			Uint32 const masks[3] = { fmt.red_mask, fmt.green_mask, fmt.blue_mask };
+			Uint32 const shifts[3] = { fmt.red_shift, fmt.green_shift, fmt.blue_shift };
+			for( int c = 0; c < 3; ++c )
+			{
+				int bits = 0;
+				while( bits < 32 && ( masks[c] >> bits ) != 0 )
+					++bits;
+				mask[c] = masks[c];
+				shift[c] = shifts[c];
+				scale[c] = 8 - bits;
+			}
+		}
+
+		//! Reads one component of a pixel, as an 8-bit value.
+		int Get( Uint32 pixel, int c ) const
+		{
+			Uint32 v = ( pixel >> shift[c] ) & mask[c];
+			return scale[c] >= 0 ? (int)( v << scale[c] ) : (int)( v >> -scale[c] );
+		}
+
+		//! Packs a component of 0 to 255 into its place in a pixel.
+		Uint32 Put( int value, int c ) const
+		{
+			Uint32 v = scale[c] >= 0 ? (Uint32)value >> scale[c] : (Uint32)value << -scale[c];
+			return v << shift[c];
+		}
+
+		Uint32 mask[3];   //!< red, green and blue masks
+		int shift[3];     //!< red, green and blue shifts
+		int scale[3];     //!< left shift from each component to eight bits; negative for wider components
+	};
+
+	//! Clamps a colour component to 0..255.
+	static inline int ClampComponent( int v )
+	{
+		return v < 0 ? 0 : v > 255 ? 255 : v;
+	}
+
+	//! Turns a tile of ZYWRLE coefficients back into pixels, in place.
+	/*!
+	  The tile's pixels, in order, are the coefficients of the largest area
+	  whose sides are a multiple of 1 << level, finest subbands first, then
+	  the pixels of the leftover strips on the right and bottom as they are.
+	  \param t coefficient storage
+	  \param zf how coefficients sit in pixels
+	  \param tile tile pixels, tw by th
+	  \param tw tile width
+	  \param th tile height
+	  \param level number of wavelet levels
+	*/
+	template< typename PIXEL, bool SWAP >
+	static void ZywrleSynthesize( ZywrleTile& t, ZywrleFormat const& zf, PIXEL* tile, int tw, int th, int level )
+	{
+		int w = tw & ~( ( 1 << level ) - 1 );
+		int h = th & ~( ( 1 << level ) - 1 );
+		if( w == 0 || h == 0 )
+			return;   // too small to transform; sent as plain pixels
+
+		// spread the coefficients out to their places in the planes
+		PIXEL const* src = tile;
+		for( int l = 0; l < level; ++l )
+		{
+			int step = 2 << l;
+			for( int band = 3; band >= ( l == level - 1 ? 0 : 1 ); --band )
+			{
+				int x0 = ( band & 1 ) ? step / 2 : 0;
+				int y0 = ( band & 2 ) ? step / 2 : 0;
+				for( int y = y0; y < h; y += step )
+					for( int x = x0; x < w; x += step )
+					{
+						Uint32 pixel = OrderPixel< SWAP >( *src );
+						++src;
+						for( int c = 0; c < 3; ++c )
+							t.planes[c][y][x] = (Int8)zf.Get( pixel, c );
+					}
+			}
+		}
+
+		// the leftover pixels follow the coefficients; keep them before overwriting the tile
+		PIXEL rest[ZRLE_TILE_SIZE * ZRLE_TILE_SIZE];
+		int rest_count = tw * th - w * h;
+		memcpy( rest, src, rest_count * sizeof( PIXEL ) );
+
+		for( int l = level - 1; l >= 0; --l )
+			for( int c = 0; c < 3; ++c )
+				InverseWaveletLevel( t, c, w, h, l );
+
+		// reversible colour transform, from V, Y and U in the red, green and blue planes
+		for( int y = 0; y < h; ++y )
+		{
+			PIXEL* dst = tile + y * tw;
+			for( int x = 0; x < w; ++x )
+			{
+				int yy = t.planes[1][y][x] + 128;
+				int u = t.planes[2][y][x] * 2;
+				int v = t.planes[0][y][x] * 2;
+				int g = yy - ( ( u + v ) >> 2 );
+				int b = u + g;
+				int r = v + g;
+				PIXEL pixel = (PIXEL)( zf.Put( ClampComponent( r ), 0 ) | zf.Put( ClampComponent( g ), 1 ) | zf.Put( ClampComponent( b ), 2 ) );
+				dst[x] = OrderPixel< SWAP >( pixel );
+			}
+		}
+
+		// right strip, bottom strip, then the corner
+		PIXEL const* p = rest;
+		for( int y = 0; y < h; ++y )
+			for( int x = w; x < tw; ++x )
+				tile[y * tw + x] = *p++;
+		for( int y = h; y < th; ++y )
+			for( int x = 0; x < w; ++x )
+				tile[y * tw + x] = *p++;
+		for( int y = h; y < th; ++y )
+			for( int x = w; x < tw; ++x )
+				tile[y * tw + x] = *p++;
+	}
+
+	//! Decodes the body of one tile into a buffer, after its subencoding byte.
+	/*!
+	  \param zr decompressed ZRLE data, or raw TRLE data
+	  \param layout CPIXEL layout
+	  \param subencoding tile subencoding
+	  \param tile buffer to fill, tw by th
+	  \param tw tile width
+	  \param th tile height
+	  \param palette palette shared from tile to tile
+	  \param palette_size number of entries in \a palette
+	*/
+	template< typename PIXEL, typename SOURCE >
+	static void DecodeTileBody( SOURCE& zr, CPixelLayout const& layout, Uint8 subencoding, PIXEL* tile, int tw, int th,
+								PIXEL* palette, int& palette_size )
+	{
+		int count = tw * th;
+		if( subencoding == ZRLE_RAW )
+		{
+			ReadCPixels( zr, layout, tile, count );
+		}
+		else if( subencoding == ZRLE_SOLID )
+		{
+			PIXEL pixel;
+			ReadCPixels( zr, layout, &pixel, 1 );
+			for( int i = 0; i < count; ++i )
+				tile[i] = pixel;
+		}
+		else if( subencoding <= ZRLE_PACKED_MAX || subencoding == ZRLE_PACKED_REUSE )
+		{
+			// packed palette indices, each row starting on a byte boundary
+			if( subencoding != ZRLE_PACKED_REUSE )
+			{
+				palette_size = subencoding;
+				ReadCPixels( zr, layout, palette, palette_size );
+			}
+			else if( palette_size < 2 || palette_size > ZRLE_PACKED_MAX )
+			{
+				throw Exc( "TRLE tile reuses a palette that doesn't fit" );
+			}
+			int bits = palette_size == 2 ? 1 : palette_size <= 4 ? 2 : 4;
+			Uint8 mask = (1 << bits) - 1;
+			PIXEL* dst = tile;
+			for( int row = 0; row < th; ++row )
+			{
+				Uint8 byte = 0;
+				int left = 0;
+				for( int col = 0; col < tw; ++col )
+				{
+					if( left == 0 )
+					{
+						byte = zr.ReadByte();
+						left = 8;
+					}
+					left -= bits;
+					int index = (byte >> left) & mask;
+					if( index >= palette_size )
+						throw Exc( "ZRLE palette index out of range" );
+					*dst++ = palette[index];
+				}
+			}
+		}
+		else if( subencoding == ZRLE_PLAIN_RLE )
+		{
+			PIXEL* dst = tile;
+			PIXEL* end = tile + count;
+			while( dst < end )
+			{
+				int length;
+				PIXEL pixel = ReadRun< PIXEL >( zr, layout, length );
+				if( length > end - dst )
+					throw Exc( "ZRLE run extends past the end of the tile" );
+				for( PIXEL* run_end = dst + length; dst < run_end; ++dst )
+					*dst = pixel;
+			}
+		}
+		else if( subencoding >= ZRLE_PALETTE_RLE || subencoding == ZRLE_PALETTE_REUSE )
+		{
+			if( subencoding != ZRLE_PALETTE_REUSE )
+			{
+				palette_size = subencoding - 128;
+				ReadCPixels( zr, layout, palette, palette_size );
+			}
+			else if( palette_size == 0 )
+			{
+				throw Exc( "TRLE tile reuses a palette before sending one" );
+			}
+			PIXEL* dst = tile;
+			PIXEL* end = tile + count;
+			while( dst < end )
+			{
+				Uint8 index = zr.ReadByte();
+				if( ( index & 127 ) >= palette_size )
+					throw Exc( "ZRLE palette index out of range" );
+				if( !( index & 128 ) )
+				{
+					*dst++ = palette[index];
+					continue;
+				}
+				PIXEL pixel = palette[index & 127];
+				int length = ReadRunLength( zr, zr.ReadByte() );
+				if( length > end - dst )
+					throw Exc( "ZRLE run extends past the end of the tile" );
+				for( PIXEL* run_end = dst + length; dst < run_end; ++dst )
+					*dst = pixel;
+			}
+		}
+		else
+		{
+			throw Exc( "invalid ZRLE tile subencoding" );
+		}
+	}
+
+	//! Decodes one tile and writes it to the display.
+	/*!
+	  \param zr tile data, starting at its subencoding byte
+	  \param layout CPIXEL layout
+	  \param zf how ZYWRLE coefficients sit in pixels
+	  \param disp display to write to
+	  \param x left edge of the tile on the display
+	  \param y top edge of the tile on the display
+	  \param tw tile width
+	  \param th tile height
+	  \param tile buffer of at least tw by th pixels
+	  \param palette palette shared from tile to tile
+	  \param palette_size number of entries in \a palette
+	  \param zywrle coefficient storage for ZYWRLE, or NULL
+	  \param zywrle_level ZYWRLE wavelet levels, or 0 for plain ZRLE
+	*/
+	template< typename PIXEL, bool SWAP, typename SOURCE >
+	static void DrawTile( SOURCE& zr, CPixelLayout const& layout, ZywrleFormat const& zf, Display& disp,
+						  int x, int y, int tw, int th, PIXEL* tile, PIXEL* palette, int& palette_size,
+						  ZywrleTile* zywrle, int zywrle_level )
+	{
+		Uint8 subencoding = zr.ReadByte();
+		if( subencoding == ZRLE_SOLID )
+		{
+			PIXEL pixel;
+			ReadCPixels( zr, layout, &pixel, 1 );
+			disp.FillRect( ScreenRect( x, y, tw, th ), pixel );
+			return;
+		}
+		if( subencoding == ZRLE_RAW && zywrle_level > 0 )
+		{
+			// a raw ZYWRLE tile is another tile, of wavelet coefficients
+			DecodeTileBody( zr, layout, zr.ReadByte(), tile, tw, th, palette, palette_size );
+			ZywrleSynthesize< PIXEL, SWAP >( *zywrle, zf, tile, tw, th, zywrle_level );
+		}
+		else
+		{
+			DecodeTileBody( zr, layout, subencoding, tile, tw, th, palette, palette_size );
+		}
+
+		disp.WriteRect( ScreenRect( x, y, tw, th ), (Uint8*)tile, tw * sizeof( PIXEL ) );
+	}
+
+	//! Decodes all the tiles of a rectangle, writing them to the display a tile at a time.
+	/*!
+	  \param zr decompressed ZRLE data, or raw TRLE data
+	  \param rect rectangle to decode
+	  \param disp display to write to
+	  \param tile_size tile width and height
+	  \param zywrle coefficient storage for ZYWRLE, or NULL
+	  \param zywrle_level ZYWRLE wavelet levels, or 0 for plain ZRLE
+	*/
+	template< typename PIXEL, bool SWAP, typename SOURCE >
+	static void DecodeTiles( SOURCE& zr, ScreenRect const& rect, Display& disp, int tile_size,
+							 ZywrleTile* zywrle = NULL, int zywrle_level = 0 )
+	{
+		CPixelLayout layout = GetCPixelLayout( disp.GetPixelFormat() );
+		ZywrleFormat zf( disp.GetPixelFormat() );
+		PIXEL tile[ZRLE_TILE_SIZE * ZRLE_TILE_SIZE];
+		PIXEL palette[128];
+		int palette_size = 0;
+
+		for( int tile_y = 0; tile_y < rect.h; tile_y += tile_size )
+		{
+			int th = (rect.h - tile_y) < tile_size ? (rect.h - tile_y) : tile_size;
+			for( int tile_x = 0; tile_x < rect.w; tile_x += tile_size )
+			{
+				int tw = (rect.w - tile_x) < tile_size ? (rect.w - tile_x) : tile_size;
+				DrawTile< PIXEL, SWAP >( zr, layout, zf, disp, rect.x + tile_x, rect.y + tile_y, tw, th,
+						  tile, palette, palette_size, zywrle, zywrle_level );
+			}
+		}
+	}
+
+	//! Splits decompressed ZRLE data into tiles, without drawing them.
+	/*!
+	  This is the serial half of a pipelined rectangle: it walks each
+	  tile's structure just far enough to find its end, copying its bytes
+	  out so a worker can decode them. Tiles that reuse the previous
+	  palette get it written into their copy, so each copied tile stands
+	  on its own.
+	*/
+	class TileFramer
+	{
+	public:
+		/*!
+		  \param zr decompressed ZRLE data
+		  \param scratch memory for the copies
+		  \param layout CPIXEL layout
+		  \param zywrle true if raw tiles hold another tile, of wavelet coefficients
+		*/
+		TileFramer( ZlibReader& zr, ScratchArena& scratch, CPixelLayout const& layout, bool zywrle )
+			: m_zr( zr ), m_scratch( scratch ), m_cpixel( layout.size ), m_zywrle( zywrle ), m_out( NULL ), m_palette_size( 0 ) {}
+
+		//! Copies the next tile.
+		/*!
+		  \param out where the copy goes
+		  \param tw tile width
+		  \param th tile height
+		  \returns offset of the copy in \a out
+		*/
+		Uint32 Frame( ScratchBytes& out, int tw, int th )
+		{
+			m_out = &out;
+			Uint32 offset = out.length;
+			Uint8 subencoding = m_zr.ReadByte();
+			if( subencoding == ZRLE_RAW && m_zywrle )
+			{
+				Put( subencoding );
+				subencoding = m_zr.ReadByte();
+			}
+			FrameBody( subencoding, tw, th );
+			return offset;
+		}
+
+	private:
+
+		//! Copies a tile whose subencoding has been read, writing the subencoding first.
+		void FrameBody( Uint8 subencoding, int tw, int th )
+		{
+			int count = tw * th;
+			if( subencoding == ZRLE_RAW )
+			{
+				Put( subencoding );
+				Copy( count * m_cpixel );
+			}
+			else if( subencoding == ZRLE_SOLID )
+			{
+				Put( subencoding );
+				Copy( m_cpixel );
+			}
+			else if( subencoding <= ZRLE_PACKED_MAX || subencoding == ZRLE_PACKED_REUSE )
+			{
+				if( subencoding == ZRLE_PACKED_REUSE && ( m_palette_size < 2 || m_palette_size > ZRLE_PACKED_MAX ) )
+					throw Exc( "TRLE tile reuses a palette that doesn't fit" );
+				CopyPalette( subencoding == ZRLE_PACKED_REUSE ? 0 : subencoding, 0 );
+				int bits = m_palette_size == 2 ? 1 : m_palette_size <= 4 ? 2 : 4;
+				Copy( th * ( ( tw * bits + 7 ) / 8 ) );
+			}
+			else if( subencoding == ZRLE_PLAIN_RLE )
+			{
+				Put( subencoding );
+				while( count > 0 )
+				{
+					Copy( m_cpixel );
+					count -= CopyRunLength( count );
+				}
+			}
+			else if( subencoding >= ZRLE_PALETTE_RLE || subencoding == ZRLE_PALETTE_REUSE )
+			{
+				if( subencoding == ZRLE_PALETTE_REUSE && m_palette_size == 0 )
+					throw Exc( "TRLE tile reuses a palette before sending one" );
+				CopyPalette( subencoding == ZRLE_PALETTE_REUSE ? 0 : subencoding - 128, 128 );
+				while( count > 0 )
+					count -= ( CopyByte() & 128 ) ? CopyRunLength( count ) : 1;
+			}
+			else
+			{
+				throw Exc( "invalid ZRLE tile subencoding" );
+			}
+		}
+
+		//! Writes the subencoding and palette of a palette tile.
+		/*!
+		  \param size palette size sent with the tile, or 0 if it reuses the last one
+		  \param base what the subencoding adds to the palette size
+		*/
+		void CopyPalette( int size, int base )
+		{
+			if( size > 0 )
+			{
+				m_palette_size = size;
+				m_zr.ReadBytes( m_palette, size * m_cpixel );
+			}
+			Put( (Uint8)( base + m_palette_size ) );
+			memcpy( m_out->Append( m_scratch, m_palette_size * m_cpixel, ZRLE_BATCH_BYTES ), m_palette, m_palette_size * m_cpixel );
+		}
+
+		//! Copies a run length, after its first byte.
+		/*!
+		  \param left pixels left in the tile
+		  \returns the length
+		*/
+		int CopyRunLength( int left )
+		{
+			Uint8 b = CopyByte();
+			int length = 1 + b;
+			while( b == 255 )
+			{
+				b = CopyByte();
+				length += b;
+			}
+			if( length > left )
+				throw Exc( "ZRLE run extends past the end of the tile" );
+			return length;
+		}
+
+		void Put( Uint8 b ) { *m_out->Append( m_scratch, 1, ZRLE_BATCH_BYTES ) = b; }
+		Uint8 CopyByte() { Uint8 b = m_zr.ReadByte(); Put( b ); return b; }
+		void Copy( Uint32 count ) { m_zr.ReadBytes( m_out->Append( m_scratch, count, ZRLE_BATCH_BYTES ), count ); }
+
+		ZlibReader& m_zr;
+		ScratchArena& m_scratch;
+		int m_cpixel;                  //!< bytes per CPIXEL
+		bool m_zywrle;                 //!< raw tiles are ZYWRLE coefficient tiles
+		ScratchBytes* m_out;           //!< copy being written
+		Uint8 m_palette[127 * 4];      //!< the last palette sent, as CPIXELs
+		int m_palette_size;            //!< entries in m_palette
+	};
+
+	//! Where a framed tile goes.
+	struct FramedTile
+	{
+		int x, y, w, h;     //!< position and size on the display
+		Uint32 offset;      //!< start of its data in the batch
+	};
+
+	//! Tiles framed by the network thread, for a worker to draw.
+	template< typename PIXEL, bool SWAP >
+	class TileBatch : public Job
+	{
+	public:
+		TileBatch() : disp( NULL ), zywrle_level( 0 ), num_tiles( 0 ) {}
+
+		virtual void Run()
+		{
+			if( zywrle_level > 0 )
+			{
+				ZywrleTile zywrle;
+				Draw( &zywrle );
+			}
+			else
+			{
+				Draw( NULL );
+			}
+		}
+
+		Display* disp;                            //!< display to draw on
+		int zywrle_level;                         //!< ZYWRLE wavelet levels, or 0 for plain ZRLE
+		ScratchBytes bytes;                       //!< the tiles' data
+		FramedTile tiles[ZRLE_BATCH_TILES];       //!< the tiles, in order
+		int num_tiles;                            //!< entries used in tiles
+
+	private:
+		void Draw( ZywrleTile* zywrle )
+		{
+			CPixelLayout layout = GetCPixelLayout( disp->GetPixelFormat() );
+			ZywrleFormat zf( disp->GetPixelFormat() );
+			PIXEL tile[ZRLE_TILE_SIZE * ZRLE_TILE_SIZE];
+			PIXEL palette[128];
+			int palette_size = 0;
+			for( int i = 0; i < num_tiles; ++i )
+			{
+				FramedTile const& t = tiles[i];
+				Uint32 end = i + 1 < num_tiles ? tiles[i + 1].offset : bytes.length;
+				Wire::MemorySource src( bytes.data + t.offset, end - t.offset );
+				DrawTile< PIXEL, SWAP >( src, layout, zf, *disp, t.x, t.y, t.w, t.h, tile, palette, palette_size, zywrle, zywrle_level );
+			}
+		}
+	};
+
+	//! Decodes a ZRLE rectangle, handing the tiles to workers if that is worth it.
+	/*!
+	  The network thread inflates the data and frames tiles into batches,
+	  which workers decode and draw while it carries on with the next ones.
+	  \param zr decompressed ZRLE data
+	  \param rect rectangle to decode
+	  \param disp display to write to
+	  \param in scratch memory and threads
+	  \param zywrle coefficient storage for ZYWRLE, or NULL
+	  \param zywrle_level ZYWRLE wavelet levels, or 0 for plain ZRLE
+	*/
+	template< typename PIXEL, bool SWAP >
+	static void DecodeZlibTiles( ZlibReader& zr, ScreenRect const& rect, Display& disp, DecoderInput& in,
+								 ZywrleTile* zywrle = NULL, int zywrle_level = 0 )
+	{
+		int num_tiles = ( ( rect.w + ZRLE_TILE_SIZE - 1 ) / ZRLE_TILE_SIZE ) * ( ( rect.h + ZRLE_TILE_SIZE - 1 ) / ZRLE_TILE_SIZE );
+		if( in.pool == NULL || in.pool->GetNumWorkers() == 0 || num_tiles < ZRLE_PIPELINE_MIN_TILES )
+		{
+			DecodeTiles< PIXEL, SWAP >( zr, rect, disp, ZRLE_TILE_SIZE, zywrle, zywrle_level );
+			return;
+		}
+
+		// small enough batches that every worker gets a couple
+		int batch_tiles = num_tiles / ( 2 * in.pool->GetNumWorkers() );
+		if( batch_tiles < 1 )
+			batch_tiles = 1;
+		if( batch_tiles > ZRLE_BATCH_TILES )
+			batch_tiles = ZRLE_BATCH_TILES;
+
+		TileFramer framer( zr, in.scratch, GetCPixelLayout( disp.GetPixelFormat() ), zywrle_level > 0 );
+		TileBatch< PIXEL, SWAP > batches[ZRLE_PIPELINE_BATCHES];
+		int used = 0;
+		try
+		{
+			TileBatch< PIXEL, SWAP >* batch = NULL;
+			for( int tile_y = 0; tile_y < rect.h; tile_y += ZRLE_TILE_SIZE )
+			{
+				int th = (rect.h - tile_y) < ZRLE_TILE_SIZE ? (rect.h - tile_y) : ZRLE_TILE_SIZE;
+				for( int tile_x = 0; tile_x < rect.w; tile_x += ZRLE_TILE_SIZE )
+				{
+					int tw = (rect.w - tile_x) < ZRLE_TILE_SIZE ? (rect.w - tile_x) : ZRLE_TILE_SIZE;
+					if( batch == NULL )
+					{
+						// once every batch is handed out, wait for all of them to be free again
+						if( used == ZRLE_PIPELINE_BATCHES )
+						{
+							in.pool->Wait();
+							used = 0;
+						}
+						batch = &batches[used++];
+						batch->disp = &disp;
+						batch->zywrle_level = zywrle_level;
+						batch->bytes.length = 0;
+						batch->num_tiles = 0;
+					}
+
+					FramedTile& t = batch->tiles[batch->num_tiles++];
+					t.x = rect.x + tile_x;
+					t.y = rect.y + tile_y;
+					t.w = tw;
+					t.h = th;
+					t.offset = framer.Frame( batch->bytes, tw, th );
+					if( batch->num_tiles == batch_tiles )
+					{
+						in.pool->Submit( *batch );
+						batch = NULL;
+					}
+				}
+			}
+			if( batch != NULL )
+				in.pool->Submit( *batch );
+			in.pool->Wait();
+		}
+		catch( ... )
+		{
+			// workers may still be reading the batches
+			try
+			{
+				in.pool->Wait();
+			}
+			catch( ... )
+			{
+			}
+			throw;
+		}
+	}
+
 	DEFINE_VNC_DECODER( ZRLE )
+	{
+		// inflate the compressed data as it arrives
+		Uint32 compressed_length = Wire::ReceiveValue< Uint32 >( in.net );
+		m_zlib_reader.SetStream( in.net, compressed_length );
+
+		// pixels are copied as they arrive, so only their size matters
+		disp.BeginDrawing();
+		switch( disp.GetPixelFormat().bytes )
+		{
+		case 1:  DecodeZlibTiles< Uint8, false >( m_zlib_reader, rect, disp, in );  break;
+		case 2:  DecodeZlibTiles< Uint16, false >( m_zlib_reader, rect, disp, in ); break;
+		case 4:  DecodeZlibTiles< Uint32, false >( m_zlib_reader, rect, disp, in ); break;
+		default: throw Exc( "invalid color depth for ZRLE decoder" );
+		}
+		m_zlib_reader.Finish();
+		disp.EndDrawing( rect );
+	}
+
+	DEFINE_VNC_DECODER( TRLE )
+	{
+		Wire::NetSource src( in.net );
+		disp.BeginDrawing();
+		switch( disp.GetPixelFormat().bytes )
+		{
+		case 1:  DecodeTiles< Uint8, false >( src, rect, disp, TRLE_TILE_SIZE );  break;
+		case 2:  DecodeTiles< Uint16, false >( src, rect, disp, TRLE_TILE_SIZE ); break;
+		case 4:  DecodeTiles< Uint32, false >( src, rect, disp, TRLE_TILE_SIZE ); break;
+		default: throw Exc( "invalid color depth for TRLE decoder" );
+		}
+		disp.EndDrawing( rect );
+	}
+
+	DecoderZYWRLE::DecoderZYWRLE( NetworkClient& net )
+		: Decoder( net ),
+		  m_quality_level( -1 )
+	{
+	}
+
+	void DecoderZYWRLE::GetPseudoEncodings( vector< Uint32 >& encodings ) const
+	{
+		if( m_quality_level >= 0 )
+			encodings.push_back( RFB_ENCODING_QUALITY_LEVEL_0 + m_quality_level );
+	}
+
+	void DecoderZYWRLE::operator() ( ScreenRect const& rect, Display& disp )
 	{
 		++m_processed;
+		DecoderInput in = { m_net, *m_scratch, m_pool };
+		Decode( rect, disp, in );
+	}
+
+	void DecoderZYWRLE::Decode( ScreenRect const& rect, Display& disp, DecoderInput& in )
+	{
+		// the server picks the transform depth from the quality level we asked for
+		int level = m_quality_level < 0 ? 1 : m_quality_level < 3 ? 3 : m_quality_level < 6 ? 2 : 1;
 
-		// read the length of the compressed data
-		//! \todo sanity check this length
-		NET_UINT32( compressed_length );
+		// inflate the compressed data as it arrives
+		Uint32 compressed_length = Wire::ReceiveValue< Uint32 >( in.net );
+		m_zlib_reader.SetStream( in.net, compressed_length );
 
-		// receive the data and hand it to the decoder
-		Uint8* compressed_buf = new Uint8[compressed_length];
-		m_net.ReceiveBytes( compressed_buf, compressed_length );
-		m_zlib_reader.SetStream( compressed_buf, compressed_length );
+		ZywrleTile zywrle;
+		disp.BeginDrawing();
+		switch( GetPixelKernel( disp.GetPixelFormat() ) )
+		{
+		// there is no wavelet at 8 bits per pixel; it is plain ZRLE
+		case PIXEL_KERNEL_8:          DecodeZlibTiles< Uint8, false >( m_zlib_reader, rect, disp, in );                   break;
+		case PIXEL_KERNEL_16:         DecodeZlibTiles< Uint16, false >( m_zlib_reader, rect, disp, in, &zywrle, level );  break;
+		case PIXEL_KERNEL_16_SWAPPED: DecodeZlibTiles< Uint16, true >( m_zlib_reader, rect, disp, in, &zywrle, level );   break;
+		case PIXEL_KERNEL_32:         DecodeZlibTiles< Uint32, false >( m_zlib_reader, rect, disp, in, &zywrle, level );  break;
+		case PIXEL_KERNEL_32_SWAPPED: DecodeZlibTiles< Uint32, true >( m_zlib_reader, rect, disp, in, &zywrle, level );   break;
+		}
+		m_zlib_reader.Finish();
+		disp.EndDrawing( rect );
+	}
 
-		ZIP_UINT8( subencoding );
-		cerr << "Subencoding: " << (int)subencoding << endl;
-		
-		delete compressed_buf;		
+	bool DecoderZRLE::Frame( ScreenRect const& /* rect */, Display& /* disp */, Wire::Recorder& data )
+	{
+		++m_processed;
+		data.Skip( Wire::ReceiveValue< Uint32 >( data ) );
+		return true;
 	}
 
+	bool DecoderZYWRLE::Frame( ScreenRect const& /* rect */, Display& /* disp */, Wire::Recorder& data )
+	{
+		++m_processed;
+		data.Skip( Wire::ReceiveValue< Uint32 >( data ) );
+		return true;
+	}
 };
@@ -14,12 +14,18 @@
 
 using namespace std;
 
+// Size of the receive buffer. Reads at least this large bypass it.
+#define NET_RECEIVE_BUFFER_SIZE  (16 * 1024)
+
 namespace VNC
 {
 
 	SDLNetworkClient::SDLNetworkClient( std::string host, Uint16 port )
 		: m_socket( NULL ),
-		  m_mutex( NULL )
+		  m_mutex( NULL ),
+		  m_rbuf( NET_RECEIVE_BUFFER_SIZE ),
+		  m_rbuf_pos( 0 ),
+		  m_rbuf_len( 0 )
 	{
 		IPaddress addr;
 
@@ -51,25 +57,57 @@ namespace VNC
 	
 	void SDLNetworkClient::ReceiveBytes( Uint8* data, unsigned int count )
 	{
-		int received = 0;
-		
-		while( received < (int)count )
+		while( count > 0 )
+		{
+			unsigned int amt = ReceiveSome( data, count );
+			data += amt;
+			count -= amt;
+		}
+	}
+
+	unsigned int SDLNetworkClient::ReceiveSome( Uint8* data, unsigned int count )
+	{
+		if( m_rbuf_pos == m_rbuf_len )
 		{
-			int amt = SDLNet_TCP_Recv( m_socket, data, (int)count-received );
-			if( amt <= 0 )
+			// big reads go straight into the caller's memory; a single recv
+			// returns whatever has arrived
+			if( count >= m_rbuf.size() )
 			{
-				throw ExcRead();
+				int amt = SDLNet_TCP_Recv( m_socket, data, (int)count );
+				if( amt <= 0 )
+					throw ExcRead();
+				return amt;
 			}
-			received += amt;
-			data += amt;
+			FillBuffer();
 		}
+
+		// hand out what we have
+		unsigned int amt = m_rbuf_len - m_rbuf_pos;
+		if( amt > count )
+			amt = count;
+		memcpy( data, &m_rbuf[m_rbuf_pos], amt );
+		m_rbuf_pos += amt;
+		return amt;
+	}
+
+	void SDLNetworkClient::FillBuffer()
+	{
+		int amt = SDLNet_TCP_Recv( m_socket, &m_rbuf[0], (int)m_rbuf.size() );
+		if( amt <= 0 )
+			throw ExcRead();
+		m_rbuf_pos = 0;
+		m_rbuf_len = amt;
 	}
 
 	bool SDLNetworkClient::WaitDataReady( Uint32 ms )
 	{
+		if( m_rbuf_pos < m_rbuf_len )
+			return true;
+
 		SDLNet_SocketSet ss = SDLNet_AllocSocketSet( 1 );
 		SDLNet_TCP_AddSocket( ss, m_socket );
 		int result = SDLNet_CheckSockets( ss, ms );
+		SDLNet_FreeSocketSet( ss );
 		if( result <  0 )
 			throw ExcSelect();
 		if( result == 0 )
@@ -0,0 +1,312 @@
+/*!
+  \file vnc-net-tls.cc
+  \brief OpenSSL implementation of the TLS network client decorator.
+*/
+
+#include <string>
+#include <string.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+#include "vnc-tls.h"
+
+using namespace std;
+
+// Size of the decrypted receive buffer. Several full TLS records fit in it,
+// and reads at least this large bypass it entirely.
+#define TLS_RECEIVE_BUFFER_SIZE  (64 * 1024)
+
+namespace VNC
+{
+
+	TLSNetworkClient::TLSNetworkClient( NetworkClient& net, std::string const& host, std::string const& ca_file, bool allow_anonymous )
+		: m_net( net ),
+		  m_host( host ),
+		  m_ca_file( ca_file ),
+		  m_allow_anonymous( allow_anonymous ),
+		  m_ctx( NULL ),
+		  m_ssl( NULL ),
+		  m_bio_method( NULL ),
+		  m_rbuf( TLS_RECEIVE_BUFFER_SIZE ),
+		  m_rbuf_pos( 0 ),
+		  m_rbuf_len( 0 ),
+		  m_packet_depth( 0 )
+	{
+	}
+
+	TLSNetworkClient::~TLSNetworkClient()
+	{
+		if( m_ssl != NULL )
+		{
+			m_net.BeginWritePacket();
+			SSL_shutdown( m_ssl );
+			m_net.EndWritePacket();
+			SSL_free( m_ssl );
+		}
+		if( m_ctx != NULL )
+			SSL_CTX_free( m_ctx );
+		if( m_bio_method != NULL )
+			BIO_meth_free( m_bio_method );
+	}
+
+	void TLSNetworkClient::ThrowError( char const* what )
+	{
+		string msg = what;
+		unsigned long err = ERR_get_error();
+		if( err != 0 )
+		{
+			char buf[256];
+			ERR_error_string_n( err, buf, sizeof( buf ) );
+			msg = msg + ": " + buf;
+		}
+		ERR_clear_error();
+		throw Exc( msg );
+	}
+
+	void TLSNetworkClient::StartTLS( bool anonymous )
+	{
+		if( anonymous && !m_allow_anonymous )
+			throw Exc( "anonymous TLS was not allowed" );
+		m_ctx = SSL_CTX_new( TLS_client_method() );
+		if( m_ctx == NULL )
+			throw ExcTLSInit();
+		SSL_CTX_set_min_proto_version( m_ctx, TLS1_2_VERSION );
+		if( anonymous )
+		{
+			// anonymous DH only exists up to TLS 1.2, and needs security level 0
+			SSL_CTX_set_max_proto_version( m_ctx, TLS1_2_VERSION );
+			if( !SSL_CTX_set_cipher_list( m_ctx, "aNULL:!eNULL:@SECLEVEL=0" ) )
+				ThrowError( "no anonymous TLS ciphers available" );
+		}
+		else
+		{
+			int ok = m_ca_file.empty() ? SSL_CTX_set_default_verify_paths( m_ctx )
+				: SSL_CTX_load_verify_locations( m_ctx, m_ca_file.c_str(), NULL );
+			if( !ok )
+				ThrowError( "unable to load trusted certificates" );
+			SSL_CTX_set_verify( m_ctx, SSL_VERIFY_PEER, NULL );
+		}
+
+		// ciphertext goes through the wrapped connection
+		m_bio_method = BIO_meth_new( BIO_TYPE_SOURCE_SINK | BIO_get_new_index(), "vnc network client" );
+		if( m_bio_method == NULL )
+			throw ExcTLSInit();
+		BIO_meth_set_write( m_bio_method, BioWrite );
+		BIO_meth_set_read( m_bio_method, BioRead );
+		BIO_meth_set_ctrl( m_bio_method, BioCtrl );
+		BIO* bio = BIO_new( m_bio_method );
+		if( bio == NULL )
+			throw ExcTLSInit();
+		BIO_set_data( bio, this );
+		BIO_set_init( bio, 1 );
+
+		m_ssl = SSL_new( m_ctx );
+		if( m_ssl == NULL )
+		{
+			BIO_free( bio );
+			throw ExcTLSInit();
+		}
+		SSL_set_bio( m_ssl, bio, bio );
+		if( !anonymous )
+		{
+			// an address is checked against the certificate's IP addresses,
+			// and isn't sent as a server name; anything else is a host name
+			if( !X509_VERIFY_PARAM_set1_ip_asc( SSL_get0_param( m_ssl ), m_host.c_str() ) )
+			{
+				SSL_set_tlsext_host_name( m_ssl, m_host.c_str() );
+				SSL_set1_host( m_ssl, m_host.c_str() );
+			}
+		}
+
+		// the handshake runs under the connection lock, like all SSL calls,
+		// and waits for the network with the lock released
+		for( ;; )
+		{
+			m_net.BeginWritePacket();
+			int result = SSL_connect( m_ssl );
+			int err = SSL_get_error( m_ssl, result );
+			m_net.EndWritePacket();
+			if( result == 1 )
+				break;
+			if( err == SSL_ERROR_WANT_READ )
+				m_net.WaitDataReady( 100 );
+			else if( err != SSL_ERROR_WANT_WRITE )
+				ThrowError( "TLS handshake failed" );
+		}
+	}
+
+	void TLSNetworkClient::BeginWritePacket()
+	{
+		m_net.BeginWritePacket();
+		++m_packet_depth;
+	}
+
+	void TLSNetworkClient::EndWritePacket()
+	{
+		// the whole packet goes out as one record
+		if( --m_packet_depth == 0 && !m_wbuf.empty() )
+		{
+			WriteEncrypted( &m_wbuf[0], m_wbuf.size() );
+			m_wbuf.clear();
+		}
+		m_net.EndWritePacket();
+	}
+
+	void TLSNetworkClient::SendBytes( Uint8 const* data, unsigned int count )
+	{
+		if( m_ssl == NULL )
+			m_net.SendBytes( data, count );
+		else if( m_packet_depth > 0 )
+			m_wbuf.insert( m_wbuf.end(), data, data + count );
+		else
+		{
+			m_net.BeginWritePacket();
+			WriteEncrypted( data, count );
+			m_net.EndWritePacket();
+		}
+	}
+
+	void TLSNetworkClient::WriteEncrypted( Uint8 const* data, unsigned int count )
+	{
+		// caller holds the connection lock
+		while( count > 0 )
+		{
+			int amt = SSL_write( m_ssl, data, (int)count );
+			if( amt > 0 )
+			{
+				data += amt;
+				count -= amt;
+				continue;
+			}
+			int err = SSL_get_error( m_ssl, amt );
+			if( err == SSL_ERROR_WANT_READ )
+				m_net.WaitDataReady( 100 );
+			else if( err != SSL_ERROR_WANT_WRITE )
+				throw ExcWrite();
+		}
+	}
+
+	void TLSNetworkClient::ReceiveBytes( Uint8* data, unsigned int count )
+	{
+		if( m_ssl == NULL )
+		{
+			m_net.ReceiveBytes( data, count );
+			return;
+		}
+
+		while( count > 0 )
+		{
+			// hand out what we already have
+			if( m_rbuf_pos < m_rbuf_len )
+			{
+				unsigned int amt = m_rbuf_len - m_rbuf_pos;
+				if( amt > count )
+					amt = count;
+				memcpy( data, &m_rbuf[m_rbuf_pos], amt );
+				m_rbuf_pos += amt;
+				data += amt;
+				count -= amt;
+			}
+			else if( count >= m_rbuf.size() )
+			{
+				// big reads are decrypted straight into the caller's memory
+				unsigned int amt = ReadDecrypted( data, count );
+				data += amt;
+				count -= amt;
+			}
+			else
+			{
+				m_rbuf_pos = 0;
+				m_rbuf_len = ReadDecrypted( &m_rbuf[0], m_rbuf.size() );
+			}
+		}
+	}
+
+	unsigned int TLSNetworkClient::ReadDecrypted( Uint8* data, unsigned int count )
+	{
+		unsigned int received = 0;
+		while( received < count )
+		{
+			m_net.BeginWritePacket();
+			int amt = SSL_read( m_ssl, data + received, (int)(count - received) );
+			int err = SSL_get_error( m_ssl, amt );
+			m_net.EndWritePacket();
+
+			if( amt > 0 )
+			{
+				received += amt;
+				continue;
+			}
+			if( err == SSL_ERROR_WANT_READ )
+			{
+				// stop at the first record that isn't here yet, unless we have nothing
+				if( received > 0 )
+					break;
+				m_net.WaitDataReady( 100 );
+			}
+			else if( err != SSL_ERROR_WANT_WRITE )
+				throw ExcRead();
+		}
+		return received;
+	}
+
+	bool TLSNetworkClient::WaitDataReady( Uint32 ms )
+	{
+		if( m_ssl != NULL )
+		{
+			if( m_rbuf_pos < m_rbuf_len )
+				return true;
+			m_net.BeginWritePacket();
+			int pending = SSL_pending( m_ssl );
+			m_net.EndWritePacket();
+			if( pending > 0 )
+				return true;
+		}
+		return m_net.WaitDataReady( ms );
+	}
+
+	int TLSNetworkClient::BioWrite( BIO* bio, char const* data, int count )
+	{
+		TLSNetworkClient* self = (TLSNetworkClient*)BIO_get_data( bio );
+		BIO_clear_retry_flags( bio );
+		try
+		{
+			self->m_net.SendBytes( (Uint8 const*)data, count );
+		}
+		catch( Exc const& )
+		{
+			return -1;
+		}
+		return count;
+	}
+
+	int TLSNetworkClient::BioRead( BIO* bio, char* data, int count )
+	{
+		// called with the connection lock held, so never wait for the
+		// network: hand over what has arrived, and have OpenSSL retry for
+		// the rest of the record once the lock is released
+		TLSNetworkClient* self = (TLSNetworkClient*)BIO_get_data( bio );
+		BIO_clear_retry_flags( bio );
+		if( count <= 0 )
+			return 0;
+		try
+		{
+			if( !self->m_net.WaitDataReady( 0 ) )
+			{
+				BIO_set_retry_read( bio );
+				return -1;
+			}
+			return (int)self->m_net.ReceiveSome( (Uint8*)data, count );
+		}
+		catch( Exc const& )
+		{
+			return -1;
+		}
+	}
+
+	long TLSNetworkClient::BioCtrl( BIO*, int cmd, long, void* )
+	{
+		return cmd == BIO_CTRL_FLUSH ? 1 : 0;
+	}
+
+};
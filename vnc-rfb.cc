@@ -5,10 +5,13 @@
 */
 
 #include "vnc.h"
+#include "vnc-wire.h"
 #include <stdio.h>
 #include <string>
+#include <algorithm>
 #include <iostream>
 #include <cstdlib>
+#include <sys/time.h>
 
 extern "C" {
 #include "d3des.h"
@@ -17,26 +20,10 @@ extern "C" {
 using namespace std;
 
 // Some macros to make life easier (and the code cleaner).
-#define GET_UINT32( var ) m_net.ReceiveBytes( (Uint8*)&var, 4 ); var = VNC_SWAP_BE_32( var );
-#define NET_UINT32( var ) Uint32 var; GET_UINT32( var );
-
-#define GET_UINT16( var ) m_net.ReceiveBytes( (Uint8*)&var, 2 ); var = VNC_SWAP_BE_16( var );
-#define NET_UINT16( var ) Uint16 var; GET_UINT16( var );
-
-#define NET_UINT8( var ) Uint8 var; m_net.ReceiveBytes( &var, 1 );
-
-#define NET_STRING( var, limit ) string var; { NET_UINT32(_v); if( _v > limit ) throw Exc( "received unreasonably long string" ); char* _tmp = new char[_v + 1]; m_net.ReceiveBytes( (Uint8*)_tmp, _v ); _tmp[_v] = '\0'; var = _tmp; delete _tmp; }
 #define SEND_UINT8( val )  { Uint8 _t = val; m_net.SendBytes( (Uint8 const*)&_t, 1 ); }
 #define SEND_UINT16( val ) { Uint16 _t = val; _t = VNC_SWAP_BE_16( _t ); m_net.SendBytes( (Uint8 const*)&_t, 2 ); }
 #define SEND_UINT32( val ) { Uint32 _t = val; _t = VNC_SWAP_BE_32( _t ); m_net.SendBytes( (Uint8 const*)&_t, 4 ); }
 
-// #define GET_UINT32( var ) m_net.ReceiveBytes( (Uint8*)&var, 4 ); var = VNC_SWAP_BE_32( var );
-// #define NET_UINT32( var ) cerr << #var << " (uint32)" << endl; Uint32 var; GET_UINT32( var ); cerr << "--> " << var << endl;
-// #define GET_UINT16( var ) m_net.ReceiveBytes( (Uint8*)&var, 2 ); var = VNC_SWAP_BE_16( var );
-// #define NET_UINT16( var ) cerr << #var << " (uint16)" << endl; Uint16 var; GET_UINT16( var ); cerr << "--> " << var << endl;
-// #define NET_UINT8( var ) cerr << #var << " (uint8)" << endl; Uint8 var; m_net.ReceiveBytes( &var, 1 );  cerr << "--> " << (int)var << endl;
-
-
 // Client -> server message types
 #define RFB_CLIENT_SETPIXELFORMAT        0
 #define RFB_CLIENT_FIXCOLORMAPENTRIES    1
@@ -52,10 +39,153 @@ using namespace std;
 #define RFB_SERVER_BELL                  2
 #define RFB_SERVER_CUTTEXT               3
 
+// Framed data an update queues before the lanes are run to free it
+#define RFB_FRAMED_DATA_CAP              ( 4 * 1024 * 1024 )
+
+// Side of the squares queued framed rectangles are found by
+#define RFB_FRAMED_CELL_SIZE             64
+
 
 namespace VNC
 {
 
+	//! Receives the body of a string whose length has already been read.
+	/*!
+	  \param net connection to read from
+	  \param length length of the string
+	  \param limit longest string we are willing to accept
+	  \returns the string
+	*/
+	static string ReceiveChars( NetworkClient& net, Uint32 length, Uint32 limit )
+	{
+		if( length > limit )
+			throw Exc( "received unreasonably long string" );
+		string str( length, '\0' );
+		if( length > 0 )
+			net.ReceiveBytes( (Uint8*)&str[0], length );
+		return str;
+	}
+
+	//! Receives bytes that aren't wanted, a buffer at a time.
+	/*!
+	  \param net connection to read from
+	  \param count number of bytes to throw away
+	*/
+	static void SkipBytes( NetworkClient& net, Uint32 count )
+	{
+		Uint8 buf[4096];
+		while( count > 0 )
+		{
+			Uint32 amt = count < sizeof( buf ) ? count : sizeof( buf );
+			net.ReceiveBytes( buf, amt );
+			count -= amt;
+		}
+	}
+
+	//! Receives a length-prefixed string.
+	/*!
+	  \param net connection to read from
+	  \param limit longest string we are willing to accept
+	  \returns the string
+	*/
+	static string ReceiveString( NetworkClient& net, Uint32 limit )
+	{
+		return ReceiveChars( net, Wire::ReceiveValue< Uint32 >( net ), limit );
+	}
+
+	//! Current time in seconds.
+	static double Now()
+	{
+		timeval tv;
+		gettimeofday( &tv, NULL );
+		return tv.tv_sec + tv.tv_usec / 1e6;
+	}
+
+	//! Returns true if two rectangles share any pixels.
+	static bool Overlaps( ScreenRect const& a, ScreenRect const& b )
+	{
+		return a.w > 0 && a.h > 0 && b.w > 0 && b.h > 0 &&
+			a.x < b.x + b.w && b.x < a.x + a.w && a.y < b.y + b.h && b.y < a.y + a.h;
+	}
+
+	//! A received rectangle, waiting to be decoded.
+	struct RFBProto::FramedRect
+	{
+		ScreenRect rect;      //!< where it goes
+		ScreenRect source;    //!< where a CopyRect reads from; empty for anything else
+		Decoder* decoder;     //!< decoder that framed it
+		size_t offset;        //!< where its data starts in m_framed_data
+		Uint32 length;        //!< bytes of data
+	};
+
+	//! Returns true if one framed rectangle has to be decoded after the other.
+	static bool DependsOn( RFBProto::FramedRect const& a, RFBProto::FramedRect const& b )
+	{
+		return Overlaps( a.rect, b.rect ) || Overlaps( a.source, b.rect ) || Overlaps( a.rect, b.source );
+	}
+
+	//! Decodes one lane's framed rectangles in order, on a worker thread.
+	/*!
+	  Lanes and their scratch memory are kept from one update to the next.
+	*/
+	class RFBProto::FramedLane : public Job
+	{
+	public:
+		FramedLane() : decoder( NULL ), load( 0 ), data( NULL ), disp( NULL ), pool( NULL ), busy( 0 ) {}
+
+		virtual void Run()
+		{
+			double start = Now();
+			scratch.Reset();
+			for( unsigned i = 0; i < rects.size(); ++i )
+			{
+				FramedRect const& r = rects[i];
+				Wire::MemoryClient src( data + r.offset, r.length );
+				DecoderInput in = { src, scratch, pool };
+				r.decoder->DecodeFramed( r.rect, *disp, in );
+				if( src.GetRemaining() != 0 )
+					throw Exc( "decoder left part of a framed rectangle unread" );
+			}
+			busy = Now() - start;
+		}
+
+		Decoder* decoder;             //!< sequential decoder whose rectangles are in this lane, or NULL
+		unsigned long load;           //!< pixels queued
+		Uint8 const* data;            //!< the update's framed data
+		Display* disp;                //!< display to draw on
+		WorkerPool* pool;             //!< threads the decoders can use, when the lane is the only one; otherwise NULL
+		vector< FramedRect > rects;   //!< rectangles in update order
+		ScratchArena scratch;         //!< the worker's scratch memory
+		double busy;                  //!< seconds the lane took to decode
+	};
+
+	//! Passes drawing from the workers through to the real display.
+	/*!
+	  The network thread begins and ends drawing around the whole batch, so
+	  the decoders' own calls to do that are ignored.
+	*/
+	class FramedDisplay : public Display
+	{
+	public:
+		FramedDisplay( RFBProto& rfb, Display& target ) : Display( rfb ), m_target( target ) { m_format = target.GetPixelFormat(); }
+
+		virtual void BeginDrawing() {}
+		virtual void EndDrawing( ScreenRect const& /* rect */ ) {}
+		virtual void WritePixels( int x, int y, int count, Uint8* data ) { m_target.WritePixels( x, y, count, data ); }
+		virtual void WriteUniformPixels( int x, int y, int count, Uint32 pixel ) { m_target.WriteUniformPixels( x, y, count, pixel ); }
+		virtual void CopyPixels( int sx, int sy, int dx, int dy, int w, int h ) { m_target.CopyPixels( sx, sy, dx, dy, w, h ); }
+		virtual Uint8* GetDirectRow( int x, int y ) { return m_target.GetDirectRow( x, y ); }
+		virtual void WriteRect( ScreenRect const& rect, Uint8 const* data, int pitch ) { m_target.WriteRect( rect, data, pitch ); }
+		virtual void FillRect( ScreenRect const& rect, Uint32 pixel ) { m_target.FillRect( rect, pixel ); }
+		virtual void FillRects( SolidRect const* rects, int count ) { m_target.FillRects( rects, count ); }
+
+	protected:
+		virtual bool UpdateInput() { return true; }
+
+	private:
+		Display& m_target;
+	};
+
 	RFBProto::RFBProto( NetworkClient& net, std::string const& password, bool shared, std::vector< Decoder* > decoders )
 		: m_shared( shared ),
 		  m_net( net ),
@@ -65,10 +195,20 @@ namespace VNC
 		  m_desktop_width( -1 ),
 		  m_desktop_height( -1 ),
 		  m_desktop_name( "not connected" ),
-		  m_decoders_vec( decoders )
+		  m_decoders_vec( decoders ),
+		  m_pool( NULL ),
+		  m_report_updates( false ),
+		  m_num_lanes( 0 ),
+		  m_cell_columns( 0 ),
+		  m_cell_rows( 0 ),
+		  m_framed_wall( 0 ),
+		  m_framed_busy( 0 )
 	{
 		for( unsigned i = 0; i < decoders.size(); ++i )
+		{
 			m_decoders[ decoders[i]->GetType() ] = decoders[i];
+			decoders[i]->SetScratchArena( &m_scratch );
+		}
 		
 		DoVersionHandshake();
 		DoAuthHandshake();
@@ -79,6 +219,8 @@ namespace VNC
 	RFBProto::~RFBProto()
 	{
 		// disconnect
+		for( unsigned i = 0; i < m_lanes.size(); ++i )
+			delete m_lanes[i];
 	}
 
 	void RFBProto::DoVersionHandshake()
@@ -107,24 +249,60 @@ namespace VNC
 
 		// send our version
 		// for now, we always override the server's version
-		// and specify version 3.3.
+		// and specify version 3.3, unless we need VeNCrypt;
+		// security type negotiation only exists from 3.7 on.
+		if( m_net.CanStartTLS() )
+		{
+			if( m_rfb_minor_version < 7 )
+				throw ExcNoEncryption();
+			m_rfb_minor_version = m_rfb_minor_version >= 8 ? 8 : 7;
+		}
+		else
+		{
+			m_rfb_minor_version = 3;
+		}
 		m_rfb_major_version = 3;
-		m_rfb_minor_version = 3;
 
-		snprintf( buf, sizeof (buf), "RFB 003.003\n" );
+		snprintf( buf, sizeof (buf), "RFB 003.%03d\n", m_rfb_minor_version );
 		m_net.SendBytes( (Uint8*)buf, 12 );
 	}
 
 	void RFBProto::DoAuthHandshake()
 	{
+		if( m_rfb_minor_version >= 7 )
+		{
+			// 3.7+: the server lists its security types and we pick one
+			Uint8 num_types = Wire::ReceiveValue< Uint8 >( m_net );
+			if( num_types == 0 )
+			{
+				string msg = "RFB handshake failed: ";
+				string reason = ReceiveString( m_net, VNC_STRING_LENGTH_LIMIT );
+				throw Exc( msg + reason );
+			}
+			bool have_vencrypt = false;
+			for( unsigned i = 0; i < num_types; ++i )
+			{
+				Uint8 type = Wire::ReceiveValue< Uint8 >( m_net );
+				if( type == RFB_AUTH_VENCRYPT )
+					have_vencrypt = true;
+			}
+
+			// we only speak 3.7+ to get encryption, so settle for nothing less
+			if( !have_vencrypt )
+				throw ExcNoEncryption();
+			SEND_UINT8( RFB_AUTH_VENCRYPT );
+			DoVeNCryptHandshake();
+			return;
+		}
+
 		// receive server's desired authentication scheme
-		NET_UINT32( scheme );
+		Uint32 scheme = Wire::ReceiveValue< Uint32 >( m_net );
 		switch( scheme )
 		{
 		case RFB_AUTH_FAILED:
 			{
 				string msg = "RFB handshake failed: ";
-				NET_STRING( reason, VNC_STRING_LENGTH_LIMIT );
+				string reason = ReceiveString( m_net, VNC_STRING_LENGTH_LIMIT );
 				throw Exc( msg + reason );
 			}
 		case RFB_AUTH_NONE:
@@ -137,6 +315,60 @@ namespace VNC
 		}
 	}
 
+	void RFBProto::DoVeNCryptHandshake()
+	{
+		// agree on VeNCrypt version 0.2
+		Uint8 major = Wire::ReceiveValue< Uint8 >( m_net );
+		Uint8 minor = Wire::ReceiveValue< Uint8 >( m_net );
+		if( major != 0 || minor < 2 )
+			throw Exc( "unsupported VeNCrypt version" );
+		SEND_UINT8( 0 );
+		SEND_UINT8( 2 );
+		Uint8 version_ack = Wire::ReceiveValue< Uint8 >( m_net );
+		if( version_ack != 0 )
+			throw Exc( "server refused VeNCrypt version 0.2" );
+
+		// pick the strongest subtype we know, verified certificates first;
+		// the anonymous ones only if the connection allows them
+		static Uint32 const preference[] = {
+			RFB_VENCRYPT_X509VNC, RFB_VENCRYPT_X509NONE,
+			RFB_VENCRYPT_TLSVNC, RFB_VENCRYPT_TLSNONE
+		};
+		unsigned const num_preferences = sizeof( preference ) / sizeof( preference[0] );
+		unsigned const num_verified = 2;
+		unsigned num_allowed = m_net.CanStartAnonymousTLS() ? num_preferences : num_verified;
+		unsigned best = num_preferences;
+		Uint8 num_subtypes = Wire::ReceiveValue< Uint8 >( m_net );
+		for( unsigned i = 0; i < num_subtypes; ++i )
+		{
+			Uint32 subtype = Wire::ReceiveValue< Uint32 >( m_net );
+			for( unsigned j = 0; j < best; ++j )
+			{
+				if( preference[j] == subtype )
+					best = j;
+			}
+		}
+		if( best >= num_allowed && best < num_preferences )
+			throw ExcAnonymousTLS();
+		if( best == num_preferences )
+			throw ExcUnknownAuth();
+		Uint32 subtype = preference[best];
+		SEND_UINT32( subtype );
+
+		// the server confirms before the TLS handshake starts
+		Uint8 tls_ack = Wire::ReceiveValue< Uint8 >( m_net );
+		if( tls_ack != 1 )
+			throw Exc( "server refused to start TLS" );
+		bool anonymous = subtype == RFB_VENCRYPT_TLSNONE || subtype == RFB_VENCRYPT_TLSVNC;
+		m_net.StartTLS( anonymous );
+
+		// everything from here on is encrypted
+		if( subtype == RFB_VENCRYPT_X509VNC || subtype == RFB_VENCRYPT_TLSVNC )
+			DoDESChallenge();
+		else if( m_rfb_minor_version >= 8 )
+			ReadSecurityResult();
+	}
+
 	void RFBProto::DoDESChallenge()
 	{
 		// receive challenge
@@ -151,12 +383,24 @@ namespace VNC
 		m_net.SendBytes( response, 16 );
 
 		// see if that worked
-		NET_UINT32( result );
+		ReadSecurityResult();
+	}
+
+	void RFBProto::ReadSecurityResult()
+	{
+		Uint32 result = Wire::ReceiveValue< Uint32 >( m_net );
 		switch( result )
 		{
 		case RFB_AUTH_RESULT_OK:
 			return;
 		case RFB_AUTH_RESULT_FAILED:
+			if( m_rfb_minor_version >= 8 )
+			{
+				// 3.8 tells us why
+				string msg = "authentication failed: ";
+				string reason = ReceiveString( m_net, VNC_STRING_LENGTH_LIMIT );
+				throw Exc( msg + reason );
+			}
 			throw ExcAuthFailed();
 		case RFB_AUTH_RESULT_TOOMANY:
 			throw ExcAuthTooMany();
@@ -193,40 +437,26 @@ namespace VNC
 		m_net.SendBytes( &shared_flag, 1 );
 
 		// server -> client init handshake
-		NET_UINT16( fb_width );
-		NET_UINT16( fb_height );
-
-		NET_UINT8( bits_per_pixel );
-		NET_UINT8( color_depth );
-		NET_UINT8( big_endian_flag );
-		NET_UINT8( true_color_flag );
-		NET_UINT16( red_max );
-		NET_UINT16( green_max );
-		NET_UINT16( blue_max );
-		NET_UINT8( red_shift );
-		NET_UINT8( green_shift );
-		NET_UINT8( blue_shift );
-
-		char padding[3]; m_net.ReceiveBytes( (Uint8*)padding, 3 );
-
-		NET_STRING( desktop_name, VNC_STRING_LENGTH_LIMIT );
-		m_desktop_name = desktop_name;
+		Wire::ServerInit init;
+		Wire::Receive( m_net, init );
+		m_desktop_name = ReceiveChars( m_net, init.name_length, VNC_STRING_LENGTH_LIMIT );
 
 		// set dimensions
-		m_desktop_width = fb_width;
-		m_desktop_height = fb_height;
+		m_desktop_width = init.width;
+		m_desktop_height = init.height;
 		
 		// set pixel format structure
-		m_pixel_format.bytes = bits_per_pixel / 8;
+		m_pixel_format.bytes = init.bits_per_pixel / 8;
 		if( m_pixel_format.bytes < 1 ) throw ExcBadFormat();
-		m_pixel_format.bits = color_depth;
-		m_pixel_format.red_mask = red_max;
-		m_pixel_format.green_mask = green_max;
-		m_pixel_format.blue_mask = blue_max;
-		m_pixel_format.red_shift = red_shift;
-		m_pixel_format.green_shift = green_shift;
-		m_pixel_format.blue_shift = blue_shift;
-		m_pixel_format.big_endian = big_endian_flag ? true : false;
+		m_pixel_format.bits = init.depth;
+		m_pixel_format.red_mask = init.red_max;
+		m_pixel_format.green_mask = init.green_max;
+		m_pixel_format.blue_mask = init.blue_max;
+		m_pixel_format.red_shift = init.red_shift;
+		m_pixel_format.green_shift = init.green_shift;
+		m_pixel_format.blue_shift = init.blue_shift;
+		m_pixel_format.big_endian = init.big_endian ? true : false;
+		m_pixel_format.true_color = init.true_color ? true : false;
 	}
 
 	void RFBProto::SendPixelFormat( PixelFormat const& format )
@@ -252,47 +482,93 @@ namespace VNC
 
 	void RFBProto::DoSupportedEncodings()
 	{
+		// real encodings in order of preference, then settings
+		vector< Uint32 > encodings;
+		for( unsigned i = 0; i < m_decoders_vec.size(); ++i )
+			encodings.push_back( m_decoders_vec[i]->GetType() );
+		vector< Uint32 > pseudo;
+		for( unsigned i = 0; i < m_decoders_vec.size(); ++i )
+			m_decoders_vec[i]->GetPseudoEncodings( pseudo );
+		for( unsigned i = 0; i < pseudo.size(); ++i )
+		{
+			// decoders may share a setting, such as the quality level
+			if( find( encodings.begin(), encodings.end(), pseudo[i] ) == encodings.end() )
+				encodings.push_back( pseudo[i] );
+		}
+
 		m_net.BeginWritePacket();
 		SEND_UINT8( RFB_CLIENT_SETENCODINGS );
 		SEND_UINT8( 0 );   // padding
 
- 		SEND_UINT16( m_decoders_vec.size() );
-		for( unsigned i = 0; i < m_decoders_vec.size(); ++i )
+ 		SEND_UINT16( encodings.size() );
+		for( unsigned i = 0; i < encodings.size(); ++i )
  		{
- 			SEND_UINT32( m_decoders_vec[i]->GetType() );
+ 			SEND_UINT32( encodings[i] );
  		}
 		
 		m_net.EndWritePacket();
 	}
 	
+	void RFBProto::SetParallelUpdates( WorkerPool* pool, bool report )
+	{
+		m_pool = pool;
+		m_report_updates = report;
+		m_cell_columns = ( m_desktop_width + RFB_FRAMED_CELL_SIZE - 1 ) / RFB_FRAMED_CELL_SIZE;
+		m_cell_rows = ( m_desktop_height + RFB_FRAMED_CELL_SIZE - 1 ) / RFB_FRAMED_CELL_SIZE;
+		m_framed_cells.assign( m_cell_columns * m_cell_rows, vector< Uint32 >() );
+		m_touched_cells.clear();
+	}
+
 	void RFBProto::SetDisplay( Display* display )
 	{		
 		m_display = display;
+
+		// a display that keeps the server's layout needs no message; the
+		// server carries on sending what it would anyway
+		if( !SamePixelLayout( m_pixel_format, display->GetPixelFormat() ) )
+			SendPixelFormat( display->GetPixelFormat() );
 		m_pixel_format = display->GetPixelFormat();
-		SendPixelFormat( m_pixel_format );
 	}
 	
 	void RFBProto::Update( Uint32 ms )
 	{
 		if( m_net.WaitDataReady( ms ) == false )
 			return;
-		NET_UINT8( type );
+		Uint8 type = Wire::ReceiveValue< Uint8 >( m_net );
 		switch( type )
 		{
 		case RFB_SERVER_FBUPDATE:
 			{				
-				NET_UINT8( padding );
-				NET_UINT16( num_rects );
-				for( unsigned i = 0; i < num_rects; ++i )
+				Wire::UpdateHeader update;
+				Wire::Receive( m_net, update );
+				m_display->BeginUpdate();
+				try
+				{
+					if( m_pool != NULL )
+					{
+						DecodeParallelUpdate( update.num_rects );
+					}
+					else
+					{
+						for( unsigned i = 0; i < update.num_rects; ++i )
+						{
+							Wire::RectHeader header;
+							Wire::Receive( m_net, header );
+							ScreenRect rect( header.x, header.y, header.w, header.h );
+							Decoder& decoder = GetDecoder( header.encoding );
+							FlushDecoders( &decoder );
+							decoder( rect, *m_display );
+						}
+					}
+					FlushDecoders( NULL );
+				}
+				catch( ... )
 				{
-					NET_UINT16( x );
-					NET_UINT16( y );
-					NET_UINT16( w );
-					NET_UINT16( h );
-					ScreenRect rect( x, y, w, h );
-					NET_UINT32( type );					
-					GetDecoder( type )( rect, *m_display );
+					m_display->EndUpdate();
+					throw;
 				}
+				m_display->EndUpdate();
+				m_scratch.Reset();
 				//! \todo mechanism for repainting lost areas of the display
 				SendUpdateRequest( ScreenRect( 0, 0, m_desktop_width, m_desktop_height ), true );
 			}
@@ -313,14 +589,17 @@ namespace VNC
 
 		case RFB_SERVER_CUTTEXT:
 			{
-				NET_UINT16( padding1 );
-				NET_UINT8( padding2 );
-				NET_UINT32( length );
-				char* buf = new char[ length + 1  ];
-				m_net.ReceiveBytes( (Uint8*)buf, length );
-				buf[length] = '\0';
-				cerr << "New cut text: " << buf << endl;
-				delete buf;
+				// the length is the server's to choose; keep no more than a
+				// sane amount, and let the rest go by
+				Wire::CutText cut;
+				Wire::Receive( m_net, cut );
+				Uint32 keep = cut.length < VNC_STRING_LENGTH_LIMIT ? cut.length : VNC_STRING_LENGTH_LIMIT;
+				string text = ReceiveChars( m_net, keep, VNC_STRING_LENGTH_LIMIT );
+				SkipBytes( m_net, cut.length - keep );
+				cerr << "New cut text: " << text;
+				if( keep < cut.length )
+					cerr << "... (" << cut.length - keep << " more bytes)";
+				cerr << endl;
 				//! \todo actually handle this
 			}
 			break;
@@ -373,5 +652,256 @@ namespace VNC
 		}
 		return *(it->second);
 	}
-	
+
+	void RFBProto::FlushDecoders( Decoder* except )
+	{
+		for( unsigned i = 0; i < m_decoders_vec.size(); ++i )
+		{
+			if( m_decoders_vec[i] != except )
+				m_decoders_vec[i]->Flush( *m_display );
+		}
+	}
+
+	void RFBProto::DecodeParallelUpdate( unsigned num_rects )
+	{
+		double start = Now();
+		unsigned num_framed = 0;
+		m_framed_data = ScratchBytes();
+		m_framed_wall = m_framed_busy = 0;
+		for( unsigned i = 0; i < num_rects; ++i )
+		{
+			Wire::RectHeader header;
+			Wire::Receive( m_net, header );
+			ScreenRect rect( header.x, header.y, header.w, header.h );
+			Decoder& decoder = GetDecoder( header.encoding );
+			FlushDecoders( &decoder );
+
+			FramedRect r;
+			r.rect = rect;
+			r.source = ScreenRect( 0, 0, 0, 0 );
+			r.decoder = &decoder;
+			r.offset = m_framed_data.length;
+			Wire::Recorder data( m_net, m_scratch, m_framed_data );
+			if( !decoder.Frame( rect, *m_display, data ) )
+			{
+				// this one is decoded as it arrives, after everything before it
+				RunFramed();
+				decoder( rect, *m_display );
+				continue;
+			}
+			r.length = m_framed_data.length - r.offset;
+			if( header.encoding == RFB_ENCODING_COPYRECT )
+			{
+				Wire::CopyRect copy;
+				Wire::Unpack( m_framed_data.data + r.offset, m_framed_data.data + r.offset + r.length, copy );
+				r.source = ScreenRect( copy.src_x, copy.src_y, rect.w, rect.h );
+			}
+			ScheduleFramed( r );
+			++num_framed;
+
+			// decode what is queued once it takes up enough memory, and
+			// reuse the buffer from the start
+			if( m_framed_data.length >= RFB_FRAMED_DATA_CAP )
+			{
+				RunFramed();
+				m_framed_data.length = 0;
+			}
+		}
+		RunFramed();
+
+		if( m_report_updates )
+		{
+			double total = Now() - start;
+			cerr << "Update of " << num_rects << " rectangles, " << num_framed << " framed: "
+				 << total * 1000 << " ms, " << m_framed_wall * 1000 << " ms decoding framed rectangles";
+			if( m_framed_wall > 0 )
+				cerr << " (" << m_framed_busy / m_framed_wall << "x speedup)";
+			cerr << endl;
+		}
+	}
+
+	bool RFBProto::GetFramedCells( ScreenRect const& rect, int cells[4] ) const
+	{
+		if( rect.w <= 0 || rect.h <= 0 )
+			return false;
+		cells[0] = rect.x / RFB_FRAMED_CELL_SIZE;
+		cells[1] = rect.y / RFB_FRAMED_CELL_SIZE;
+		cells[2] = ( rect.x + rect.w - 1 ) / RFB_FRAMED_CELL_SIZE;
+		cells[3] = ( rect.y + rect.h - 1 ) / RFB_FRAMED_CELL_SIZE;
+
+		// whatever lies off the screen shares the edge cells
+		if( cells[0] >= m_cell_columns ) cells[0] = m_cell_columns - 1;
+		if( cells[2] >= m_cell_columns ) cells[2] = m_cell_columns - 1;
+		if( cells[1] >= m_cell_rows ) cells[1] = m_cell_rows - 1;
+		if( cells[3] >= m_cell_rows ) cells[3] = m_cell_rows - 1;
+		return true;
+	}
+
+	void RFBProto::ScheduleFramed( FramedRect const& r )
+	{
+		// find the one lane the rectangle has to follow, if any: the lane
+		// of its sequential decoder, or of a rectangle it overlaps, which
+		// can only be among those sharing a cell with it or its source
+		bool sequential = r.decoder->IsSequential();
+		int lane = -1;
+		bool conflict = false;
+		if( sequential )
+		{
+			for( unsigned l = 0; l < m_num_lanes; ++l )
+			{
+				if( m_lanes[l]->decoder == r.decoder )
+					lane = l;
+			}
+		}
+		ScreenRect const* areas[2] = { &r.rect, &r.source };
+		for( int a = 0; a < 2 && !conflict; ++a )
+		{
+			int cells[4];
+			if( !GetFramedCells( *areas[a], cells ) )
+				continue;
+			for( int cy = cells[1]; cy <= cells[3] && !conflict; ++cy )
+				for( int cx = cells[0]; cx <= cells[2] && !conflict; ++cx )
+				{
+					vector< Uint32 > const& cell = m_framed_cells[cy * m_cell_columns + cx];
+					for( unsigned i = 0; i < cell.size() && !conflict; i += 2 )
+					{
+						int l = cell[i];
+						if( l == lane || !DependsOn( r, m_lanes[l]->rects[cell[i + 1]] ) )
+							continue;
+						if( lane >= 0 )
+							conflict = true;
+						lane = l;
+					}
+				}
+		}
+		// a lane can only keep one sequential decoder's rectangles in order
+		if( lane >= 0 && sequential && m_lanes[lane]->decoder != NULL && m_lanes[lane]->decoder != r.decoder )
+			conflict = true;
+
+		// a rectangle that is free to go anywhere gets a lane of its own
+		// while there are fewer than workers, and otherwise joins the least
+		// loaded lane that can take it
+		unsigned max_lanes = m_pool->GetNumWorkers() > 1 ? m_pool->GetNumWorkers() : 1;
+		if( !conflict && lane < 0 && m_num_lanes >= max_lanes )
+		{
+			for( unsigned l = 0; l < m_num_lanes; ++l )
+			{
+				if( sequential && m_lanes[l]->decoder != NULL )
+					continue;
+				if( lane < 0 || m_lanes[l]->load < m_lanes[lane]->load )
+					lane = l;
+			}
+			if( lane < 0 )
+				conflict = true;
+		}
+
+		if( conflict )
+		{
+			RunFramed();
+			lane = -1;
+		}
+		if( lane < 0 )
+		{
+			if( m_num_lanes == m_lanes.size() )
+				m_lanes.push_back( new FramedLane );
+			lane = m_num_lanes++;
+			m_lanes[lane]->decoder = NULL;
+			m_lanes[lane]->load = 0;
+		}
+
+		// queue it, and note where it can be found
+		FramedLane* queue = m_lanes[lane];
+		if( sequential )
+			queue->decoder = r.decoder;
+		for( int a = 0; a < 2; ++a )
+		{
+			int cells[4];
+			if( !GetFramedCells( *areas[a], cells ) )
+				continue;
+			for( int cy = cells[1]; cy <= cells[3]; ++cy )
+				for( int cx = cells[0]; cx <= cells[2]; ++cx )
+				{
+					unsigned c = cy * m_cell_columns + cx;
+					vector< Uint32 >& cell = m_framed_cells[c];
+					if( cell.empty() )
+						m_touched_cells.push_back( c );
+					cell.push_back( lane );
+					cell.push_back( queue->rects.size() );
+				}
+		}
+		queue->rects.push_back( r );
+		queue->load += (unsigned long)r.rect.w * r.rect.h;
+	}
+
+	void RFBProto::EndFramedDrawing( unsigned num_lanes )
+	{
+		// report each rectangle on its own, so that scattered ones aren't
+		// presented as the box around them; the first ends the drawing just
+		// done, the others are drawings of their own with nothing in them
+		bool first = true;
+		for( unsigned l = 0; l < num_lanes; ++l )
+		{
+			std::vector< FramedRect > const& rects = m_lanes[l]->rects;
+			for( unsigned i = 0; i < rects.size(); ++i )
+			{
+				if( !first )
+					m_display->BeginDrawing();
+				m_display->EndDrawing( rects[i].rect );
+				first = false;
+			}
+		}
+	}
+
+	void RFBProto::RunFramed()
+	{
+		if( m_num_lanes == 0 )
+			return;
+
+		// point the lanes at the data
+		FramedDisplay disp( *this, *m_display );
+		for( unsigned l = 0; l < m_num_lanes; ++l )
+		{
+			m_lanes[l]->data = m_framed_data.data;
+			m_lanes[l]->disp = &disp;
+			m_lanes[l]->pool = NULL;
+		}
+
+		double start = Now();
+		unsigned num_lanes = m_num_lanes;
+		m_num_lanes = 0;
+		for( unsigned i = 0; i < m_touched_cells.size(); ++i )
+			m_framed_cells[m_touched_cells[i]].clear();
+		m_touched_cells.clear();
+		m_display->BeginDrawing();
+		try
+		{
+			if( num_lanes == 1 )
+			{
+				// the pool is idle, so the decoders' own pipelines can have it
+				m_lanes[0]->pool = m_pool;
+				m_lanes[0]->Run();
+			}
+			else
+			{
+				for( unsigned l = 0; l < num_lanes; ++l )
+					m_pool->Submit( *m_lanes[l] );
+				m_pool->Wait();
+			}
+		}
+		catch( ... )
+		{
+			EndFramedDrawing( num_lanes );
+			for( unsigned l = 0; l < num_lanes; ++l )
+				m_lanes[l]->rects.clear();
+			throw;
+		}
+		EndFramedDrawing( num_lanes );
+		m_framed_wall += Now() - start;
+		for( unsigned l = 0; l < num_lanes; ++l )
+		{
+			m_framed_busy += m_lanes[l]->busy;
+			m_lanes[l]->rects.clear();
+		}
+	}
+
 };
@@ -8,18 +8,28 @@
 #define VNC_SDL_H
 
 #include <string>
+#include <vector>
+#include <deque>
 
 #include <SDL/SDL.h>
 #include <SDL/SDL_net.h>
 #include <SDL/SDL_mutex.h>
+#include <SDL/SDL_thread.h>
 
 #include "vnc.h"
+#include "blit-kernels.h"
+#include "pixel-converter.h"
+#include "damage-list.h"
+#include "tile-hashes.h"
 
 namespace VNC
 {
 
 	/*!
 	  \brief SDL_net implementation of NetworkClient.
+	  Small reads are served from a buffer of whatever the last receive
+	  got, so decoders reading a byte at a time don't make a system call
+	  for each one.
 	*/
 	class SDLNetworkClient : public NetworkClient
 	{
@@ -52,6 +62,7 @@ namespace VNC
 		virtual void EndWritePacket();		
 		virtual void SendBytes( Uint8 const* data, unsigned int count );
 		virtual void ReceiveBytes( Uint8* data, unsigned int count );
+		virtual unsigned int ReceiveSome( Uint8* data, unsigned int count );
 		virtual bool WaitDataReady( Uint32 ms );
 		
 	private:
@@ -61,9 +72,15 @@ namespace VNC
 		  \returns true if data is ready, false if the 100 ms timeout expired.
 		*/
 		bool WaitDataReady();
+
+		//! Receives whatever has arrived into m_rbuf; there must be nothing left in it.
+		void FillBuffer();
 		
 		TCPsocket m_socket;   //!< SDL_net TCP socket
 		SDL_mutex* m_mutex;   //!< lock to keep from reading and writing at the same time
+		std::vector< Uint8 > m_rbuf;   //!< received data not yet handed out
+		unsigned int m_rbuf_pos;       //!< read position in m_rbuf
+		unsigned int m_rbuf_len;       //!< amount of valid data in m_rbuf
 		
 	};
 
@@ -80,11 +97,24 @@ namespace VNC
 		//! SDL_SetVideoMode() call failed
 		CREATE_VNC_EXCEPTION( SDLVideo, "SDL mode set failed" );
 
+		//! the presentation thread or its synchronization objects could not be created
+		CREATE_VNC_EXCEPTION( SDLThread, "unable to create presentation thread" );
+
 		//! Constructor.
 		/*!
 		  \param rfb RFB protocol object to associate with.
+		  \param native_format keep the server's pixel format, converting
+		  pixels here rather than having the server transcode them
+		  \param shadow draw into a shadow framebuffer and copy to the
+		  surface in EndDrawing; full-width scrolls then move rows around
+		  rather than their pixels
+		  \param present_rate if not 0, present from a thread of our own at
+		  up to this many frames per second, showing only whole updates;
+		  implies \a shadow
+		  \param tile_hashing present only the damage on tiles whose pixels
+		  changed, going by a hash of each; implies \a shadow
 		*/
-		SDLDisplay( RFBProto& rfb );
+		SDLDisplay( RFBProto& rfb, bool native_format = false, bool shadow = false, int present_rate = 0, bool tile_hashing = false );
 
 		//! Destructor.
 		virtual ~SDLDisplay();
@@ -92,9 +122,32 @@ namespace VNC
 		// inherited from Display class
 		virtual void BeginDrawing();
 		virtual void EndDrawing( ScreenRect const& rect );
+		virtual void BeginUpdate();
+		virtual void EndUpdate();
 		virtual void WritePixels( int x, int y, int count, Uint8* data );
 		virtual void WriteUniformPixels( int x, int y, int count, Uint32 pixel );
 		virtual void CopyPixels( int sx, int sy, int dx, int dy, int w, int h );
+		virtual Uint8* GetDirectRow( int x, int y );
+		virtual void WriteRect( ScreenRect const& rect, Uint8 const* data, int pitch );
+		virtual void FillRect( ScreenRect const& rect, Uint32 pixel );
+		virtual void FillRects( SolidRect const* rects, int count );
+
+		//! Retrieves how many updates have been drawn, and in how many frames they were shown.
+		/*!
+		  With a presentation thread, updates that come faster than the
+		  frame rate share frames, so there may be fewer frames.
+		*/
+		void GetPresentStats( unsigned long& updates, unsigned long& frames ) const;
+
+		//! Retrieves how much damage tile hashing found unchanged, and so didn't present.
+		/*!
+		  \param tiles tiles hashed
+		  \param unchanged of those, tiles whose pixels hadn't changed
+		  \param pixels pixels of damage drawn
+		  \param kept of those, pixels presented
+		  \returns false, leaving the counts alone, if not hashing tiles
+		*/
+		bool GetTileHashStats( unsigned long& tiles, unsigned long& unchanged, unsigned long& pixels, unsigned long& kept ) const;
 
 	protected:
 
@@ -105,6 +158,8 @@ namespace VNC
 		  We always accept the server's bit layout for 8bpp (since we just have to compose a palette
 		  for this), but in 16bpp and 32bpp modes we use whatever bit layout is easiest for us.
 		  The VNC protocol guarantees that this is acceptable.
+		  With native_format, m_format goes back to the server's layout, and if the
+		  surface's differs, m_converter is set up to translate.
 		*/
 		void ReconcilePixelFormat();
 
@@ -114,6 +169,50 @@ namespace VNC
 		//! Sets the current format to reflect our truecolor or hicolor bit layout.
 		void Setup16or32bit();
 
+		//! Points m_rows at the surface's rows, if it isn't in shadow mode; call with the surface locked.
+		void SetSurfaceRows();
+
+		//! Presents the damage in one go, or hands it to the presentation thread.
+		/*!
+		  Releases the surface BeginDrawing locked, unless in shadow mode.
+		  With a presentation thread, the damaged areas are copied into
+		  the frame it presents from, under the frame lock.
+		  With tile hashing, damage on tiles that hash as before is dropped.
+		*/
+		void FinishDrawing();
+
+		//! Copies areas of a shadow framebuffer into the surface, locking it meanwhile.
+		/*!
+		  \param rects areas to copy
+		  \param rows where each row of the screen is in the shadow framebuffer
+		*/
+		void CopyShadow( std::vector< ScreenRect > const& rects, std::vector< Uint8* > const& rows );
+
+		//! Shows areas of the surface on the screen, with a single SDL call.
+		void ShowRects( std::vector< ScreenRect > const& rects );
+
+		//! Entry point of the presentation thread.
+		static int PresentThread( void* _display );
+
+		//! Presents pending damage, at most m_present_rate times a second, until told to quit.
+		void PresentFrames();
+
+		//! Stops the presentation thread and frees its synchronization objects.
+		void StopPresenting();
+
+		//! Moves full-width rows of the shadow framebuffer by swapping row pointers.
+		/*!
+		  Only the rows uncovered by the move have pixels copied, so
+		  scrolling costs the distance scrolled rather than the height.
+		  \param sy first source row
+		  \param dy first destination row
+		  \param h number of rows
+		*/
+		void ScrollRows( int sy, int dy, int h );
+
+		//! Puts a pixel in the display's format into the surface's.
+		Uint32 SurfacePixel( Uint32 pixel ) const { return m_converter ? m_converter->ConvertPixel( pixel ) : pixel; }
+
 		//! Checks for special key combinations.
 		/*!
 		  Reads the current keyboard state and acts on special key combinations.
@@ -130,10 +229,79 @@ namespace VNC
 		*/
 		virtual bool UpdateInput();
 		
-		SDL_Surface* m_display;   //!< pointer to the main SDL display
-		bool m_quit;              //!< quit flag
+		SDL_Surface* m_display;           //!< pointer to the main SDL display
+		bool m_quit;                      //!< quit flag
+		BlitKernels const& m_kernels;     //!< fills, packing and copies for this processor
+		bool m_native_format;             //!< keep the server's pixel format
+		PixelConverter* m_converter;      //!< translates m_format to the surface's, or NULL if they match
+		bool m_shadow;                    //!< draw into m_shadow_pixels rather than the surface
+		std::vector< Uint8 > m_shadow_pixels; //!< the shadow framebuffer's rows, in no particular order
+		std::vector< Uint8* > m_rows;     //!< where each row of the screen is drawn, in the surface's layout
+		int m_row_bytes;                  //!< bytes in a row of the screen
+		TileHashes* m_tile_hashes;        //!< hashes of the shadow framebuffer's tiles, or NULL if not skipping unchanged ones
+		DamageList m_changed;             //!< damage on tiles that changed, kept to save allocating
+		bool m_in_update;                 //!< between BeginUpdate and EndUpdate, where drawing only adds damage
+		DamageList m_damage;              //!< areas drawn and not yet presented
+		std::vector< SDL_Rect > m_update_rects; //!< damage in SDL's terms, kept to save allocating
+		int m_present_rate;               //!< frames per second of the presentation thread, or 0 for none
+		SDL_Thread* m_present_thread;     //!< the presentation thread, if any
+		std::vector< Uint8 > m_frame_pixels; //!< finished updates, for the presentation thread to copy out
+		std::vector< Uint8* > m_frame_rows; //!< where each row of the screen is in m_frame_pixels
+		SDL_mutex* m_frame_mutex;         //!< held while a finished update is copied in, and while a frame is copied out
+		SDL_cond* m_frame_cond;           //!< signalled when an update has left damage
+		DamageList m_pending;             //!< damage of finished updates not yet shown
+		bool m_present_quit;              //!< tells the presentation thread to exit
+		unsigned long m_num_updates;      //!< updates drawn
+		unsigned long m_num_frames;       //!< frames shown
 	};	
 
+	/*!
+	  \brief SDL thread implementation of WorkerPool.
+	*/
+	class SDLWorkerPool : public WorkerPool
+	{
+	public:
+
+		//! a worker thread or its synchronization objects could not be created
+		CREATE_VNC_EXCEPTION( Thread, "unable to create worker thread" );
+
+		//! Constructor.
+		/*!
+		  Starts the worker threads.
+		  \param num_workers number of threads; with none, jobs run inside Submit
+		*/
+		SDLWorkerPool( unsigned num_workers );
+
+		//! Destructor. Stops the worker threads.
+		virtual ~SDLWorkerPool();
+
+		// inherited from WorkerPool class
+		virtual unsigned GetNumWorkers() const { return m_threads.size(); }
+		virtual void Submit( Job& job );
+		virtual void Wait();
+
+	private:
+
+		//! Entry point of the worker threads.
+		static int WorkerThread( void* _pool );
+
+		//! Runs a job, remembering the first error. Called without the lock held.
+		void RunJob( Job& job );
+
+		//! Stops the threads and frees the synchronization objects.
+		void Shutdown();
+
+		std::vector< SDL_Thread* > m_threads;   //!< worker threads
+		std::deque< Job* > m_queue;             //!< jobs not yet started
+		unsigned m_unfinished;                  //!< jobs submitted but not yet finished
+		bool m_failed;                          //!< a job has thrown since the last Wait
+		std::string m_error;                    //!< what the first failing job threw
+		bool m_quit;                            //!< tells the workers to exit
+		SDL_mutex* m_mutex;                     //!< protects everything above
+		SDL_cond* m_work_cond;                  //!< signalled when a job is queued
+		SDL_cond* m_done_cond;                  //!< signalled when the last job finishes
+	};
+
 
 };
 
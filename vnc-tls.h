@@ -0,0 +1,99 @@
+/*!
+  \file vnc-tls.h
+  \brief TLS transport for encrypted (VeNCrypt) VNC sessions.
+*/
+
+#ifndef VNC_TLS_H
+#define VNC_TLS_H
+
+#include <string>
+#include <vector>
+
+#include <openssl/ssl.h>
+
+#include "vnc.h"
+
+namespace VNC
+{
+
+	/*!
+	  \brief NetworkClient decorator that adds a TLS layer to another connection.
+	  Passes all traffic through unchanged until StartTLS is called by the
+	  RFB handshake, and encrypts everything after that. Decrypted data is
+	  buffered in large chunks, so decoders still get bulk reads out of it.
+	  Outgoing packets are collected between BeginWritePacket and EndWritePacket
+	  and sent as a single TLS record.
+	*/
+	class TLSNetworkClient : public NetworkClient
+	{
+	public:
+
+		//! OpenSSL could not be set up
+		CREATE_VNC_EXCEPTION( TLSInit, "unable to initialize TLS" );
+
+		//! Constructor.
+		/*!
+		  \param net underlying connection to encrypt
+		  \param host server hostname, checked against the server certificate
+		  \param ca_file PEM file of trusted certificates; the system store is used if empty
+		  \param allow_anonymous also accept anonymous TLS, which encrypts
+		  but doesn't authenticate the server
+		*/
+		TLSNetworkClient( NetworkClient& net, std::string const& host, std::string const& ca_file, bool allow_anonymous = false );
+
+		//! Destructor.
+		virtual ~TLSNetworkClient();
+
+		// inherited from NetworkClient class
+		virtual void BeginWritePacket();
+		virtual void EndWritePacket();
+		virtual void SendBytes( Uint8 const* data, unsigned int count );
+		virtual void ReceiveBytes( Uint8* data, unsigned int count );
+		virtual bool WaitDataReady( Uint32 ms );
+		virtual bool CanStartTLS() const { return true; }
+		virtual bool CanStartAnonymousTLS() const { return m_allow_anonymous; }
+		virtual void StartTLS( bool anonymous );
+
+	private:
+
+		//! Reads decrypted data, waiting for the network if necessary.
+		/*!
+		  Reads at least one byte. Keeps going while more decrypted data
+		  can be had without blocking and there is room left.
+		  \param data buffer to fill
+		  \param count size of the buffer
+		  \returns number of bytes read
+		*/
+		unsigned int ReadDecrypted( Uint8* data, unsigned int count );
+
+		//! Encrypts and sends a block of data.
+		void WriteEncrypted( Uint8 const* data, unsigned int count );
+
+		//! Throws an exception describing the last OpenSSL error.
+		void ThrowError( char const* what );
+
+		// BIO callbacks that move ciphertext through the wrapped connection
+		static int BioWrite( BIO* bio, char const* data, int count );
+		static int BioRead( BIO* bio, char* data, int count );
+		static long BioCtrl( BIO* bio, int cmd, long num, void* ptr );
+
+		NetworkClient& m_net;          //!< wrapped connection carrying the ciphertext
+		std::string m_host;            //!< hostname to verify
+		std::string m_ca_file;         //!< trusted certificates, or empty for the system store
+		bool m_allow_anonymous;        //!< anonymous TLS may be negotiated
+
+		SSL_CTX* m_ctx;                //!< TLS context, NULL until StartTLS
+		SSL* m_ssl;                    //!< TLS session, NULL until StartTLS
+		BIO_METHOD* m_bio_method;      //!< BIO glue to m_net
+
+		std::vector< Uint8 > m_rbuf;   //!< decrypted data not yet handed out
+		unsigned int m_rbuf_pos;       //!< read position in m_rbuf
+		unsigned int m_rbuf_len;       //!< amount of valid data in m_rbuf
+
+		std::vector< Uint8 > m_wbuf;   //!< outgoing packet being assembled
+		int m_packet_depth;            //!< BeginWritePacket nesting level
+	};
+
+};
+
+#endif
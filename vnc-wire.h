@@ -0,0 +1,337 @@
+/*!
+  \file vnc-wire.h
+  \brief Compile-time descriptions of RFB wire messages.
+
+  Each message is declared once as a list of fixed-size fields. The list
+  expands into a plain struct, its exact size on the wire, and an unpacker
+  that decodes the whole message from a contiguous buffer. Messages are
+  received with a single read and decoded with a single bounds check,
+  instead of one read and one byte swap per field.
+*/
+
+#ifndef VNC_WIRE_H
+#define VNC_WIRE_H
+
+#include <string.h>
+#include "vnc.h"
+
+namespace VNC
+{
+	namespace Wire
+	{
+		//! Message ran past the end of its buffer.
+		CREATE_VNC_EXCEPTION( Truncated, "truncated message" );
+
+		//! Padding bytes; skipped when unpacking.
+		template< int N >
+		struct Pad
+		{
+		};
+
+		//! Size and decoder of one wire field. Multi-byte integers are big endian.
+		template< typename T >
+		struct Field;
+
+		template<>
+		struct Field< Uint8 >
+		{
+			enum { SIZE = 1 };
+			static void Load( Uint8 const* p, Uint8& val ) { val = *p; }
+		};
+
+		template<>
+		struct Field< Uint16 >
+		{
+			enum { SIZE = 2 };
+			static void Load( Uint8 const* p, Uint16& val ) { memcpy( &val, p, 2 ); val = VNC_SWAP_BE_16( val ); }
+		};
+
+		template<>
+		struct Field< Uint32 >
+		{
+			enum { SIZE = 4 };
+			static void Load( Uint8 const* p, Uint32& val ) { memcpy( &val, p, 4 ); val = VNC_SWAP_BE_32( val ); }
+		};
+
+		template< int N >
+		struct Field< Pad< N > >
+		{
+			enum { SIZE = N };
+			static void Load( Uint8 const*, Pad< N >& ) {}
+		};
+
+		//! Receives a complete message with one network read.
+		/*!
+		  \param net connection to read from
+		  \param msg message to fill
+		*/
+		template< typename M >
+		void Receive( NetworkClient& net, M& msg )
+		{
+			Uint8 buf[M::SIZE];
+			net.ReceiveBytes( buf, M::SIZE );
+			M::Unpack( buf, msg );
+		}
+
+		//! Unpacks a complete message from a buffer.
+		/*!
+		  Throws ExcTruncated if the message doesn't fit.
+		  \param p start of the message
+		  \param end end of the buffer
+		  \param msg message to fill
+		  \returns pointer just past the message
+		*/
+		template< typename M >
+		Uint8 const* Unpack( Uint8 const* p, Uint8 const* end, M& msg )
+		{
+			if( end - p < (int)M::SIZE )
+				throw ExcTruncated();
+			M::Unpack( p, msg );
+			return p + M::SIZE;
+		}
+
+		//! Receives a single big endian integer.
+		template< typename T >
+		T ReceiveValue( NetworkClient& net )
+		{
+			Uint8 buf[Field< T >::SIZE];
+			net.ReceiveBytes( buf, Field< T >::SIZE );
+			T val;
+			Field< T >::Load( buf, val );
+			return val;
+		}
+
+		//! Loads a pixel of a size known at compile time, for decoders' pixel loops.
+		template< typename PIXEL >
+		inline PIXEL LoadPixel( Uint8 const* p )
+		{
+			PIXEL val;
+			memcpy( &val, p, sizeof( PIXEL ) );
+			return val;
+		}
+
+		//! Loads a pixel in the session's pixel format, which is already in host byte order.
+		/*!
+		  \param p pixel data
+		  \param bpp bytes per pixel (1, 2 or 4)
+		  \returns pixel value
+		*/
+		inline Uint32 LoadPixel( Uint8 const* p, int bpp )
+		{
+			switch( bpp )
+			{
+			case 1: return LoadPixel< Uint8 >( p );
+			case 2: return LoadPixel< Uint16 >( p );
+			case 4: return LoadPixel< Uint32 >( p );
+			default: throw Exc( "invalid color depth" );
+			}
+		}
+
+		//! Receives a pixel in the session's pixel format.
+		inline Uint32 ReceivePixel( NetworkClient& net, int bpp )
+		{
+			Uint8 buf[4];
+			net.ReceiveBytes( buf, bpp );
+			return LoadPixel( buf, bpp );
+		}
+
+		//! Reads decoder data straight from the network, with the same interface as ZlibReader.
+		/*!
+		  Lets one templated decoder body handle both plain and zlib-compressed data.
+		  Formats like TRLE don't say how long they are, so nothing can be read
+		  ahead here; single bytes are cheap because the connections buffer
+		  what they receive.
+		*/
+		class NetSource
+		{
+		public:
+			NetSource( NetworkClient& net ) : m_net( net ) {}
+			Uint8 ReadByte() { Uint8 b; m_net.ReceiveBytes( &b, 1 ); return b; }
+			void ReadBytes( Uint8* buf, int length ) { m_net.ReceiveBytes( buf, length ); }
+		private:
+			NetworkClient& m_net;
+		};
+
+		//! Reads decoder data from memory, with the same interface as ZlibReader.
+		/*!
+		  For data that was received or inflated earlier and is decoded on another thread.
+		*/
+		class MemorySource
+		{
+		public:
+			MemorySource( Uint8 const* data, Uint32 length ) : m_data( data ), m_end( data + length ) {}
+
+			Uint8 ReadByte()
+			{
+				if( m_data == m_end )
+					throw ExcTruncated();
+				return *m_data++;
+			}
+
+			void ReadBytes( Uint8* buf, int length )
+			{
+				if( length > m_end - m_data )
+					throw ExcTruncated();
+				memcpy( buf, m_data, length );
+				m_data += length;
+			}
+
+		private:
+			Uint8 const* m_data;
+			Uint8 const* m_end;
+		};
+
+		//! Passes data through from the network, keeping a copy of everything received.
+		/*!
+		  Decoders receive rectangles through this to frame them for later decoding.
+		*/
+		class Recorder : public NetworkClient
+		{
+		public:
+			//! Starts recording.
+			/*!
+			  \param net connection to receive from
+			  \param scratch memory the record grows into
+			  \param data record to append received data to
+			*/
+			Recorder( NetworkClient& net, ScratchArena& scratch, ScratchBytes& data ) : m_net( net ), m_scratch( scratch ), m_data( data ) {}
+
+			virtual void BeginWritePacket() { m_net.BeginWritePacket(); }
+			virtual void EndWritePacket() { m_net.EndWritePacket(); }
+			virtual void SendBytes( Uint8 const* data, unsigned int count ) { m_net.SendBytes( data, count ); }
+			virtual bool WaitDataReady( Uint32 ms ) { return m_net.WaitDataReady( ms ); }
+
+			virtual void ReceiveBytes( Uint8* data, unsigned int count )
+			{
+				Uint32 at = m_data.length;
+				Skip( count );
+				memcpy( data, m_data.data + at, count );
+			}
+
+			//! Receives data that is only needed later, straight into the record.
+			void Skip( Uint32 count )
+			{
+				Uint8* at = m_data.Append( m_scratch, count );
+				if( count > 0 )
+					m_net.ReceiveBytes( at, count );
+			}
+
+		private:
+			NetworkClient& m_net;
+			ScratchArena& m_scratch;
+			ScratchBytes& m_data;
+		};
+
+		//! Plays back data received earlier, as though it came from the network.
+		class MemoryClient : public NetworkClient
+		{
+		public:
+			//! Starts playback.
+			/*!
+			  \param data recorded data; must outlive the client
+			  \param length bytes of data
+			*/
+			MemoryClient( Uint8 const* data, Uint32 length ) : m_data( data ), m_left( length ) {}
+
+			virtual void BeginWritePacket() {}
+			virtual void EndWritePacket() {}
+			virtual void SendBytes( Uint8 const*, unsigned int ) { throw Exc( "recorded data can't be replied to" ); }
+			virtual bool WaitDataReady( Uint32 ) { return m_left > 0; }
+
+			virtual void ReceiveBytes( Uint8* data, unsigned int count )
+			{
+				if( count > m_left )
+					throw ExcTruncated();
+				memcpy( data, m_data, count );
+				m_data += count;
+				m_left -= count;
+			}
+
+			virtual unsigned int ReceiveSome( Uint8* data, unsigned int count )
+			{
+				if( m_left == 0 )
+					throw ExcTruncated();
+				if( count > m_left )
+					count = m_left;
+				ReceiveBytes( data, count );
+				return count;
+			}
+
+			//! Retrieves the number of bytes not yet received.
+			Uint32 GetRemaining() const { return m_left; }
+
+		private:
+			Uint8 const* m_data;
+			Uint32 m_left;
+		};
+	};
+
+	//! expands to one member declaration of a wire message
+#define VNC_WIRE_DECLARE_FIELD( type, name ) type name;
+
+	//! expands to the size of one wire field, for summing
+#define VNC_WIRE_FIELD_SIZE( type, name ) + ::VNC::Wire::Field< type >::SIZE
+
+	//! expands to the decoding of one wire field
+#define VNC_WIRE_LOAD_FIELD( type, name ) \
+	::VNC::Wire::Field< type >::Load( p, msg.name ); p += ::VNC::Wire::Field< type >::SIZE;
+
+	//! declares a wire message from a field list macro taking a field macro F( type, name )
+#define VNC_WIRE_MESSAGE( msgname, FIELDS )								\
+	struct msgname														\
+	{																	\
+		FIELDS( VNC_WIRE_DECLARE_FIELD )								\
+		enum { SIZE = 0 FIELDS( VNC_WIRE_FIELD_SIZE ) };				\
+		static void Unpack( Uint8 const* p, msgname& msg )				\
+		{																\
+			FIELDS( VNC_WIRE_LOAD_FIELD )								\
+		}																\
+	};
+
+	namespace Wire
+	{
+		// ServerInit, up to the desktop name itself
+#define VNC_WIRE_SERVER_INIT( F )										\
+		F( Uint16, width ) F( Uint16, height )							\
+		F( Uint8, bits_per_pixel ) F( Uint8, depth )					\
+		F( Uint8, big_endian ) F( Uint8, true_color )					\
+		F( Uint16, red_max ) F( Uint16, green_max ) F( Uint16, blue_max ) \
+		F( Uint8, red_shift ) F( Uint8, green_shift ) F( Uint8, blue_shift ) \
+		F( Pad< 3 >, padding ) F( Uint32, name_length )
+		VNC_WIRE_MESSAGE( ServerInit, VNC_WIRE_SERVER_INIT )
+
+		// FramebufferUpdate, after the message type
+#define VNC_WIRE_UPDATE_HEADER( F )										\
+		F( Pad< 1 >, padding ) F( Uint16, num_rects )
+		VNC_WIRE_MESSAGE( UpdateHeader, VNC_WIRE_UPDATE_HEADER )
+
+		// header of each rectangle in a FramebufferUpdate
+#define VNC_WIRE_RECT_HEADER( F )										\
+		F( Uint16, x ) F( Uint16, y ) F( Uint16, w ) F( Uint16, h )	\
+		F( Uint32, encoding )
+		VNC_WIRE_MESSAGE( RectHeader, VNC_WIRE_RECT_HEADER )
+
+		// ServerCutText, after the message type
+#define VNC_WIRE_CUT_TEXT( F )											\
+		F( Pad< 3 >, padding ) F( Uint32, length )
+		VNC_WIRE_MESSAGE( CutText, VNC_WIRE_CUT_TEXT )
+
+		// CopyRect source position
+#define VNC_WIRE_COPY_RECT( F )											\
+		F( Uint16, src_x ) F( Uint16, src_y )
+		VNC_WIRE_MESSAGE( CopyRect, VNC_WIRE_COPY_RECT )
+
+		// RRE subrectangle, after its pixel value
+#define VNC_WIRE_RRE_SUBRECT( F )										\
+		F( Uint16, x ) F( Uint16, y ) F( Uint16, w ) F( Uint16, h )
+		VNC_WIRE_MESSAGE( RRESubrect, VNC_WIRE_RRE_SUBRECT )
+
+		// CoRRE subrectangle, after its pixel value
+#define VNC_WIRE_CORRE_SUBRECT( F )										\
+		F( Uint8, x ) F( Uint8, y ) F( Uint8, w ) F( Uint8, h )
+		VNC_WIRE_MESSAGE( CoRRESubrect, VNC_WIRE_CORRE_SUBRECT )
+	};
+
+};
+
+#endif
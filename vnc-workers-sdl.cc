@@ -0,0 +1,148 @@
+/*!
+  \file vnc-workers-sdl.cc
+  \brief SDL thread implementation of the decoding worker pool.
+*/
+
+#include <string>
+#include <SDL/SDL_mutex.h>
+#include <SDL/SDL_thread.h>
+#include "vnc-sdl.h"
+
+using namespace std;
+
+namespace VNC
+{
+
+	SDLWorkerPool::SDLWorkerPool( unsigned num_workers )
+		: m_unfinished( 0 ),
+		  m_failed( false ),
+		  m_quit( false ),
+		  m_mutex( SDL_CreateMutex() ),
+		  m_work_cond( SDL_CreateCond() ),
+		  m_done_cond( SDL_CreateCond() )
+	{
+		if( m_mutex == NULL || m_work_cond == NULL || m_done_cond == NULL )
+		{
+			Shutdown();
+			throw ExcThread();
+		}
+		for( unsigned i = 0; i < num_workers; ++i )
+		{
+			SDL_Thread* thread = SDL_CreateThread( WorkerThread, this );
+			if( thread == NULL )
+			{
+				Shutdown();
+				throw ExcThread();
+			}
+			m_threads.push_back( thread );
+		}
+	}
+
+	SDLWorkerPool::~SDLWorkerPool()
+	{
+		Shutdown();
+	}
+
+	void SDLWorkerPool::Shutdown()
+	{
+		if( !m_threads.empty() )
+		{
+			SDL_LockMutex( m_mutex );
+			m_quit = true;
+			SDL_CondBroadcast( m_work_cond );
+			SDL_UnlockMutex( m_mutex );
+			for( unsigned i = 0; i < m_threads.size(); ++i )
+				SDL_WaitThread( m_threads[i], NULL );
+			m_threads.clear();
+		}
+		if( m_done_cond != NULL )
+			SDL_DestroyCond( m_done_cond );
+		if( m_work_cond != NULL )
+			SDL_DestroyCond( m_work_cond );
+		if( m_mutex != NULL )
+			SDL_DestroyMutex( m_mutex );
+		m_done_cond = m_work_cond = NULL;
+		m_mutex = NULL;
+	}
+
+	void SDLWorkerPool::Submit( Job& job )
+	{
+		if( m_threads.empty() )
+		{
+			RunJob( job );
+			return;
+		}
+		SDL_LockMutex( m_mutex );
+		m_queue.push_back( &job );
+		++m_unfinished;
+		SDL_CondSignal( m_work_cond );
+		SDL_UnlockMutex( m_mutex );
+	}
+
+	void SDLWorkerPool::Wait()
+	{
+		SDL_LockMutex( m_mutex );
+		while( m_unfinished > 0 )
+			SDL_CondWait( m_done_cond, m_mutex );
+		bool failed = m_failed;
+		string error = m_error;
+		m_failed = false;
+		SDL_UnlockMutex( m_mutex );
+
+		if( failed )
+			throw Exc( error );
+	}
+
+	void SDLWorkerPool::RunJob( Job& job )
+	{
+		string error;
+		try
+		{
+			job.Run();
+			return;
+		}
+		catch( Exc const& e )
+		{
+			error = (char const*)e;
+		}
+		catch( ... )
+		{
+			error = "unexpected error in worker thread";
+		}
+
+		SDL_LockMutex( m_mutex );
+		if( !m_failed )
+		{
+			m_failed = true;
+			m_error = error;
+		}
+		SDL_UnlockMutex( m_mutex );
+	}
+
+	int SDLWorkerPool::WorkerThread( void* _pool )
+	{
+		SDLWorkerPool& pool = *(SDLWorkerPool*)_pool;
+
+		SDL_LockMutex( pool.m_mutex );
+		for( ;; )
+		{
+			while( pool.m_queue.empty() && !pool.m_quit )
+				SDL_CondWait( pool.m_work_cond, pool.m_mutex );
+			if( pool.m_queue.empty() )
+				break;
+
+			Job* job = pool.m_queue.front();
+			pool.m_queue.pop_front();
+			SDL_UnlockMutex( pool.m_mutex );
+			pool.RunJob( *job );
+			SDL_LockMutex( pool.m_mutex );
+
+			if( --pool.m_unfinished == 0 )
+				SDL_CondBroadcast( pool.m_done_cond );
+		}
+		SDL_UnlockMutex( pool.m_mutex );
+
+		return 0;
+	}
+
+};
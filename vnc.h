@@ -12,6 +12,7 @@
 #include <map>
 #include "vnctypes.h"
 #include "zlib-reader.h"
+#include "scratch-arena.h"
 
 //-------------------------------------------------------------------------------------
 
@@ -22,6 +23,12 @@
 #define RFB_AUTH_FAILED     0     //!< incompatible server version
 #define RFB_AUTH_NONE       1     //!< no authentication required
 #define RFB_AUTH_VNC        2     //!< DES hash authentication
+#define RFB_AUTH_VENCRYPT   19    //!< VeNCrypt (TLS) security type, RFB 3.7 and later
+
+#define RFB_VENCRYPT_TLSNONE   257   //!< anonymous TLS, no further authentication
+#define RFB_VENCRYPT_TLSVNC    258   //!< anonymous TLS, then DES hash authentication
+#define RFB_VENCRYPT_X509NONE  260   //!< certificate-verified TLS, no further authentication
+#define RFB_VENCRYPT_X509VNC   261   //!< certificate-verified TLS, then DES hash authentication
 
 #define RFB_AUTH_RESULT_OK      0 //!< authentication succeeded
 #define RFB_AUTH_RESULT_FAILED  1 //!< authentication not accepted
@@ -33,32 +40,71 @@
 #define RFB_ENCODING_CORRE    4   //!< compact rise and run length encoding
 #define RFB_ENCODING_HEXTILE  5   //!< 16x16 tile encoding
 #define RFB_ENCODING_ZLIB     6   //!< zlib-compressed raw pixel data
+#define RFB_ENCODING_TIGHT    7   //!< filtered pixel data over four zlib streams
+#define RFB_ENCODING_ZLIBHEX  8   //!< hextile with zlib-compressed tiles
+#define RFB_ENCODING_TRLE     15  //!< tiled RLE encoding; ZRLE without zlib
 #define RFB_ENCODING_ZRLE     16  //!< zipped RLE encoding
+#define RFB_ENCODING_ZYWRLE   17  //!< ZRLE with lossy wavelet-coded tiles
+#define RFB_ENCODING_H264     50  //!< Open H.264 video streams, one per rectangle
+
+#define RFB_ENCODING_QUALITY_LEVEL_0  0xFFFFFFE0   //!< pseudo-encoding -32: JPEG quality 0, up to 9 at -23
 
 #define RFB_ENCODING_NAME_RAW       "Raw"
 #define RFB_ENCODING_NAME_COPYRECT  "CopyRect"
 #define RFB_ENCODING_NAME_RRE       "RRE"
 #define RFB_ENCODING_NAME_CORRE     "CoRRE"
 #define RFB_ENCODING_NAME_HEXTILE   "Hextile"
+#define RFB_ENCODING_NAME_TRLE      "TRLE"
 #define RFB_ENCODING_NAME_ZRLE      "ZRLE"
+#define RFB_ENCODING_NAME_ZYWRLE    "ZYWRLE"
+#define RFB_ENCODING_NAME_H264      "H.264"
 #define RFB_ENCODING_NAME_ZLIB      "ZLIB"
+#define RFB_ENCODING_NAME_TIGHT     "Tight"
+#define RFB_ENCODING_NAME_ZLIBHEX   "ZlibHex"
 
 #define RFB_ENCODING_DESC_RAW       "raw pixel data without compression"
 #define RFB_ENCODING_DESC_COPYRECT  "fast copy within framebuffer"
 #define RFB_ENCODING_DESC_RRE       "rise and run length encoded pixel data (RRE)"
 #define RFB_ENCODING_DESC_CORRE     "compact rise and run length encoded pixel data (CoRRE)"
 #define RFB_ENCODING_DESC_HEXTILE   "16x16 tile encoded pixel data (hextile)"
+#define RFB_ENCODING_DESC_TRLE      "16x16 tiled RLE pixel data (TRLE)"
 #define RFB_ENCODING_DESC_ZRLE      "zlib-compressed RLE pixel data (ZRLE)"
+#define RFB_ENCODING_DESC_ZYWRLE    "wavelet-coded, zlib-compressed RLE pixel data (ZYWRLE)"
+#define RFB_ENCODING_DESC_H264      "H.264 video (Open H.264)"
 #define RFB_ENCODING_DESC_ZLIB      "zlib-compressed raw pixel data"
+#define RFB_ENCODING_DESC_TIGHT     "filtered and zlib-compressed pixel data (Tight)"
+#define RFB_ENCODING_DESC_ZLIBHEX   "zlib-compressed 16x16 tile encoded pixel data (ZlibHex)"
 
 #define RFB_HEXTILE_RAW                    1     //!< tile sent as raw pixels; other bits irrelevant
 #define RFB_HEXTILE_BG_SPECIFIED           2     //!< background color for this tile follows
 #define RFB_HEXTILE_FG_SPECIFIED           4     //!< foreground color for all subrects follows
 #define RFB_HEXTILE_ANY_SUBRECTS           8     //!< byte with # of subrects follows
 #define RFB_HEXTILE_SUBRECTS_COLORED       16    //!< each subrect will be preceded by its own foreground color
+#define RFB_ZLIBHEX_ZLIB_RAW               32    //!< ZlibHex: raw tile compressed on the raw stream; other bits irrelevant
+#define RFB_ZLIBHEX_ZLIB_HEX               64    //!< ZlibHex: tile body compressed on the encoded stream
+
+#define RFB_TIGHT_STREAMS             4     //!< number of independent zlib streams
+#define RFB_TIGHT_EXPLICIT_FILTER     0x40  //!< basic compression: a filter ID follows
+#define RFB_TIGHT_BASIC               0x00  //!< rectangle is filtered and maybe zlib-compressed
+#define RFB_TIGHT_FILL                0x80  //!< rectangle is a single TPIXEL
+#define RFB_TIGHT_JPEG                0x90  //!< rectangle is a JPEG image
+#define RFB_TIGHT_MAX_SUBENCODING     0x90  //!< highest compression type we understand
+#define RFB_TIGHT_FILTER_COPY         0     //!< pixels sent as is
+#define RFB_TIGHT_FILTER_PALETTE      1     //!< pixels sent as palette indices
+#define RFB_TIGHT_FILTER_GRADIENT     2     //!< pixels sent as differences from a gradient prediction
+#define RFB_TIGHT_MIN_TO_COMPRESS     12    //!< smaller data is sent without zlib
+
+#define RFB_H264_RESET_CONTEXT        1     //!< start this rectangle's stream afresh
+#define RFB_H264_RESET_ALL_CONTEXTS   2     //!< drop every stream before decoding this rectangle
 
 //-------------------------------------------------------------------------------------
 
+#if defined(VNC_HAVE_H264)
+// libavcodec types, kept out of this header
+struct AVPacket;
+struct AVFrame;
+#endif
+
 /*!
 	\brief Namespace for VNC-related classes and functions.	
 */
@@ -83,6 +129,7 @@ namespace VNC
 		
 		CREATE_VNC_EXCEPTION( Read, "unable to read data" );
 		CREATE_VNC_EXCEPTION( Write, "unable to write data" );
+		CREATE_VNC_EXCEPTION( NoTLS, "this connection does not support TLS" );
 
         // -------------------------------------------------------------
 		// Construction and destruction
@@ -144,6 +191,16 @@ namespace VNC
 		 */
 		virtual void ReceiveBytes( Uint8* data, unsigned int count ) = 0;
 
+		//! Receives whatever data has arrived, up to a limit.
+		/*!
+		  Blocks only while nothing at all has arrived. The default reads a
+		  single byte; connections that can do better should.
+		  \param data buffer to read data into; must be at least \a count bytes
+		  \param count most bytes to read; at least 1
+		  \returns number of bytes read, at least 1
+		*/
+		virtual unsigned int ReceiveSome( Uint8* data, unsigned int count ) { (void)count; ReceiveBytes( data, 1 ); return 1; }
+
 		//! Monitors the network for data.
 		/*!
 		  Returns when at least one byte can be read immediately, or after the
@@ -152,12 +209,42 @@ namespace VNC
 		  \returns true if data is available, false if the timeout expired.
 		*/
 		virtual bool WaitDataReady( Uint32 ms ) = 0;
+
+		//! Reports whether this connection can be switched to TLS.
+		/*!
+		  The RFB handshake uses this to decide whether to negotiate VeNCrypt.
+		  \returns true if StartTLS is supported
+		  \sa StartTLS
+		*/
+		virtual bool CanStartTLS() const { return false; }
+
+		//! Reports whether this connection may use TLS that doesn't authenticate the server.
+		/*!
+		  Anonymous Diffie-Hellman encrypts the session, but can't tell the
+		  server from a man in the middle, so it has to be asked for.
+		  \returns true if StartTLS( true ) is allowed
+		  \sa StartTLS
+		*/
+		virtual bool CanStartAnonymousTLS() const { return false; }
+
+		//! Performs a TLS handshake and encrypts all further traffic.
+		/*!
+		  \param anonymous true for anonymous Diffie-Hellman, false to verify the server certificate
+		  \sa CanStartTLS
+		*/
+		virtual void StartTLS( bool anonymous ) { (void)anonymous; throw ExcNoTLS(); }
 	};
 
 	//-------------------------------------------------------------------------------------
 	
 	class Display;
 	class Decoder;
+	class WorkerPool;
+
+	namespace Wire
+	{
+		class Recorder;
+	}
 	
 	/*!
  	    \brief Implementation of the Remote Framebuffer (RFB) protocol.
@@ -181,6 +268,12 @@ namespace VNC
 		/*! we've run out of chances to successfully authenticate */
 		CREATE_VNC_EXCEPTION( AuthTooMany, "authentication failed too many times" );
 
+		/*! encryption was requested but the server doesn't offer it */
+		CREATE_VNC_EXCEPTION( NoEncryption, "server does not support encrypted (VeNCrypt) sessions" );
+
+		/*! encryption was requested but the server only offers it without authenticating itself */
+		CREATE_VNC_EXCEPTION( AnonymousTLS, "server only offers anonymous (unauthenticated) TLS" );
+
 		/*! some pixel format we can't deal with (rare) */
 		CREATE_VNC_EXCEPTION( BadFormat, "bizarre pixel format" );
 
@@ -227,10 +320,24 @@ namespace VNC
 		
 		//! Sets the display to update.
 		/*!
-		  Also sets the active pixel format.
+		  Also sets the active pixel format to the display's, asking the
+		  server for it unless the server already uses that layout.
 		  \param display Display object to send updates to.
 		*/
 		void SetDisplay( Display* display );		
+
+		//! Decodes the rectangles of each update in parallel, where they allow it.
+		/*!
+		  Rectangles are received whole first. Those that don't overlap,
+		  aren't the source of a CopyRect and don't share a zlib stream are
+		  then decoded at the same time.
+		  \param pool worker pool, or NULL to decode each rectangle as it arrives
+		  \param report true to print the time and speedup of every update
+		*/
+		void SetParallelUpdates( WorkerPool* pool, bool report );
+
+		struct FramedRect;   //!< a received rectangle waiting to be decoded
+		class FramedLane;    //!< framed rectangles that have to be decoded in order
 		
 		// -------------------------------------------------------------
 		// Client -> Server messages		
@@ -286,6 +393,9 @@ namespace VNC
 
 		//! Returns the desktop's height.
 		int GetDesktopHeight() const { return m_desktop_height; }
+
+		//! Retrieves the decoders' scratch memory, for its statistics.
+		ScratchArena const& GetScratchArena() const { return m_scratch; }
 		
 		// -------------------------------------------------------------
 		// Private variables
@@ -301,12 +411,28 @@ namespace VNC
 		//! Performs the authentication handshake.
 		/*!
 		  Performs encrypted password authentication if necessary.
+		  If the network connection can do TLS, negotiates VeNCrypt
+		  and refuses any unencrypted security type.
 		*/
 		void DoAuthHandshake();
 
+		//! Performs the VeNCrypt subtype negotiation and starts TLS.
+		/*!
+		  Then runs the authentication of the chosen subtype over the encrypted link.
+		  Only the X509 subtypes are accepted, unless the connection allows
+		  anonymous TLS.
+		*/
+		void DoVeNCryptHandshake();
+
 		//! Responds to the server's DES authentication challenge.
 		void DoDESChallenge();
 
+		//! Reads the server's verdict on our authentication attempt.
+		/*!
+		  Throws an exception if authentication did not succeed.
+		*/
+		void ReadSecurityResult();
+
 		//! Generates a response by hashing the challenge with m_password.
 		/*!
 		  \param challenge 16-byte challenge from VNC server
@@ -328,6 +454,43 @@ namespace VNC
 		  \returns reference to the requested decoder
 		*/
 		Decoder& GetDecoder( Uint32 type ) const;
+
+		//! Receives and decodes the rectangles of an update, in parallel where they are independent.
+		/*!
+		  \param num_rects number of rectangles in the update
+		*/
+		void DecodeParallelUpdate( unsigned num_rects );
+
+		//! Queues a framed rectangle on a lane.
+		/*!
+		  Decodes everything already queued first if the rectangle depends
+		  on more than one lane. There are at most as many lanes as workers.
+		  \param r rectangle to queue
+		*/
+		void ScheduleFramed( FramedRect const& r );
+
+		//! Finds the cells of m_framed_cells a rectangle touches.
+		/*!
+		  \param rect area to look up
+		  \param cells set to the first column, first row, last column and last row
+		  \returns false if the rectangle is empty
+		*/
+		bool GetFramedCells( ScreenRect const& rect, int cells[4] ) const;
+
+		//! Decodes every queued framed rectangle, with a worker per lane, and waits for them.
+		void RunFramed();
+
+		//! Ends the drawing of RunFramed, passing the display each rectangle the lanes drew.
+		/*!
+		  \param num_lanes number of lanes that ran
+		*/
+		void EndFramedDrawing( unsigned num_lanes );
+
+		//! Finishes the queued work of every decoder but one.
+		/*!
+		  \param except decoder to leave alone, or NULL to flush them all
+		*/
+		void FlushDecoders( Decoder* except );
 		
 		bool m_shared;              //!< allow other clients to share desktop
 		NetworkClient& m_net;       //!< network connection
@@ -344,10 +507,30 @@ namespace VNC
 		Display* m_display;           //!< display to update
 		std::map< Uint32, Decoder* > m_decoders;  //! packet type -> decoder
 		std::vector< Decoder* > m_decoders_vec;   //! decoders in order of preference
+		ScratchArena m_scratch;                   //!< decoder scratch memory, emptied after each update
+
+		WorkerPool* m_pool;                       //!< threads for parallel updates, or NULL
+		bool m_report_updates;                    //!< print the timing of parallel updates
+		ScratchBytes m_framed_data;               //!< data of the queued framed rectangles, in m_scratch
+		std::vector< FramedLane* > m_lanes;       //!< lanes, kept from one update to the next
+		unsigned m_num_lanes;                     //!< lanes with rectangles queued
+		std::vector< std::vector< Uint32 > > m_framed_cells;   //!< for squares of the screen, the lane and index of each queued rectangle touching them, in pairs
+		std::vector< unsigned > m_touched_cells;  //!< cells with rectangles in them
+		int m_cell_columns;                       //!< cells across the screen
+		int m_cell_rows;                          //!< cells down the screen
+		double m_framed_wall;                     //!< seconds spent decoding framed rectangles this update
+		double m_framed_busy;                     //!< seconds of worker time that took
 	};
 
 	//-------------------------------------------------------------------------------------
 
+	//! A rectangle filled with one pixel value, for Display::FillRects.
+	struct SolidRect
+	{
+		ScreenRect rect;   //!< area to fill
+		Uint32 pixel;      //!< pixel value to fill it with
+	};
+
 	/*!
 	  \brief Generic VNC display.
 	*/
@@ -384,6 +567,19 @@ namespace VNC
 		  \param rect boundary rectangle of all drawing we performed
 		*/		
 		virtual void EndDrawing( ScreenRect const& rect ) = 0;
+
+		//! Starts a whole framebuffer update.
+		/*!
+		  The protocol brackets each update with BeginUpdate and EndUpdate,
+		  and the decoders' BeginDrawing / EndDrawing pairs come in between.
+		  A display can use this to prepare for drawing once and to present
+		  everything the update drew together. The default does nothing, and
+		  the drawing calls work the same with or without it.
+		*/
+		virtual void BeginUpdate() {}
+
+		//! Finishes a framebuffer update; see BeginUpdate.
+		virtual void EndUpdate() {}
 		
 		//! Our basic drawing primitive.
 		/*!
@@ -418,9 +614,47 @@ namespace VNC
 		*/
 		virtual void CopyPixels( int sx, int sy, int dx, int dy, int w, int h ) = 0;
 
+		//! Gives decoders direct access to the framebuffer, where the display allows it.
+		/*!
+		  The row holds pixels in the display's pixel format, and runs at least to
+		  the right edge of the screen. Only valid between BeginDrawing and EndDrawing.
+		  \param x x coordinate of the first pixel
+		  \param y y coordinate of the row
+		  \returns pointer to pixel (x, y), or NULL if decoders must use WritePixels
+		*/
+		virtual Uint8* GetDirectRow( int /* x */, int /* y */ ) { return NULL; }
+
+		//! Writes a block of pixel data, all its rows in one call.
+		/*!
+		  The default writes each row with WritePixels; displays override
+		  this to work out where the rows go once for the whole block.
+		  \param rect area to write
+		  \param data source pixel data for the top row
+		  \param pitch bytes from one source row to the next
+		*/
+		virtual void WriteRect( ScreenRect const& rect, Uint8 const* data, int pitch );
+
+		//! Fills a rectangle with identical pixels.
+		/*!
+		  The default fills each row with WriteUniformPixels.
+		  \param rect area to fill
+		  \param pixel pixel value to write
+		*/
+		virtual void FillRect( ScreenRect const& rect, Uint32 pixel );
+
+		//! Fills a number of rectangles, in order, so later ones cover earlier ones.
+		/*!
+		  The default calls FillRect for each one.
+		  \param rects rectangles and their pixel values
+		  \param count number of entries in \a rects
+		*/
+		virtual void FillRects( SolidRect const* rects, int count );
+
 		// note to hackers:
 		// please avoid adding more drawing primitives if it can be avoided
-		// I would like this interface to remain thin
+		// I would like this interface to remain thin; the block operations
+		// above exist because decoders spent more time calling WritePixels
+		// than drawing
 		
 		//! Processes events and updates the RFB object.
 		/*!
@@ -452,7 +686,56 @@ namespace VNC
 	};
 
 	//-------------------------------------------------------------------------------------
-	
+
+	//! A unit of work for a WorkerPool.
+	class Job
+	{
+	public:
+		virtual ~Job() {};
+
+		//! Does the work. Runs on one of the pool's threads.
+		/*!
+		  Exceptions thrown here are passed on by WorkerPool::Wait.
+		*/
+		virtual void Run() = 0;
+	};
+
+	/*!
+	  \brief A set of threads for decoding work that can run in parallel.
+	  Decoders use this to spread independent parts of an update across cores.
+	  Only the network thread submits jobs.
+	*/
+	class WorkerPool
+	{
+	public:
+		virtual ~WorkerPool() {};
+
+		//! Returns the number of jobs that can run at once.
+		virtual unsigned GetNumWorkers() const = 0;
+
+		//! Queues a job to run as soon as a thread is free.
+		/*!
+		  \param job job to run; must stay alive until Wait returns
+		*/
+		virtual void Submit( Job& job ) = 0;
+
+		//! Blocks until every submitted job has finished.
+		/*!
+		  Rethrows the first exception a job threw, once all of them are done.
+		*/
+		virtual void Wait() = 0;
+	};
+
+	//-------------------------------------------------------------------------------------
+
+	//! Where a decoder reads a rectangle from, and gets its temporary buffers.
+	struct DecoderInput
+	{
+		NetworkClient& net;      //!< the connection, or the rectangle's data, received earlier
+		ScratchArena& scratch;   //!< memory that lasts until the end of the update
+		WorkerPool* pool;        //!< threads to spread this rectangle over, or NULL when already on a worker
+	};
+
 	//! Functor for handling video update packets.
 	class Decoder
 	{
@@ -465,7 +748,7 @@ namespace VNC
 		/*!
 		  \param net network connection to read data from when invoked
 		*/
-		Decoder( NetworkClient& net ) : m_net( net ), m_processed( 0 ) {};
+		Decoder( NetworkClient& net ) : m_net( net ), m_processed( 0 ), m_pool( NULL ), m_scratch( NULL ) {};
 
 		//! Destructor.
 		virtual ~Decoder() {};
@@ -479,6 +762,62 @@ namespace VNC
 		*/
 		virtual void operator() ( ScreenRect const& rect, Display& disp ) = 0;
 
+		//! Receives a rectangle whole, to be decoded later by DecodeFramed.
+		/*!
+		  This only parses enough of the data to find where it ends, so the
+		  protocol can receive every rectangle of an update and then decode
+		  the ones that don't depend on each other in parallel.
+		  \param rect affected rectangle
+		  \param disp display the rectangle is for
+		  \param data connection that keeps whatever is received through it
+		  \returns false, without receiving anything, if this decoder can only decode as it receives
+		*/
+		virtual bool Frame( ScreenRect const& /* rect */, Display& /* disp */, Wire::Recorder& /* data */ ) { return false; }
+
+		//! Decodes a rectangle received by Frame.
+		/*!
+		  May run on a worker thread, at the same time as other rectangles of
+		  this decoder unless it is sequential. Must not call BeginDrawing or
+		  EndDrawing on its own behalf; the display passed in ignores them.
+		  \param rect affected rectangle
+		  \param disp display to update
+		  \param in the rectangle's data, and scratch memory for the thread
+		*/
+		virtual void DecodeFramed( ScreenRect const& /* rect */, Display& /* disp */, DecoderInput& /* in */ ) {}
+
+		//! Reports whether framed rectangles have to be decoded in order, as with a zlib stream.
+		virtual bool IsSequential() const { return false; }
+
+		//! Finishes any rectangles whose decoding was put off.
+		/*!
+		  A decoder may queue up rectangles and decode them together, in parallel.
+		  The protocol calls this before another decoder draws and at the end of
+		  each update, so that rectangles always land on the screen in order.
+		  \param disp display to update
+		*/
+		virtual void Flush( Display& /* disp */ ) {};
+
+		//! Adds any pseudo-encodings this decoder wants to advertise.
+		/*!
+		  These tell the server about decoder settings rather than naming an encoding.
+		  \param encodings list to append to
+		*/
+		virtual void GetPseudoEncodings( std::vector< Uint32 >& /* encodings */ ) const {};
+
+		//! Sets the threads this decoder may use.
+		/*!
+		  \param pool worker pool, or NULL to decode everything on the calling thread
+		*/
+		void SetWorkerPool( WorkerPool* pool ) { m_pool = pool; }
+
+		//! Sets where this decoder gets its temporary buffers.
+		/*!
+		  The protocol hands every decoder its arena before the first update,
+		  and empties it after each one.
+		  \param scratch scratch memory
+		*/
+		void SetScratchArena( ScratchArena* scratch ) { m_scratch = scratch; }
+
 		//! Retrieves the RFB type of this decoder.
 		/*!
 		  \returns RFB type ID
@@ -508,8 +847,10 @@ namespace VNC
 		// Private variables
 		
 	protected:
-		NetworkClient& m_net;   //!< network client to read data from
-		unsigned m_processed;   //!< number of packets processed by this encoding
+		NetworkClient& m_net;      //!< network client to read data from
+		unsigned m_processed;      //!< number of packets processed by this encoding
+		WorkerPool* m_pool;        //!< threads for parallel decoding, or NULL
+		ScratchArena* m_scratch;   //!< temporary buffers, valid until the end of the update
 	};
 
 
@@ -520,52 +861,190 @@ namespace VNC
 #define VNC_DECODER_INTERFACE( type )		   							\
 	public:																\
 	VNC_DECODER( type )( NetworkClient& net ) : Decoder( net ) {}		\
-	virtual void operator() ( ScreenRect const& rect, Display& disp );	\
+	virtual void operator() ( ScreenRect const& rect, Display& disp )	\
+	{ ++m_processed; DecoderInput in = { m_net, *m_scratch, m_pool }; Decode( rect, disp, in ); } \
 	virtual Uint32 GetType() { return RFB_ENCODING_##type; }			\
 	virtual char const* GetName() { return RFB_ENCODING_NAME_##type; }  \
 	virtual char const* GetDesc() { return RFB_ENCODING_DESC_##type; }  \
     private:		  													\
+	void Decode( ScreenRect const& rect, Display& disp, DecoderInput& in ); \
+
+	//! declares that a decoder can receive rectangles whole, to decode them later
+	/*!
+	  \param sequential true if its rectangles have to be decoded in order
+	*/
+#define VNC_DECODER_FRAMING( sequential )								\
+	public:																\
+	virtual bool Frame( ScreenRect const& rect, Display& disp, Wire::Recorder& data ); \
+	virtual void DecodeFramed( ScreenRect const& rect, Display& disp, DecoderInput& in ) { Decode( rect, disp, in ); } \
+	virtual bool IsSequential() const { return sequential; }			\
+    private:		  													\
 
 	//! begins the definition of a decoder 
 #define DEFINE_VNC_DECODER( type ) \
-	void VNC_DECODER( type )::operator() ( ScreenRect const& rect, Display& disp )
+	void VNC_DECODER( type )::Decode( ScreenRect const& rect, Display& disp, DecoderInput& in )
 
 	class VNC_DECODER( RAW ) : public Decoder
 	{
 		VNC_DECODER_INTERFACE( RAW );
+		VNC_DECODER_FRAMING( false );
 	};
 
 	class VNC_DECODER( COPYRECT ) : public Decoder
 	{
 		VNC_DECODER_INTERFACE( COPYRECT );
+		VNC_DECODER_FRAMING( false );
 	};
 	
 	class VNC_DECODER( RRE ) : public Decoder
 	{
 		VNC_DECODER_INTERFACE( RRE );
+		VNC_DECODER_FRAMING( false );
 	};
 
 	class VNC_DECODER( CORRE ) : public Decoder
 	{
 		VNC_DECODER_INTERFACE( CORRE );
+		VNC_DECODER_FRAMING( false );
 	};
 
 	class VNC_DECODER( HEXTILE ) : public Decoder
 	{
 		VNC_DECODER_INTERFACE( HEXTILE );
+		VNC_DECODER_FRAMING( false );
 	};
 
-//	class VNC_DECODER( ZRLE ) : public Decoder
-//	{
-//		VNC_DECODER_INTERFACE( ZRLE );
-//		ZlibReader m_zlib_reader;   //!< zlib input stream
-//	};
+	class VNC_DECODER( ZLIBHEX ) : public Decoder
+	{
+		VNC_DECODER_INTERFACE( ZLIBHEX );
+		VNC_DECODER_FRAMING( true );
+		ZlibReader m_raw_reader;   //!< zlib stream for raw tiles
+		ZlibReader m_hex_reader;   //!< zlib stream for encoded tiles
+	};
+
+	class VNC_DECODER( ZRLE ) : public Decoder
+	{
+		VNC_DECODER_INTERFACE( ZRLE );
+		VNC_DECODER_FRAMING( true );
+		ZlibReader m_zlib_reader;   //!< zlib input stream
+	};
 	
+	class VNC_DECODER( TRLE ) : public Decoder
+	{
+		VNC_DECODER_INTERFACE( TRLE );
+	};
+
+	class VNC_DECODER( ZYWRLE ) : public Decoder
+	{
+	public:
+		// the usual interface, plus a constructor that sets up the defaults
+		VNC_DECODER( ZYWRLE )( NetworkClient& net );
+		virtual void operator() ( ScreenRect const& rect, Display& disp );
+		virtual Uint32 GetType() { return RFB_ENCODING_ZYWRLE; }
+		virtual char const* GetName() { return RFB_ENCODING_NAME_ZYWRLE; }
+		virtual char const* GetDesc() { return RFB_ENCODING_DESC_ZYWRLE; }
+
+		virtual void GetPseudoEncodings( std::vector< Uint32 >& encodings ) const;
+		virtual bool Frame( ScreenRect const& rect, Display& disp, Wire::Recorder& data );
+		virtual void DecodeFramed( ScreenRect const& rect, Display& disp, DecoderInput& in ) { Decode( rect, disp, in ); }
+		virtual bool IsSequential() const { return true; }
+
+		//! Sets the quality level to ask for, which decides how deep the wavelet goes.
+		/*!
+		  \param level quality from 0 to 9, or -1 for the server's default
+		*/
+		void SetQualityLevel( int level ) { m_quality_level = level; }
+
+	private:
+		//! Decodes a rectangle from the network or from framed data.
+		void Decode( ScreenRect const& rect, Display& disp, DecoderInput& in );
+
+		int m_quality_level;        //!< quality to request, or -1
+		ZlibReader m_zlib_reader;   //!< zlib input stream
+	};
+
 	class VNC_DECODER( ZLIB ) : public Decoder
 	{
 		VNC_DECODER_INTERFACE( ZLIB );
+		VNC_DECODER_FRAMING( true );
 		ZlibReader m_zlib_reader;   //!< zlib input stream
 	};
+
+	class VNC_DECODER( TIGHT ) : public Decoder
+	{
+	public:
+		// the usual interface, plus a constructor that sets up the defaults
+		VNC_DECODER( TIGHT )( NetworkClient& net );
+		virtual void operator() ( ScreenRect const& rect, Display& disp );
+		virtual Uint32 GetType() { return RFB_ENCODING_TIGHT; }
+		virtual char const* GetName() { return RFB_ENCODING_NAME_TIGHT; }
+		virtual char const* GetDesc() { return RFB_ENCODING_DESC_TIGHT; }
+
+		virtual ~VNC_DECODER( TIGHT )();
+		virtual void Flush( Display& disp );
+		virtual void GetPseudoEncodings( std::vector< Uint32 >& encodings ) const;
+
+		//! Lets the server send JPEG rectangles, at a quality from 0 to 9.
+		/*!
+		  \param level JPEG quality level, or -1 to stay lossless
+		*/
+		void SetQualityLevel( int level ) { m_quality_level = level; }
+
+		struct Rect;   //!< a received rectangle waiting to be decoded
+		class Lane;    //!< a worker's share of the queued rectangles
+
+	private:
+		//! Decodes a queued rectangle.
+		/*!
+		  \param scratch the decoding lane's row buffers
+		*/
+		void Decode( Rect& r, Display& disp, std::vector< Uint8 >& scratch );
+
+		//! Queues a rectangle, or decodes it right away if there is no worker pool.
+		void Schedule( Rect* r, Display& disp );
+
+		//! Ends a flush's drawing, passing the display each queued rectangle.
+		void EndDrawing( Display& disp );
+
+		int m_quality_level;                            //!< JPEG quality to request, or -1
+		ZlibReader m_zlib_readers[RFB_TIGHT_STREAMS];   //!< the four zlib input streams
+		std::vector< Rect* > m_pending;                 //!< rectangles waiting for Flush, in order; in scratch memory
+		std::vector< Lane* > m_lanes;                   //!< lanes, kept for the next flush
+	};
+
+#if defined(VNC_HAVE_H264)
+	class VNC_DECODER( H264 ) : public Decoder
+	{
+	public:
+		// the usual interface, plus a constructor that sets up libavcodec
+		VNC_DECODER( H264 )( NetworkClient& net );
+		virtual void operator() ( ScreenRect const& rect, Display& disp );
+		virtual Uint32 GetType() { return RFB_ENCODING_H264; }
+		virtual char const* GetName() { return RFB_ENCODING_NAME_H264; }
+		virtual char const* GetDesc() { return RFB_ENCODING_DESC_H264; }
+
+		virtual ~VNC_DECODER( H264 )();
+
+		struct Context;   //!< one rectangle's video stream
+
+	private:
+		//! Finds the stream for a rectangle, starting a new one if needed.
+		/*!
+		  \param rect rectangle the stream covers
+		  \param reset true to throw away any existing stream first
+		  \returns the stream, now the most recently used
+		*/
+		Context* GetContext( ScreenRect const& rect, bool reset );
+
+		//! Drops every stream.
+		void ResetContexts();
+
+		std::vector< Context* > m_contexts;   //!< streams, most recently used first
+		std::vector< Uint8 > m_data;          //!< compressed data of the current rectangle
+		::AVPacket* m_packet;                 //!< libavcodec input wrapper
+		::AVFrame* m_frame;                   //!< libavcodec output frame
+	};
+#endif
 	
 };
 
@@ -32,38 +32,111 @@ namespace VNC
 		unsigned int green_shift;   //!< offset of green bits in pixel
 		unsigned int blue_shift;    //!< offset of blue bits in pixel
 		bool big_endian;            //!< use the one true byte order?
+		bool true_color;            //!< pixels hold their color, rather than a color map index
 	};
 
+	//! Checks whether pixels of two formats are stored the same way.
+	/*!
+	  The depth doesn't matter, only where each channel's bits are; a
+	  single byte has no byte order.
+	*/
+	inline bool SamePixelLayout( PixelFormat const& a, PixelFormat const& b )
+	{
+		return a.bytes == b.bytes &&
+			a.red_mask == b.red_mask && a.green_mask == b.green_mask && a.blue_mask == b.blue_mask &&
+			a.red_shift == b.red_shift && a.green_shift == b.green_shift && a.blue_shift == b.blue_shift &&
+			( a.bytes == 1 || a.big_endian == b.big_endian ) &&
+			a.true_color == b.true_color;
+	}
+
+	//! Checks whether pixels of a format can be drawn from their channels alone.
+	/*!
+	  Color mapped pixels need the server's color map, which isn't
+	  supported; a channel without bits can't be drawn either.
+	*/
+	inline bool IsTrueColor( PixelFormat const& fmt )
+	{
+		return fmt.true_color && fmt.red_mask != 0 && fmt.green_mask != 0 && fmt.blue_mask != 0;
+	}
+
 	// byte swapping macros
+#if defined(__GNUC__) || defined(__clang__)
+	/*! reverse the bytes of a 16-bit value (compiler intrinsic) */
+# define VNC_BYTESWAP_16(u16) ((Uint16)__builtin_bswap16(u16))
+	/*! reverse the bytes of a 32-bit value (compiler intrinsic) */
+# define VNC_BYTESWAP_32(u32) ((Uint32)__builtin_bswap32(u32))
+#else
+	/*! reverse the bytes of a 16-bit value */
+# define VNC_BYTESWAP_16(u16) ((Uint16)((((u16) & 0xFF00) >> 8) | (((u16) & 0xFF) << 8)))
+	/*! reverse the bytes of a 32-bit value */
+# define VNC_BYTESWAP_32(u32) ((Uint32)((((u32) & 0xFF000000) >> 24) | (((u32) & 0x00FF0000) >> 8) | (((u32) & 0x0000FF00) << 8) | (((u32) & 0x000000FF) << 24)))
+#endif
+
+	// host byte order, from the compiler unless the build sets VNC_LITTLE_ENDIAN or VNC_BIG_ENDIAN
+#if !defined(VNC_LITTLE_ENDIAN) && !defined(VNC_BIG_ENDIAN)
+# if defined(__BYTE_ORDER__) && defined(__ORDER_LITTLE_ENDIAN__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#  define VNC_LITTLE_ENDIAN
+# elif defined(__BYTE_ORDER__) && defined(__ORDER_BIG_ENDIAN__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#  define VNC_BIG_ENDIAN
+# elif defined(_WIN32) || defined(__i386__) || defined(__x86_64__) || defined(_M_IX86) || defined(_M_X64)
+#  define VNC_LITTLE_ENDIAN
+# elif defined(__BIG_ENDIAN__) || defined(__ppc__) || defined(__powerpc__)
+#  define VNC_BIG_ENDIAN
+# else
+#  error "unable to tell the host byte order; define VNC_LITTLE_ENDIAN or VNC_BIG_ENDIAN"
+# endif
+#elif defined(VNC_LITTLE_ENDIAN) && defined(VNC_BIG_ENDIAN)
+# error "VNC_LITTLE_ENDIAN and VNC_BIG_ENDIAN are both defined"
+#endif
+
 #if defined(VNC_LITTLE_ENDIAN)
 
+	/*! 1 if the host is big endian, 0 if it is little endian */
+# define VNC_HOST_BIG_ENDIAN 0
+
 	/*! swap 16-bit big endian to native byte order */
-# define VNC_SWAP_BE_16(u16) (((u16 & 0xFF00) >> 8) + ((u16 & 0xFF) << 8))
+# define VNC_SWAP_BE_16(u16) VNC_BYTESWAP_16(u16)
 
 	/*! swap 16-bit little endian to native byte order */	
 # define VNC_SWAP_LE_16(u16) (u16)
 
 	/*! swap 32-bit big endian to native byte order */
-# define VNC_SWAP_BE_32(u32) (((u32 & 0xFF000000) >> 24) + ((u32 & 0x00FF0000) >> 8) + ((u32 & 0x0000FF00) << 8) + ((u32 & 0x000000FF) << 24))
+# define VNC_SWAP_BE_32(u32) VNC_BYTESWAP_32(u32)
 	
 	/*! swap 32-bit little endian to native byte order */
 # define VNC_SWAP_LE_32(u32) (u32)
 
 #else  //--------------------------------------------------------
 
+	/*! 1 if the host is big endian, 0 if it is little endian */
+# define VNC_HOST_BIG_ENDIAN 1
+
 	/*! swap 16-bit little endian to native byte order */
-# define VNC_SWAP_LE_16(u16) (((u16 & 0xFF00) >> 8) + ((u16 & 0xFF) << 8))
+# define VNC_SWAP_LE_16(u16) VNC_BYTESWAP_16(u16)
 
 	/*! swap 16-bit big endian to native byte order */
 # define VNC_SWAP_BE_16(u16) (u16)
 
 	/*! swap 32-bit little endian to native byte order */
-# define VNC_SWAP_LE_32(u32) (((u32 & 0xFF000000) >> 24) + ((u32 & 0x00FF0000) >> 8) + ((u32 & 0x0000FF00) << 8) + ((u32 & 0x000000FF) << 24))
+# define VNC_SWAP_LE_32(u32) VNC_BYTESWAP_32(u32)
 
 	/*! swap 32-bit big endian to native byte order */
 # define VNC_SWAP_BE_32(u32) (u32)
 
 #endif
+
+	//! Byte swaps a pixel value of any size.
+	inline Uint8 SwapPixel( Uint8 pixel ) { return pixel; }
+	inline Uint16 SwapPixel( Uint16 pixel ) { return VNC_BYTESWAP_16( pixel ); }
+	inline Uint32 SwapPixel( Uint32 pixel ) { return VNC_BYTESWAP_32( pixel ); }
+
+	//! Puts a pixel value into the byte order of the display, or back.
+	/*!
+	  \param SWAP true if the display's byte order is not the host's; known
+	  at compile time, so the test costs nothing in a pixel loop
+	*/
+	template< bool SWAP, typename PIXEL >
+	inline PIXEL OrderPixel( PIXEL pixel ) { return SWAP ? SwapPixel( pixel ) : pixel; }
     	
 		
 	/*!
@@ -105,6 +178,34 @@ namespace VNC
 	//! Creates an exception reporting class.
 #define CREATE_VNC_EXCEPTION( name, msg ) \
 	class Exc##name : public Exc { public: Exc##name() : Exc( msg ) {} };
+
+	//! Pixel sizes and byte orders that decoders have loops specialized for.
+	enum PixelKernel
+	{
+		PIXEL_KERNEL_8,            //!< 1 byte pixels
+		PIXEL_KERNEL_16,           //!< 2 byte pixels in the host's byte order
+		PIXEL_KERNEL_16_SWAPPED,   //!< 2 byte pixels in the other byte order
+		PIXEL_KERNEL_32,           //!< 4 byte pixels in the host's byte order
+		PIXEL_KERNEL_32_SWAPPED    //!< 4 byte pixels in the other byte order
+	};
+
+	//! Picks the specialized loops for a pixel format.
+	/*!
+	  Decoders switch on this once per rectangle, so that their pixel loops
+	  are compiled for one pixel size and byte order and test neither.
+	  Throws Exc if the pixel size isn't supported.
+	*/
+	inline PixelKernel GetPixelKernel( PixelFormat const& fmt )
+	{
+		bool swap = fmt.big_endian != ( VNC_HOST_BIG_ENDIAN != 0 );
+		switch( fmt.bytes )
+		{
+		case 1:  return PIXEL_KERNEL_8;
+		case 2:  return swap ? PIXEL_KERNEL_16_SWAPPED : PIXEL_KERNEL_16;
+		case 4:  return swap ? PIXEL_KERNEL_32_SWAPPED : PIXEL_KERNEL_32;
+		default: throw Exc( "invalid color depth" );
+		}
+	}
 	
 };
 
@@ -1,8 +1,8 @@
 #include <iostream>
 #include <cstdlib>
 #include <cstring>
-#include <zlib.h>
 
+#include "vnc.h"
 #include "zlib-reader.h"
 
 using namespace std;
@@ -10,48 +10,110 @@ using namespace std;
 namespace VNC
 {
 
-	static voidpf ZAlloc( voidpf, uInt items, uInt size )
-	{
-		return malloc( items * size );
-	}
-
-	static void ZFree( voidpf, voidpf address )
-	{
-		free( address );
-	}
-	
 	ZlibReader::ZlibReader()
+		: m_inflater( GetDefaultInflateBackend().CreateInflater() ),
+		  m_net( NULL ),
+		  m_net_left( 0 ),
+		  m_out_pos( 0 ),
+		  m_out_len( 0 )
 	{
-		memset( &m_zs, 0, sizeof( m_zs ) );
-		m_zs.zalloc = ZAlloc;
-		m_zs.zfree = ZFree;
-		if( inflateInit( &m_zs ) != Z_OK )
-			throw Exc( "unable to initialize zlib" );
+		memset( &m_io, 0, sizeof( m_io ) );
 	}
 	
 	ZlibReader::~ZlibReader()
 	{
-		inflateEnd( &m_zs );
+		delete m_inflater;
 	}
 
 	void ZlibReader::SetStream( Uint8* input, int size )
 	{
 		//cerr << "stream has " << size << " bytes" << endl;
-		m_zs.next_in = (Bytef*)input;
-		m_zs.avail_in = size;
+		m_io.next_in = input;
+		m_io.avail_in = size;
+		m_net = NULL;
+		m_net_left = 0;
+		m_out_pos = m_out_len = 0;
 	}
 
-	void ZlibReader::ReadBytes( Uint8* buf, int length )
+	void ZlibReader::SetStream( NetworkClient& net, Uint32 size )
+	{
+		m_io.next_in = NULL;
+		m_io.avail_in = 0;
+		m_net = &net;
+		m_net_left = size;
+		m_out_pos = m_out_len = 0;
+	}
+
+	void ZlibReader::Finish()
+	{
+		while( m_io.avail_in > 0 || m_net_left > 0 )
+		{
+			if( m_io.avail_in == 0 )
+				Receive();
+			m_io.next_out = m_out;
+			m_io.avail_out = sizeof( m_out );
+			if( !m_inflater->Inflate( m_io ) )
+				throw Exc( "unable to decompress data" );
+		}
+		m_net = NULL;
+		m_out_pos = m_out_len = 0;
+	}
+
+	void ZlibReader::Receive()
 	{
-		m_zs.next_out = (Bytef*)buf;
-		m_zs.avail_out = length;
+		if( m_net_left == 0 )
+			throw Exc( "compressed data ended early" );
+		Uint32 amt = m_net_left < sizeof( m_in ) ? m_net_left : sizeof( m_in );
+		m_net->ReceiveBytes( m_in, amt );
+		m_net_left -= amt;
+		m_io.next_in = m_in;
+		m_io.avail_in = amt;
+	}
+
+	void ZlibReader::Inflate( bool all )
+	{
+		Uint32 start = m_io.avail_out;
 		do
 		{
-			if( inflate( &m_zs, Z_SYNC_FLUSH ) != Z_OK )
-			{
+			if( m_io.avail_in == 0 )
+				Receive();
+			if( !m_inflater->Inflate( m_io ) )
 				throw Exc( "unable to decompress data" );
-			}
-		} while( m_zs.next_out - (Uint8*)buf < length );
+		} while( all ? m_io.avail_out > 0 : m_io.avail_out == start );
+	}
+
+	void ZlibReader::Reset()
+	{
+		m_inflater->Reset();
+		m_out_pos = m_out_len = 0;
+	}
+
+	void ZlibReader::Fill()
+	{
+		m_io.next_out = m_out;
+		m_io.avail_out = sizeof( m_out );
+		m_out_pos = m_out_len = 0;
+		Inflate( false );
+		m_out_len = sizeof( m_out ) - m_io.avail_out;
+	}
+
+	void ZlibReader::ReadBytes( Uint8* buf, int length )
+	{
+		// use up what we've already decompressed
+		int amt = m_out_len - m_out_pos;
+		if( amt > length )
+			amt = length;
+		memcpy( buf, m_out + m_out_pos, amt );
+		m_out_pos += amt;
+		buf += amt;
+		length -= amt;
+		if( length == 0 )
+			return;
+
+		// decompress the rest straight into the caller's buffer
+		m_io.next_out = buf;
+		m_io.avail_out = length;
+		Inflate( true );
 	}
 	
 };
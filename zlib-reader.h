@@ -7,36 +7,92 @@
 #ifndef ZLIB_READER_H
 #define ZLIB_READER_H
 
-#include <zlib.h>
 #include "vnctypes.h"
+#include "inflate-backend.h"
 
 namespace VNC
 {
 
+	class NetworkClient;
+
 	class ZlibReader
 	{
 	
 	public:
 	
+		//! Creates a reader that inflates with the default backend.
 		ZlibReader();
 		~ZlibReader();
 
 		void SetStream( Uint8* input, int size );
+
+		//! Decompresses data straight off the network, receiving it a chunk at a time as it is needed.
+		/*!
+		  Call Finish once the rectangle is decoded, to use up the rest of its data.
+		  \param net connection to receive from
+		  \param size number of compressed bytes that belong to this stream segment
+		*/
+		void SetStream( NetworkClient& net, Uint32 size );
+
+		//! Inflates whatever is left of the current compressed data.
+		/*!
+		  Keeps the dictionary in step with the server's, and leaves the
+		  network positioned after the compressed data. Output nobody asked
+		  for is thrown away.
+		*/
+		void Finish();
+
+		//! Starts a new zlib stream, discarding the old dictionary.
+		void Reset();
 	
 		template< typename T >
 		void Read( T& val );
 		
 		void ReadBytes( Uint8* buf, int length );
+
+		//! Reads a single byte from the decompressed stream.
+		Uint8 ReadByte()
+		{
+			if( m_out_pos == m_out_len )
+				Fill();
+			return m_out[m_out_pos++];
+		}
 	
 	private:
 
-		z_stream  m_zs;    //!< zlib stream
+		// a reader owns its decompressor, so it isn't copied
+		ZlibReader( ZlibReader const& );
+		ZlibReader& operator=( ZlibReader const& );
+
+		//! Decompresses the next chunk of the stream into m_out.
+		void Fill();
+
+		//! Inflates into next_out until avail_out is used up, or at least some output is made.
+		/*!
+		  Every pass either consumes input or fails, so a bad stream can't spin forever.
+		  \param all true to fill the whole output space, false to stop after any output
+		*/
+		void Inflate( bool all );
+
+		//! Receives the next chunk of compressed data from the network.
+		void Receive();
+
+		Inflater* m_inflater;   //!< decompressor, from the default backend when this reader was made
+		InflateBuffers m_io;    //!< where the decompressor reads and writes next
+
+		NetworkClient* m_net;   //!< where compressed data comes from, or NULL if it was all handed over
+		Uint32 m_net_left;      //!< compressed bytes still to be received
+		Uint8 m_in[16384];      //!< compressed data received but not yet inflated
+
+		Uint8 m_out[16384];     //!< decompressed data not yet read
+		int m_out_pos;          //!< read position in m_out
+		int m_out_len;          //!< amount of valid data in m_out
 	};
 
 	template< typename T >
 	void ZlibReader::Read( T& val )
 	{
-		ReadBytes( &val, sizeof( val ) );
+		ReadBytes( (Uint8*)&val, sizeof( val ) );
 	}
 
 };